@@ -0,0 +1,324 @@
+/*
+ * Async File Description:
+ * A small C++20 coroutine library for driving many connections from one thread. A coroutine awaits
+ * connect, send and receive on an asyncSocket much like it would call the blocking functions:
+ *
+ *     asyncTask talk(struct reactor* loop, struct addrinfo* server) {
+ *         struct asyncSocket* socket = openAsyncSocket(loop, server->ai_family, server->ai_socktype, server->ai_protocol);
+ *         if (co_await asyncConnect(socket, server->ai_addr, server->ai_addrlen) == -1) { ... }
+ *         co_await asyncSend(socket, data, length);
+ *         co_await asyncReceive(socket, answer, sizeof(answer));
+ *         closeAsyncSocket(socket);
+ *     }
+ *
+ * Every operation is first tried right away on the non-blocking socket, and the coroutine only
+ * suspends when the kernel says EAGAIN (or EINPROGRESS for connect). A socket is added to the
+ * reactor's epoll set once, edge triggered for both directions, so waiting costs no epoll_ctl calls.
+ * runReactor() waits on epoll and, for every ready socket, retries the operation parked on it and
+ * resumes its coroutine once the operation is complete.
+ *
+ * A socket has at most one operation in flight (its coroutine awaits one thing at a time) and a
+ * coroutine only closes its own socket. Everything runs on the thread that calls runReactor(), so
+ * nothing here needs a lock. Needs -std=c++20.
+ */
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <sys/epoll.h>    // epoll_create1, epoll_ctl, epoll_wait
+#include <sys/socket.h>   // socket, connect, send, recv, sendmsg
+#include <sys/uio.h>      // iovec
+#include <unistd.h>       // close
+#include <errno.h>        // errno, EAGAIN, EINPROGRESS
+#include <limits.h>       // IOV_MAX
+
+#include <coroutine>
+#include <exception>      // std::terminate
+#include <cstring>
+
+struct reactor {
+	int epollDescriptor;
+	long sockets; // open asyncSockets, runReactor returns once this drops to zero
+	long syscalls; // socket syscalls made by the operations, plus the epoll_wait calls
+};
+
+struct asyncOperation;
+
+struct asyncSocket {
+	int descriptor;
+	struct reactor* owner;
+	struct asyncOperation* waiting; // the operation parked until the socket is ready, or NULL
+};
+
+enum asyncKind { ASYNC_CONNECT, ASYNC_SEND, ASYNC_SENDV, ASYNC_RECEIVE };
+
+// one connect, send or receive in progress, it lives in the frame of the coroutine awaiting it
+struct asyncOperation {
+	int kind;
+	struct asyncSocket* socket;
+	const struct sockaddr* address; // connect
+	socklen_t addressLength;
+	char* data; // send and receive
+	long length;
+	int flags;
+	struct iovec* segments; // sendv, trimmed as they go out
+	int count;
+	long done; // bytes moved so far
+	int error; // errno that ended the operation, 0 if it worked
+	std::coroutine_handle<> waiter;
+};
+
+inline bool initReactor(struct reactor* loop) {
+	loop->epollDescriptor = epoll_create1(0);
+	loop->sockets = 0;
+	loop->syscalls = 0;
+
+	return loop->epollDescriptor != -1;
+}
+
+/*
+ * Creates a non-blocking socket and adds it to the reactor. Returns NULL if the socket could not be
+ * created. Close it with closeAsyncSocket.
+ */
+inline struct asyncSocket* openAsyncSocket(struct reactor* loop, int family, int type, int protocol) {
+	int descriptor = socket(family, type | SOCK_NONBLOCK, protocol);
+
+	if (descriptor == -1) {
+		return NULL;
+	}
+
+	struct asyncSocket* socket = new asyncSocket;
+	socket->descriptor = descriptor;
+	socket->owner = loop;
+	socket->waiting = NULL;
+
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	event.data.ptr = socket;
+	epoll_ctl(loop->epollDescriptor, EPOLL_CTL_ADD, descriptor, &event);
+	loop->sockets++;
+
+	return socket;
+}
+
+inline void closeAsyncSocket(struct asyncSocket* socket) {
+	close(socket->descriptor); // closing also takes it out of the epoll set
+	socket->owner->sockets--;
+	delete socket;
+}
+
+/*
+ * Moves the operation along as far as the socket allows without blocking. Returns true once it is
+ * complete (or failed, with error set), false if it has to wait for the socket to become ready.
+ */
+inline bool attemptOperation(struct asyncOperation* operation) {
+	int descriptor = operation->socket->descriptor;
+	struct reactor* loop = operation->socket->owner;
+
+	switch (operation->kind) {
+	case ASYNC_CONNECT: {
+		// calling connect again is how a non-blocking connect is checked: EALREADY while it is still
+		// going, EISCONN once it worked, or the error it failed with
+		int result = connect(descriptor, operation->address, operation->addressLength);
+		loop->syscalls++;
+
+		if (result == 0 || errno == EISCONN) {
+			return true;
+		}
+		if (errno == EINPROGRESS || errno == EALREADY) {
+			return false;
+		}
+
+		operation->error = errno;
+		return true;
+	}
+
+	case ASYNC_SEND:
+		while (operation->done < operation->length) {
+			// MSG_NOSIGNAL so a server that resets one connection does not kill every simulated client with SIGPIPE
+			long written = send(descriptor, operation->data + operation->done, operation->length - operation->done,
+				operation->flags | MSG_NOSIGNAL);
+			loop->syscalls++;
+
+			if (written == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return false;
+				}
+				operation->error = errno;
+				return true;
+			}
+
+			operation->done += written;
+		}
+		return true;
+
+	case ASYNC_SENDV:
+		while (operation->count > 0) {
+			// sendmsg is writev with flags, see ASYNC_SEND for MSG_NOSIGNAL
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = operation->segments;
+			message.msg_iovlen = (operation->count < IOV_MAX) ? operation->count : IOV_MAX;
+
+			long written = sendmsg(descriptor, &message, MSG_NOSIGNAL);
+			loop->syscalls++;
+
+			if (written == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return false;
+				}
+				operation->error = errno;
+				return true;
+			}
+
+			operation->done += written;
+
+			// skip the segments that went out completely and trim the one that only partly did
+			while (operation->count > 0 && (size_t) written >= operation->segments->iov_len) {
+				written -= operation->segments->iov_len;
+				operation->segments++;
+				operation->count--;
+			}
+			if (written > 0) {
+				operation->segments->iov_base = (char*) operation->segments->iov_base + written;
+				operation->segments->iov_len -= written;
+			}
+		}
+		return true;
+
+	case ASYNC_RECEIVE:
+		while (operation->done < operation->length) {
+			long bytes = recv(descriptor, operation->data + operation->done, operation->length - operation->done, 0);
+			loop->syscalls++;
+
+			if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return false;
+			}
+			if (bytes <= 0) {
+				operation->error = (bytes == 0) ? ECONNRESET : errno; // the peer closed before all of it arrived
+				return true;
+			}
+
+			operation->done += bytes;
+		}
+		return true;
+	}
+
+	return true;
+}
+
+/*
+ * What co_await works on. The operation is tried as soon as it is awaited, and the coroutine is
+ * only suspended (and the operation parked on its socket) if it could not finish right away.
+ * co_await gives the number of bytes moved (0 for connect), or -1 if the operation failed.
+ */
+struct asyncAwaitable {
+	struct asyncOperation operation;
+
+	bool await_ready() {
+		return attemptOperation(&operation);
+	}
+
+	void await_suspend(std::coroutine_handle<> waiter) {
+		operation.waiter = waiter;
+		operation.socket->waiting = &operation;
+	}
+
+	long await_resume() {
+		return (operation.error != 0) ? -1 : operation.done;
+	}
+};
+
+inline struct asyncAwaitable makeAwaitable(int kind, struct asyncSocket* socket) {
+	struct asyncAwaitable awaitable = {}; // every field zero, the handle empty
+	awaitable.operation.kind = kind;
+	awaitable.operation.socket = socket;
+
+	return awaitable;
+}
+
+inline struct asyncAwaitable asyncConnect(struct asyncSocket* socket, const struct sockaddr* address, socklen_t addressLength) {
+	struct asyncAwaitable awaitable = makeAwaitable(ASYNC_CONNECT, socket);
+	awaitable.operation.address = address;
+	awaitable.operation.addressLength = addressLength;
+
+	return awaitable;
+}
+
+// sends all length bytes, flags go to send() (MSG_MORE for example)
+inline struct asyncAwaitable asyncSend(struct asyncSocket* socket, char* data, long length, int flags = 0) {
+	struct asyncAwaitable awaitable = makeAwaitable(ASYNC_SEND, socket);
+	awaitable.operation.data = data;
+	awaitable.operation.length = length;
+	awaitable.operation.flags = flags;
+
+	return awaitable;
+}
+
+// sends every segment, the segments are changed as they go out
+inline struct asyncAwaitable asyncSendv(struct asyncSocket* socket, struct iovec* segments, int count) {
+	struct asyncAwaitable awaitable = makeAwaitable(ASYNC_SENDV, socket);
+	awaitable.operation.segments = segments;
+	awaitable.operation.count = count;
+
+	return awaitable;
+}
+
+// receives exactly length bytes, a connection that closes before that is a failure
+inline struct asyncAwaitable asyncReceive(struct asyncSocket* socket, char* data, long length) {
+	struct asyncAwaitable awaitable = makeAwaitable(ASYNC_RECEIVE, socket);
+	awaitable.operation.data = data;
+	awaitable.operation.length = length;
+
+	return awaitable;
+}
+
+/*
+ * Return type of a coroutine the reactor drives. It starts running as soon as it is called, comes
+ * back to the caller at its first wait, and frees its own frame when it returns, so the caller just
+ * calls it and forgets about it.
+ */
+struct asyncTask {
+	struct promise_type {
+		asyncTask get_return_object() {
+			return asyncTask();
+		}
+		std::suspend_never initial_suspend() noexcept {
+			return std::suspend_never();
+		}
+		std::suspend_never final_suspend() noexcept {
+			return std::suspend_never();
+		}
+		void return_void() {
+		}
+		void unhandled_exception() {
+			std::terminate();
+		}
+	};
+};
+
+/*
+ * Waits on epoll and resumes the coroutines whose operations completed, until every asyncSocket of
+ * the reactor is closed.
+ */
+inline void runReactor(struct reactor* loop) {
+	const int MAXEVENTS = 256;
+	struct epoll_event events[MAXEVENTS];
+
+	while (loop->sockets > 0) {
+		int ready = epoll_wait(loop->epollDescriptor, events, MAXEVENTS, -1);
+		loop->syscalls++;
+
+		for (int i = 0; i < ready; i++) {
+			struct asyncSocket* socket = (struct asyncSocket*) events[i].data.ptr;
+			struct asyncOperation* operation = socket->waiting;
+
+			// the socket can be ready for the other direction than the one its operation waits for
+			if (operation != NULL && attemptOperation(operation)) {
+				socket->waiting = NULL;
+				operation->waiter.resume(); // may close and free the socket
+			}
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,841 @@
+/*
+ * Benchmark File Description:
+ * Starts the server binary once per server mode, then opens a given number of client connections
+ * against it from a set of client threads. Every client does the same thing client.cpp does with
+ * type 2 (connect, send iterations framed messages of 1500 bytes, wait for the acknowledgement,
+ * close). For each mode it prints how many connections per second the server got through and the
+ * p50/p99 ack latency, which is the time between a client finishing its writes and the
+ * acknowledgement arriving. It also prints the throughput in MB/s and how many socket syscalls the
+ * server needed per MB received, which the server reports when it is stopped.
+ *
+ * The modes are thread, pool, epoll and uring (the epoll mode with --backend=uring), and udp in the
+ * sweep.
+ *
+ * With --sweep=clientPath it instead runs the real client binary over a grid of points: every server
+ * mode, every buffer shape (nbufs x bufsize), every transfer type and every connection count (that
+ * many client processes at once, each sending iterations messages). Each point gets --warmup runs
+ * that are thrown away and then --repeat measured runs, and reports the median throughput with a
+ * 95% confidence interval, the round-trip time, and write syscalls per byte on the client and
+ * socket syscalls per byte on the server (read from the server's metrics endpoint on port + 1).
+ * All points are also written to a JSON file so runs from different commits can be diffed.
+ *
+ * Every point records the socket profile (see sockettuning.h) it ran with. The first form passes
+ * --profile to the server, the sweep runs every profile in --profiles on both sides.
+ *
+ * The udp mode (in --modes, sweep only) starts the server with --mode=udp and runs each shape as
+ * plain datagrams (client --udp) and with GSO (client --gso) instead of the transfer types. Those
+ * points also report packets/sec, the loss rate and the one-way latency, next to the TCP points of
+ * the same shapes.
+ *
+ * With --integrity every measured run of a point is followed by the same run with the clients'
+ * --verify (see checksum.h), so plain and checksummed runs see the same conditions, and the point
+ * reports the throughput with checksums and how much lower its median is. A checksummed run only
+ * counts if the client printed "integrity = ok", so it cannot be used against a --sink server.
+ *
+ * usage: benchmark serverPath port clients iterations [--concurrency=N] [--modes=thread,pool,epoll,uring] [--profile=name]
+ *        benchmark serverPath port clients iterations --sweep=clientPath [--modes=...,udp] [--shapes=1x1500,15x100,100x15,1500x1]
+ *                  [--types=1,2,3,4,5,6] [--connections=1,clients] [--profiles=default,latency,throughput]
+ *                  [--warmup=1] [--repeat=5] [--json=sweep.json] [--integrity]
+ */
+#include <sys/types.h>    // socket
+#include <sys/socket.h>   // socket, connect
+#include <sys/wait.h>     // waitpid
+#include <netinet/in.h>   // sockaddr_in
+#include <netdb.h>        // getaddrinfo
+#include <unistd.h>       // read, write, close, fork, execl
+#include <signal.h>       // kill
+#include <pthread.h>      // pthread_create, pthread_join
+#include <time.h>         // clock_gettime
+#include <math.h>         // sqrt
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "options.h"
+#include "protocol.h"
+
+using namespace std;
+
+const int BUFSIZE = 1500; // payload bytes per message
+
+// what each client thread needs to run its share of the connections
+struct clientThreadData {
+	struct addrinfo* server;
+	int iterations;
+	int connections; // how many connections this thread opens one after the other
+	vector<long> ackLatencies; // nanoseconds, one per successful connection
+	int failures;
+};
+
+// current time in nanoseconds from the monotonic clock (never jumps like gettimeofday can)
+long nowNanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// keeps calling write until all length bytes went out, returns false if the connection broke
+bool writeAll(int sd, const char* data, long length) {
+	while (length > 0) {
+		long written = write(sd, data, length);
+
+		if (written <= 0) {
+			return false;
+		}
+
+		data += written;
+		length -= written;
+	}
+
+	return true;
+}
+
+/*
+ * Runs one complete client exchange. message has room for a header followed by BUFSIZE bytes of
+ * payload. Returns the ack latency in nanoseconds, or -1 if any step failed.
+ */
+long runOneClient(struct addrinfo* server, int iterations, char* message) {
+	int sd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+
+	if (sd == -1) {
+		return -1;
+	}
+	if (connect(sd, server->ai_addr, server->ai_addrlen) == -1) {
+		close(sd);
+		return -1;
+	}
+
+	for (int i = 0; i < iterations; i++) {
+		encodeHeader(message, BUFSIZE, i, (i == iterations - 1) ? FLAG_LAST : 0);
+
+		if (!writeAll(sd, message, HEADERSIZE + BUFSIZE)) {
+			close(sd);
+			return -1;
+		}
+	}
+
+	long sent = nowNanoseconds();
+	int numReads = 0;
+	int ackBytes = read(sd, &numReads, sizeof(numReads));
+	long acked = nowNanoseconds();
+
+	close(sd);
+
+	if (ackBytes != sizeof(numReads)) {
+		return -1;
+	}
+
+	return acked - sent;
+}
+
+void* runClients(void* input) {
+	struct clientThreadData* data = (struct clientThreadData*)input;
+	char message[HEADERSIZE + BUFSIZE];
+	memset(message, 'a', sizeof(message));
+
+	for (int i = 0; i < data->connections; i++) {
+		long latency = runOneClient(data->server, data->iterations, message);
+
+		if (latency == -1) {
+			data->failures++;
+		}
+		else {
+			data->ackLatencies.push_back(latency);
+		}
+	}
+
+	return NULL;
+}
+
+// the server prints a line for every connection, so this keeps reading its output until it exits
+struct serverOutput {
+	int pipeDescriptor;
+	string lastLines; // only the tail is kept, that is where the syscall total ends up
+};
+
+void* drainServerOutput(void* input) {
+	struct serverOutput* output = (struct serverOutput*)input;
+	char chunk[4096];
+	int bytes;
+
+	while ((bytes = read(output->pipeDescriptor, chunk, sizeof(chunk))) > 0) {
+		output->lastLines.append(chunk, bytes);
+
+		if (output->lastLines.size() > 65536) {
+			output->lastLines.erase(0, output->lastLines.size() - 4096);
+		}
+	}
+
+	close(output->pipeDescriptor);
+	return NULL;
+}
+
+// runs path with the given arguments in a child process with its output going into outputPipe
+pid_t startProcess(const char* path, const vector<string>& arguments, int outputPipe) {
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		dup2(outputPipe, STDOUT_FILENO);
+
+		vector<char*> argv;
+		argv.push_back((char*) path);
+		for (size_t i = 0; i < arguments.size(); i++) {
+			argv.push_back((char*) arguments[i].c_str());
+		}
+		argv.push_back(NULL);
+
+		execv(path, argv.data());
+		_exit(EXIT_FAILURE); // only reached if exec failed
+	}
+
+	return pid;
+}
+
+// starts "serverPath port iterations --mode=mode [extra]" in a child process with its output going into outputPipe
+pid_t startServer(const char* serverPath, const char* port, const char* iterations, const string& mode, int outputPipe, const vector<string>& extra = vector<string>()) {
+	vector<string> arguments;
+	arguments.push_back(port);
+	arguments.push_back(iterations);
+	arguments.push_back((mode == "uring") ? "--backend=uring" : "--mode=" + mode);
+	arguments.insert(arguments.end(), extra.begin(), extra.end());
+
+	return startProcess(serverPath, arguments, outputPipe);
+}
+
+// splits "a,b,c" into its pieces
+vector<string> splitList(const string& list) {
+	vector<string> pieces;
+	size_t start = 0;
+
+	while (start <= list.size()) {
+		size_t comma = list.find(',', start);
+		pieces.push_back(list.substr(start, comma == string::npos ? string::npos : comma - start));
+		start = (comma == string::npos) ? list.size() + 1 : comma + 1;
+	}
+
+	return pieces;
+}
+
+// finds the number printed right after the last label in output, or -1 if it is not there
+long findNumber(const string& output, const string& label) {
+	size_t position = output.rfind(label);
+
+	if (position == string::npos) {
+		return -1;
+	}
+
+	return atol(output.c_str() + position + label.size());
+}
+
+// like findNumber for a number with decimals, or -1 if it is not there
+double findDecimal(const string& output, const string& label) {
+	size_t position = output.rfind(label);
+
+	if (position == string::npos) {
+		return -1;
+	}
+
+	return atof(output.c_str() + position + label.size());
+}
+
+// finds "socket syscalls = N" in what the server printed, or -1 if it is not there
+long findSyscalls(const string& output) {
+	return findNumber(output, "socket syscalls = ");
+}
+
+// returns the value at the given fraction (0.99 for p99) of a sorted list
+long percentile(const vector<long>& sorted, double fraction) {
+	if (sorted.empty()) {
+		return 0;
+	}
+
+	size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[index];
+}
+
+// what one batch of client processes running at the same time did
+struct clientBatch {
+	bool ok; // every client got its acknowledgement
+	long roundTrip; // longest round-trip time any of the clients reported, usec
+	long writeSyscalls; // added up over the clients
+	long datagramsSent; // these four only for --udp and --gso clients, added up over the clients
+	long datagramsReceived;
+	long packetsPerSecond;
+	double latencyP50; // highest one-way latency any of the clients reported, usec
+	double latencyP99;
+};
+
+/*
+ * Runs count copies of "clientPath port 127.0.0.1 iterations nbufs bufsize type --profile=profile" at
+ * once and waits for all of them. The clients time themselves, so the fork and exec do not end up
+ * in the numbers. extra flags go after those. A client given --verify that does not report its
+ * payloads arriving intact fails the batch.
+ */
+struct clientBatch runClientBatch(const char* clientPath, const char* port, int iterations, int nbufs, int bufsize, int type, int count, const string& profile,
+	const vector<string>& extra = vector<string>()) {
+	vector<string> arguments;
+	arguments.push_back(port);
+	arguments.push_back("127.0.0.1");
+	arguments.push_back(to_string(iterations));
+	arguments.push_back(to_string(nbufs));
+	arguments.push_back(to_string(bufsize));
+	arguments.push_back(to_string(type));
+	arguments.push_back("--profile=" + profile);
+	arguments.insert(arguments.end(), extra.begin(), extra.end());
+	bool verify = find(extra.begin(), extra.end(), "--verify") != extra.end();
+
+	vector<pid_t> pids;
+	vector<int> pipes;
+
+	for (int i = 0; i < count; i++) {
+		int outputPipe[2];
+		pipe(outputPipe);
+		pids.push_back(startProcess(clientPath, arguments, outputPipe[1]));
+		close(outputPipe[1]);
+		pipes.push_back(outputPipe[0]);
+	}
+
+	struct clientBatch batch;
+	batch.ok = true;
+	batch.roundTrip = 0;
+	batch.writeSyscalls = 0;
+	batch.datagramsSent = 0;
+	batch.datagramsReceived = 0;
+	batch.packetsPerSecond = 0;
+	batch.latencyP50 = 0;
+	batch.latencyP99 = 0;
+
+	// a client prints a few short lines, far less than a pipe holds, so reading them one after the other is fine
+	for (int i = 0; i < count; i++) {
+		string output;
+		char chunk[4096];
+		int bytes;
+
+		while ((bytes = read(pipes[i], chunk, sizeof(chunk))) > 0) {
+			output.append(chunk, bytes);
+		}
+
+		close(pipes[i]);
+		waitpid(pids[i], NULL, 0);
+
+		long roundTrip = findNumber(output, "round-trip time = ");
+		long syscalls = findNumber(output, "write syscalls = ");
+
+		if (roundTrip == -1 || syscalls == -1 || (verify && output.find("integrity = ok") == string::npos)) {
+			batch.ok = false;
+			continue;
+		}
+
+		batch.roundTrip = max(batch.roundTrip, roundTrip);
+		batch.writeSyscalls += syscalls;
+
+		// a datagram client also says what the server counted of its flow
+		if (output.find("datagrams sent = ") != string::npos) {
+			batch.datagramsSent += findNumber(output, "datagrams sent = ");
+			batch.datagramsReceived += findNumber(output, ", received = ");
+			batch.packetsPerSecond += findNumber(output, "packets/sec = ");
+			batch.latencyP50 = max(batch.latencyP50, findDecimal(output, "one-way latency p50 = "));
+			batch.latencyP99 = max(batch.latencyP99, findDecimal(output, ", p99 = "));
+		}
+	}
+
+	return batch;
+}
+
+// reads the server's syscall and received byte totals from its metrics endpoint, false if that failed
+bool scrapeServer(const char* metricsPort, long& syscalls, long& bytes) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* endpoint;
+
+	if (getaddrinfo("127.0.0.1", metricsPort, &hints, &endpoint) != 0) {
+		return false;
+	}
+
+	int sd = socket(endpoint->ai_family, endpoint->ai_socktype, endpoint->ai_protocol);
+	bool connected = sd != -1 && connect(sd, endpoint->ai_addr, endpoint->ai_addrlen) == 0;
+	freeaddrinfo(endpoint);
+
+	if (!connected) {
+		if (sd != -1) {
+			close(sd);
+		}
+		return false;
+	}
+
+	const char* request = "GET /metrics HTTP/1.0\r\n\r\n";
+	writeAll(sd, request, strlen(request));
+
+	string page;
+	char chunk[4096];
+	int received;
+
+	while ((received = read(sd, chunk, sizeof(chunk))) > 0) {
+		page.append(chunk, received);
+	}
+
+	close(sd);
+
+	syscalls = findNumber(page, "\nserver_socket_syscalls_total ");
+	bytes = findNumber(page, "\nserver_received_bytes_total ");
+
+	return syscalls != -1 && bytes != -1;
+}
+
+// median, mean and the 95% confidence interval of the mean of a set of measurements
+struct summary {
+	double median;
+	double mean;
+	double low;
+	double high;
+};
+
+struct summary summarize(vector<double> values) {
+	struct summary result;
+	result.median = result.mean = result.low = result.high = 0;
+
+	if (values.empty()) {
+		return result;
+	}
+
+	sort(values.begin(), values.end());
+	size_t n = values.size();
+	result.median = (n % 2 == 1) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+
+	double sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += values[i];
+	}
+	result.mean = sum / n;
+
+	if (n < 2) {
+		result.low = result.high = result.mean;
+		return result;
+	}
+
+	double squares = 0;
+	for (size_t i = 0; i < n; i++) {
+		squares += (values[i] - result.mean) * (values[i] - result.mean);
+	}
+
+	// Student's t for a two-sided 95% interval with n - 1 degrees of freedom, the normal 1.96 past 30
+	const double T95[] = { 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	double t = (n - 1 <= 30) ? T95[n - 2] : 1.96;
+	double halfWidth = t * sqrt(squares / (n - 1)) / sqrt((double) n);
+
+	result.low = result.mean - halfWidth;
+	result.high = result.mean + halfWidth;
+	return result;
+}
+
+// one point of the sweep and what was measured there
+struct sweepPoint {
+	string mode;
+	string transport; // tcp, udp or udp-gso
+	string profile; // socket profile the server and the clients used (see sockettuning.h)
+	int nbufs;
+	int bufsize;
+	int type;
+	int connections;
+	int runs; // measured runs that worked
+	int failures;
+	struct summary throughput; // MB/s
+	struct summary roundTrip; // usec
+	int verifiedRuns; // --integrity runs that worked, 0 without --integrity
+	struct summary verifiedThroughput; // MB/s with every payload checksummed
+	double integrityOverhead; // percent the median throughput drops with checksums
+	double clientSyscallsPerByte;
+	double serverSyscallsPerByte; // -1 if the metrics endpoint could not be read
+	struct summary packetsPerSecond; // udp points only, datagrams the clients sent per second
+	double lossPercent; // of every datagram sent in the measured runs
+	struct summary latencyP50; // one-way, usec
+	struct summary latencyP99;
+};
+
+void writeSummary(ofstream& out, const char* name, const struct summary& value) {
+	out << "\"" << name << "\": {\"median\": " << value.median << ", \"mean\": " << value.mean
+		<< ", \"ci95_low\": " << value.low << ", \"ci95_high\": " << value.high << "}";
+}
+
+bool writeSweepJson(const char* path, int iterations, const vector<sweepPoint>& points) {
+	ofstream out(path);
+
+	if (!out) {
+		return false;
+	}
+
+	out << "{" << endl << "  \"iterations\": " << iterations << "," << endl << "  \"points\": [" << endl;
+
+	for (size_t i = 0; i < points.size(); i++) {
+		const struct sweepPoint& point = points[i];
+
+		out << "    {\"mode\": \"" << point.mode << "\", \"transport\": \"" << point.transport << "\", \"profile\": \"" << point.profile << "\", \"nbufs\": " << point.nbufs << ", \"bufsize\": " << point.bufsize
+			<< ", \"type\": " << point.type << ", \"connections\": " << point.connections << ", \"runs\": " << point.runs
+			<< ", \"failures\": " << point.failures << ", ";
+		writeSummary(out, "throughput_mb_per_sec", point.throughput);
+		out << ", ";
+		writeSummary(out, "round_trip_usec", point.roundTrip);
+		if (point.verifiedRuns > 0) {
+			out << ", ";
+			writeSummary(out, "verified_throughput_mb_per_sec", point.verifiedThroughput);
+			out << ", \"integrity_overhead_percent\": " << point.integrityOverhead;
+		}
+		if (point.transport != "tcp") {
+			out << ", ";
+			writeSummary(out, "packets_per_sec", point.packetsPerSecond);
+			out << ", \"loss_percent\": " << point.lossPercent << ", ";
+			writeSummary(out, "one_way_latency_p50_usec", point.latencyP50);
+			out << ", ";
+			writeSummary(out, "one_way_latency_p99_usec", point.latencyP99);
+		}
+		out << ", \"client_syscalls_per_byte\": " << point.clientSyscallsPerByte
+			<< ", \"server_syscalls_per_byte\": " << point.serverSyscallsPerByte << "}"
+			<< (i + 1 < points.size() ? "," : "") << endl;
+	}
+
+	out << "  ]" << endl << "}" << endl;
+	return true;
+}
+
+/*
+ * The --sweep mode. Starts the server once per mode and socket profile (with its metrics endpoint on
+ * port + 1) and runs every shape, type and connection count against it, with the clients using the
+ * same profile. Returns false if a server never came up.
+ */
+bool runSweep(const char* serverPath, const char* clientPath, const char* port, const char* iterationsText, int iterations, int clients, const string& modes, int argc, char** argv) {
+	vector<string> shapes = splitList(getOption(argc, argv, "shapes", "1x1500,15x100,100x15,1500x1"));
+	vector<string> types = splitList(getOption(argc, argv, "types", "1,2,3,4,5,6"));
+	string defaultConnections = (clients > 1) ? "1," + to_string(clients) : "1";
+	vector<string> connectionCounts = splitList(getOption(argc, argv, "connections", defaultConnections.c_str()));
+	int warmup = getIntOption(argc, argv, "warmup", 1);
+	int repeat = getIntOption(argc, argv, "repeat", 5);
+	const char* jsonPath = getOption(argc, argv, "json", "sweep.json");
+	vector<string> profiles = splitList(getOption(argc, argv, "profiles", "default"));
+	bool integrity = getOption(argc, argv, "integrity", NULL) != NULL;
+
+	if (repeat < 1) {
+		repeat = 1;
+	}
+
+	string metricsPort = to_string(atoi(port) + 1);
+	vector<string> serverFlags;
+	serverFlags.push_back("--log=warn"); // keep the per-connection lines out of the pipe
+	serverFlags.push_back("--metrics=" + metricsPort);
+
+	vector<sweepPoint> points;
+	vector<string> modeList = splitList(modes);
+	bool allUp = true;
+
+	// every mode with every profile, each pair gets a fresh server
+	for (size_t k = 0; k < modeList.size() * profiles.size(); k++) {
+		string mode = modeList[k / profiles.size()];
+		string profile = profiles[k % profiles.size()];
+		vector<string> flags = serverFlags;
+		flags.push_back("--profile=" + profile);
+
+		int outputPipe[2];
+		pipe(outputPipe);
+		pid_t serverPid = startServer(serverPath, port, iterationsText, mode, outputPipe[1], flags);
+		close(outputPipe[1]);
+
+		struct serverOutput output;
+		output.pipeDescriptor = outputPipe[0];
+		pthread_t drainThread;
+		pthread_create(&drainThread, NULL, drainServerOutput, &output);
+
+		// the udp mode has no transfer types, its points send plain datagrams and GSO batches instead
+		bool datagrams = (mode == "udp");
+		vector<string> transfers = datagrams ? splitList("udp,gso") : types;
+		vector<string> probeFlags = datagrams ? vector<string>(1, "--udp") : vector<string>();
+
+		bool up = false;
+		for (int attempt = 0; attempt < 500 && !up; attempt++) {
+			up = runClientBatch(clientPath, port, 1, 1, datagrams ? 64 : 1, 2, 1, profile, probeFlags).ok;
+			if (!up) {
+				usleep(10000);
+			}
+		}
+
+		if (!up) {
+			cout << mode << " " << profile << ": server never came up" << endl;
+			allUp = false;
+		}
+
+		for (size_t s = 0; s < shapes.size() && up; s++) {
+			int nbufs = 0;
+			int bufsize = 0;
+
+			if (sscanf(shapes[s].c_str(), "%dx%d", &nbufs, &bufsize) != 2 || nbufs < 1 || bufsize < 1) {
+				cout << "shapes look like 15x100 (nbufs x bufsize), skipping " << shapes[s] << endl;
+				continue;
+			}
+
+			for (size_t t = 0; t < transfers.size(); t++) {
+				vector<string> clientFlags = datagrams ? vector<string>(1, "--" + transfers[t]) : vector<string>();
+				vector<string> verifyFlags = clientFlags;
+				verifyFlags.push_back("--verify");
+
+				for (size_t c = 0; c < connectionCounts.size(); c++) {
+					struct sweepPoint point;
+					point.mode = mode;
+					point.transport = !datagrams ? "tcp" : (transfers[t] == "gso") ? "udp-gso" : "udp";
+					point.profile = profile;
+					point.nbufs = nbufs;
+					point.bufsize = bufsize;
+					point.type = datagrams ? 0 : atoi(transfers[t].c_str());
+					point.connections = max(1, atoi(connectionCounts[c].c_str()));
+					point.runs = 0;
+					point.failures = 0;
+					point.verifiedRuns = 0;
+					point.integrityOverhead = 0;
+
+					// the client still wants a type with --udp even though it does not use it, the probe's 2 will do
+					int clientType = datagrams ? 2 : point.type;
+
+					for (int i = 0; i < warmup; i++) {
+						runClientBatch(clientPath, port, iterations, nbufs, bufsize, clientType, point.connections, profile, clientFlags);
+					}
+
+					vector<double> throughputs;
+					vector<double> roundTrips;
+					vector<double> verifiedThroughputs;
+					vector<double> packetRates;
+					vector<double> latencyP50s;
+					vector<double> latencyP99s;
+					long datagramsSent = 0;
+					long datagramsReceived = 0;
+					long clientSyscalls = 0;
+					long serverSyscalls = 0;
+					long serverBytes = 0;
+					bool scraped = true;
+					double bytesPerRun = (double) iterations * nbufs * bufsize * point.connections;
+
+					for (int i = 0; i < repeat; i++) {
+						long syscallsBefore = 0, bytesBefore = 0, syscallsAfter = 0, bytesAfter = 0;
+						scraped = scrapeServer(metricsPort.c_str(), syscallsBefore, bytesBefore) && scraped;
+						struct clientBatch batch = runClientBatch(clientPath, port, iterations, nbufs, bufsize, clientType, point.connections, profile, clientFlags);
+						scraped = scrapeServer(metricsPort.c_str(), syscallsAfter, bytesAfter) && scraped;
+
+						if (!batch.ok || batch.roundTrip <= 0) {
+							point.failures++;
+							continue;
+						}
+
+						// every client ran at the same time, so the batch took about as long as its slowest client
+						point.runs++;
+						throughputs.push_back(bytesPerRun / batch.roundTrip); // bytes per usec is MB/s
+						roundTrips.push_back(batch.roundTrip);
+						clientSyscalls += batch.writeSyscalls;
+						serverSyscalls += syscallsAfter - syscallsBefore;
+						serverBytes += bytesAfter - bytesBefore;
+
+						if (datagrams) {
+							packetRates.push_back(batch.packetsPerSecond);
+							latencyP50s.push_back(batch.latencyP50);
+							latencyP99s.push_back(batch.latencyP99);
+							datagramsSent += batch.datagramsSent;
+							datagramsReceived += batch.datagramsReceived;
+						}
+
+						// datagrams are not checksummed, so the udp points have no integrity runs
+						if (integrity && !datagrams) {
+							struct clientBatch verified = runClientBatch(clientPath, port, iterations, nbufs, bufsize, clientType, point.connections, profile, verifyFlags);
+
+							if (!verified.ok || verified.roundTrip <= 0) {
+								point.failures++;
+								continue;
+							}
+
+							point.verifiedRuns++;
+							verifiedThroughputs.push_back(bytesPerRun / verified.roundTrip);
+						}
+					}
+
+					point.throughput = summarize(throughputs);
+					point.roundTrip = summarize(roundTrips);
+					point.verifiedThroughput = summarize(verifiedThroughputs);
+					point.packetsPerSecond = summarize(packetRates);
+					point.lossPercent = (datagramsSent == 0) ? 0 : 100.0 * (datagramsSent - datagramsReceived) / datagramsSent;
+					point.latencyP50 = summarize(latencyP50s);
+					point.latencyP99 = summarize(latencyP99s);
+					if (point.verifiedRuns > 0 && point.throughput.median > 0) {
+						point.integrityOverhead = 100 * (1 - point.verifiedThroughput.median / point.throughput.median);
+					}
+					point.clientSyscallsPerByte = (point.runs == 0) ? 0 : clientSyscalls / (bytesPerRun * point.runs);
+					point.serverSyscallsPerByte = (!scraped || serverBytes == 0) ? -1 : (double) serverSyscalls / serverBytes;
+					points.push_back(point);
+
+					cout << point.mode << " " << profile << " " << nbufs << "x" << bufsize << " " << (datagrams ? point.transport : "type " + to_string(point.type))
+						<< " x" << point.connections << ": "
+						<< point.throughput.median << " MB/s (95% CI " << point.throughput.low << " - " << point.throughput.high
+						<< "), round trip " << point.roundTrip.median << " usec, syscalls per byte client = " << point.clientSyscallsPerByte
+						<< ", server = " << point.serverSyscallsPerByte;
+					if (datagrams) {
+						cout << ", " << (long) point.packetsPerSecond.median << " packets/sec, loss = " << point.lossPercent << "%, one-way latency p50 = "
+							<< point.latencyP50.median << " usec, p99 = " << point.latencyP99.median << " usec";
+					}
+					if (point.verifiedRuns > 0) {
+						cout << ", with checksums " << point.verifiedThroughput.median << " MB/s (integrity overhead = " << point.integrityOverhead << "%)";
+					}
+					cout << ", failures = " << point.failures << endl;
+				}
+			}
+		}
+
+		kill(serverPid, SIGTERM);
+		waitpid(serverPid, NULL, 0);
+		pthread_join(drainThread, NULL);
+	}
+
+	if (!writeSweepJson(jsonPath, iterations, points)) {
+		cout << "Could not write the results to " << jsonPath << endl;
+		return false;
+	}
+
+	cout << "results written to " << jsonPath << endl;
+	return allUp;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 5) {
+		cout << "usage: benchmark serverPath port clients iterations [--concurrency=N] [--modes=thread,pool,epoll,uring] [--profile=name]" << endl;
+		cout << "       benchmark serverPath port clients iterations --sweep=clientPath [--modes=...,udp] [--shapes=1x1500,15x100,100x15,1500x1]" << endl;
+		cout << "                 [--types=1,2,3,4,5,6] [--connections=1,clients] [--profiles=default,latency,throughput]" << endl;
+		cout << "                 [--warmup=1] [--repeat=5] [--json=sweep.json] [--integrity]" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	char* serverPath = argv[1];
+	char* port = argv[2];
+	int clients = atoi(argv[3]);
+	int iterations = atoi(argv[4]);
+	int concurrency = getIntOption(argc, argv, "concurrency", 64);
+	string modes = getOption(argc, argv, "modes", "thread,pool,epoll,uring");
+	string profile = getOption(argc, argv, "profile", "default"); // socket profile for the server (see sockettuning.h)
+
+	if (concurrency < 1) {
+		concurrency = 1;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	struct addrinfo* server;
+
+	if (getaddrinfo("127.0.0.1", port, &hints, &server) != 0) {
+		cout << "Could not translate loopback address with the given port" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	char message[HEADERSIZE + BUFSIZE];
+	memset(message, 'a', sizeof(message));
+
+	const char* clientPath = getOption(argc, argv, "sweep", NULL);
+
+	if (clientPath != NULL) {
+		bool ok = runSweep(serverPath, clientPath, port, argv[4], iterations, clients, modes, argc, argv);
+		freeaddrinfo(server);
+		return ok ? 0 : 1;
+	}
+
+	vector<string> modeList = splitList(modes);
+
+	for (size_t m = 0; m < modeList.size(); m++) {
+		string mode = modeList[m];
+
+		if (mode == "udp") {
+			cout << "udp: only runs in the --sweep form, the clients built in here speak TCP" << endl;
+			continue;
+		}
+
+		int outputPipe[2];
+		pipe(outputPipe);
+		vector<string> flags(1, "--profile=" + profile);
+		pid_t serverPid = startServer(serverPath, port, argv[4], mode, outputPipe[1], flags);
+		close(outputPipe[1]);
+
+		struct serverOutput output;
+		output.pipeDescriptor = outputPipe[0];
+		pthread_t drainThread;
+		pthread_create(&drainThread, NULL, drainServerOutput, &output);
+
+		// wait until the server answers a full exchange, which also serves as the warmup
+		bool up = false;
+		for (int attempt = 0; attempt < 500 && !up; attempt++) {
+			up = runOneClient(server, iterations, message) != -1;
+			if (!up) {
+				usleep(10000);
+			}
+		}
+
+		if (!up) {
+			cout << mode << ": server never came up" << endl;
+			kill(serverPid, SIGKILL);
+			waitpid(serverPid, NULL, 0);
+			pthread_join(drainThread, NULL);
+			continue;
+		}
+
+		// hand every thread an even share of the connections
+		vector<clientThreadData> threadData(concurrency);
+		vector<pthread_t> threads(concurrency);
+
+		for (int i = 0; i < concurrency; i++) {
+			threadData[i].server = server;
+			threadData[i].iterations = iterations;
+			threadData[i].connections = clients / concurrency + (i < clients % concurrency ? 1 : 0);
+			threadData[i].failures = 0;
+		}
+
+		long start = nowNanoseconds();
+		for (int i = 0; i < concurrency; i++) {
+			pthread_create(&threads[i], NULL, runClients, &threadData[i]);
+		}
+		for (int i = 0; i < concurrency; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		long elapsed = nowNanoseconds() - start;
+
+		kill(serverPid, SIGTERM);
+		waitpid(serverPid, NULL, 0);
+		pthread_join(drainThread, NULL);
+
+		vector<long> latencies;
+		int failures = 0;
+		for (int i = 0; i < concurrency; i++) {
+			latencies.insert(latencies.end(), threadData[i].ackLatencies.begin(), threadData[i].ackLatencies.end());
+			failures += threadData[i].failures;
+		}
+		sort(latencies.begin(), latencies.end());
+
+		double connectionsPerSecond = latencies.size() / (elapsed / 1e9);
+		double megabytes = (double) latencies.size() * iterations * BUFSIZE / 1e6;
+		double warmupMegabytes = (double) iterations * BUFSIZE / 1e6; // the server counted the warmup exchange too
+		long syscalls = findSyscalls(output.lastLines);
+
+		cout << mode << " (profile " << profile << "): " << latencies.size() << " connections in " << elapsed / 1000 << " usec, "
+			<< (long) connectionsPerSecond << " connections/sec, ack latency p50 = " << percentile(latencies, 0.50) / 1000
+			<< " usec, p99 = " << percentile(latencies, 0.99) / 1000 << " usec, failures = " << failures << endl;
+		cout << mode << " (profile " << profile << "): throughput = " << megabytes / (elapsed / 1e9) << " MB/s, server syscalls per MB = ";
+		if (syscalls == -1) {
+			cout << "unknown" << endl;
+		}
+		else {
+			cout << syscalls / (megabytes + warmupMegabytes) << endl;
+		}
+	}
+
+	freeaddrinfo(server);
+
+	return 0;
+}
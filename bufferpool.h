@@ -0,0 +1,230 @@
+/*
+ * Buffer Pool File Description:
+ * Where the client and the server get their data buffers from, instead of the stack or plain new.
+ *
+ * Buffers come in power of two size classes from one cache line (64 bytes) up to 1 MB. Every class
+ * is carved out of 2 MB slabs that are mapped with mmap and touched up front, so a
+ * buffer is always at least cache-line aligned, a buffer of 4 KB or more is page aligned, and the
+ * hot loops do not take page faults the first time they write into a buffer. With hugepages turned
+ * on the slabs are asked for as 2 MB huge pages (falling back to transparent huge pages, and then
+ * to normal pages, when the system has none to give), which also cuts TLB misses.
+ *
+ * Each thread keeps its own free list per class, so allocating and freeing is a pointer pop or push
+ * with no lock. Only when a thread's list runs empty or grows too long does it move a batch of
+ * buffers from or to the shared lists under a mutex. Anything over 1 MB gets its own mapping.
+ *
+ * Freeing takes the size that was asked for, the same way the buffer was allocated, so buffers need
+ * no header in front of them and keep their alignment.
+ */
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <sys/mman.h>     // mmap, munmap, madvise
+#include <pthread.h>      // pthread_mutex_lock
+#include <stddef.h>
+#include <stdlib.h>       // abort
+
+#include <atomic>
+
+const size_t CACHELINE = 64;
+const size_t POOL_SLAB_SIZE = 2 * 1024 * 1024; // one huge page
+const int POOL_SMALLEST_SHIFT = 6; // 64 bytes
+const int POOL_LARGEST_SHIFT = 20; // 1 MB, bigger buffers are mapped on their own
+const int POOL_CLASSES = POOL_LARGEST_SHIFT - POOL_SMALLEST_SHIFT + 1;
+const int POOL_BATCH = 32; // buffers moved between a thread and the shared lists at once
+
+// a free buffer holds the pointer to the next free buffer of its class in its first bytes
+struct poolBlock {
+	struct poolBlock* next;
+};
+
+struct sharedPool {
+	pthread_mutex_t lock;
+	struct poolBlock* free[POOL_CLASSES];
+	std::atomic<bool> hugepages;
+};
+
+inline struct sharedPool* getSharedPool() {
+	static struct sharedPool pool = { PTHREAD_MUTEX_INITIALIZER, {}, {false} };
+	return &pool;
+}
+
+// turns hugepage backing on or off, must be called at startup before the first buffer is allocated
+inline void setPoolHugepages(bool enabled) {
+	getSharedPool()->hugepages.store(enabled, std::memory_order_relaxed);
+}
+
+// maps length bytes (a multiple of the page size), using huge pages if they are turned on
+inline char* mapPoolMemory(size_t length) {
+	void* memory = MAP_FAILED;
+	bool hugepages = getSharedPool()->hugepages.load(std::memory_order_relaxed);
+
+	if (hugepages && length % POOL_SLAB_SIZE == 0) {
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	}
+
+	if (memory == MAP_FAILED) {
+		memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (memory == MAP_FAILED) {
+			abort(); // the same thing new does when it runs out, minus the exception nobody here catches
+		}
+
+		if (hugepages) {
+			madvise(memory, length, MADV_HUGEPAGE); // no reserved huge pages, ask for transparent ones
+		}
+
+		// fault every page in now rather than in the middle of a timed loop
+		madvise(memory, length, MADV_WILLNEED);
+		for (size_t offset = 0; offset < length; offset += 4096) {
+			((volatile char*) memory)[offset] = 0;
+		}
+	}
+
+	return (char*) memory;
+}
+
+// the class a size falls into, or -1 if it is too big for the slabs
+inline int poolClass(size_t size) {
+	int shift = POOL_SMALLEST_SHIFT;
+
+	while (((size_t) 1 << shift) < size) {
+		shift++;
+	}
+
+	return (shift > POOL_LARGEST_SHIFT) ? -1 : shift - POOL_SMALLEST_SHIFT;
+}
+
+inline size_t poolClassSize(int sizeClass) {
+	return (size_t) 1 << (sizeClass + POOL_SMALLEST_SHIFT);
+}
+
+/*
+ * The free lists of one thread. When the thread ends its destructor hands every buffer back to the
+ * shared lists, so the thread mode (a thread per connection) does not leak them.
+ */
+struct threadPool {
+	struct poolBlock* free[POOL_CLASSES];
+	int count[POOL_CLASSES];
+
+	threadPool() {
+		for (int i = 0; i < POOL_CLASSES; i++) {
+			free[i] = NULL;
+			count[i] = 0;
+		}
+	}
+
+	~threadPool() {
+		for (int i = 0; i < POOL_CLASSES; i++) {
+			giveBack(i, count[i]);
+		}
+	}
+
+	// moves up to blocks buffers of a class to the shared lists
+	void giveBack(int sizeClass, int blocks) {
+		struct sharedPool* shared = getSharedPool();
+
+		pthread_mutex_lock(&shared->lock);
+		for (int i = 0; i < blocks && free[sizeClass] != NULL; i++) {
+			struct poolBlock* block = free[sizeClass];
+			free[sizeClass] = block->next;
+			count[sizeClass]--;
+
+			block->next = shared->free[sizeClass];
+			shared->free[sizeClass] = block;
+		}
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+	// gets a batch of buffers of a class from the shared lists, carving a new slab into them if they are empty
+	void refill(int sizeClass) {
+		struct sharedPool* shared = getSharedPool();
+
+		pthread_mutex_lock(&shared->lock);
+
+		if (shared->free[sizeClass] == NULL) {
+			// the slab is never unmapped, its buffers just keep going around the free lists
+			char* slab = mapPoolMemory(POOL_SLAB_SIZE);
+			size_t size = poolClassSize(sizeClass);
+
+			for (size_t offset = POOL_SLAB_SIZE; offset >= size; offset -= size) {
+				struct poolBlock* block = (struct poolBlock*) (slab + offset - size);
+				block->next = shared->free[sizeClass];
+				shared->free[sizeClass] = block; // lowest address ends up first
+			}
+		}
+
+		for (int i = 0; i < POOL_BATCH && shared->free[sizeClass] != NULL; i++) {
+			struct poolBlock* block = shared->free[sizeClass];
+			shared->free[sizeClass] = block->next;
+
+			block->next = free[sizeClass];
+			free[sizeClass] = block;
+			count[sizeClass]++;
+		}
+
+		pthread_mutex_unlock(&shared->lock);
+	}
+};
+
+inline struct threadPool& getThreadPool() {
+	static thread_local struct threadPool pool;
+	return pool;
+}
+
+// the page size rounded length of a buffer that is mapped on its own
+inline size_t poolLargeLength(size_t size) {
+	size_t unit = getSharedPool()->hugepages.load(std::memory_order_relaxed) ? POOL_SLAB_SIZE : 4096;
+	return (size + unit - 1) / unit * unit;
+}
+
+/*
+ * Returns a buffer of at least size bytes, cache-line aligned (page aligned from 4 KB up).
+ * Give it back with poolFree and the same size.
+ */
+inline char* poolAllocate(size_t size) {
+	int sizeClass = poolClass(size);
+
+	if (sizeClass == -1) {
+		return mapPoolMemory(poolLargeLength(size));
+	}
+
+	struct threadPool& pool = getThreadPool();
+
+	if (pool.free[sizeClass] == NULL) {
+		pool.refill(sizeClass);
+	}
+
+	struct poolBlock* block = pool.free[sizeClass];
+	pool.free[sizeClass] = block->next;
+	pool.count[sizeClass]--;
+
+	return (char*) block;
+}
+
+inline void poolFree(void* buffer, size_t size) {
+	if (buffer == NULL) {
+		return;
+	}
+
+	int sizeClass = poolClass(size);
+
+	if (sizeClass == -1) {
+		munmap(buffer, poolLargeLength(size));
+		return;
+	}
+
+	struct threadPool& pool = getThreadPool();
+	struct poolBlock* block = (struct poolBlock*) buffer;
+
+	block->next = pool.free[sizeClass];
+	pool.free[sizeClass] = block;
+	pool.count[sizeClass]++;
+
+	// a thread that frees more than it allocates (it got the buffers from another thread) passes the extra on
+	if (pool.count[sizeClass] > 4 * POOL_BATCH) {
+		pool.giveBack(sizeClass, 2 * POOL_BATCH);
+	}
+}
+
+#endif
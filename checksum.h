@@ -0,0 +1,327 @@
+/*
+ * Checksum File Description:
+ * CRC32C (the Castagnoli polynomial, the one iSCSI, ext4 and SCTP use) for the integrity mode,
+ * where the server checksums every payload it receives and returns the digest in its
+ * acknowledgement (see FLAG_CHECKSUM in protocol.h).
+ *
+ * On x86-64 with SSE4.2 the crc32 instruction takes in 8 bytes at a time. It needs 3 cycles to
+ * finish but a new one can start every cycle, so a long buffer is cut into three blocks whose CRCs
+ * are computed side by side and then joined. Joining uses the fact that the CRC of A followed by B
+ * is the CRC of A pushed through len(B) zero bytes, xored with the CRC of B on its own. Pushing
+ * through a fixed number of zeros is linear, so it is four table lookups (one per byte of the CRC)
+ * with a table built once per block size. Other machines, and CPUs without SSE4.2, use the classic
+ * table-driven loop, which is correct but an order of magnitude slower.
+ *
+ * That still tops out at 8 bytes a cycle, and the server has to checksum at the rate the loopback
+ * device delivers, so CPUs with AVX-512 and VPCLMULQDQ take long buffers 256 bytes at a time with
+ * carry-less multiplies instead. Sixteen 16 byte blocks are kept in four registers. Each round
+ * multiplies every block by x^2048 modulo the polynomial (two 64 x 32 bit carry-less multiplies,
+ * one per half, with a precomputed constant) and xors in the block 256 bytes further on, which
+ * leaves the CRC of the whole unchanged. At the end the sixteen blocks are folded into one the same
+ * way, and the crc32 instruction finishes that block and the last few bytes.
+ *
+ * crc32c(crc, data, length) continues crc over data, starting from 0, so calling it on the pieces of
+ * a message one after the other gives the CRC of the whole message.
+ */
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>    // _mm_crc32_u64, _mm_crc32_u8, _mm512_clmulepi64_epi128
+#endif
+
+const uint32_t CRC32C_POLYNOMIAL = 0x82F63B78; // bit reversed, since the CRC works from the lowest bit up
+const size_t CRC32C_LONG = 8192; // block size for the three streams on long buffers
+const size_t CRC32C_SHORT = 256; // and on what is left after those
+const size_t CRC32C_FOLD = 256; // bytes a round of the carry-less multiply loop takes in
+
+/*
+ * Multiplies a and b as polynomials over GF(2) modulo the CRC polynomial, bit reversed like the
+ * CRC itself (bit 31 is x^0).
+ */
+inline uint32_t multiplyModPolynomial(uint32_t a, uint32_t b) {
+	uint32_t product = 0;
+
+	for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1) {
+		if (a & bit) {
+			product ^= b;
+		}
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLYNOMIAL : b >> 1;
+	}
+
+	return product;
+}
+
+// x^bits modulo the polynomial
+inline uint32_t xPowerModPolynomial(uint64_t bits) {
+	uint32_t result = 1u << 31; // x^0
+	uint32_t power = 1u << 30; // x^1
+
+	while (bits > 0) {
+		if (bits & 1) {
+			result = multiplyModPolynomial(power, result);
+		}
+		power = multiplyModPolynomial(power, power);
+		bits >>= 1;
+	}
+
+	return result;
+}
+
+// x^(8 * bytes) modulo the polynomial, which is what running a CRC over that many zero bytes multiplies it by
+inline uint32_t zeroBytesOperator(size_t bytes) {
+	return xPowerModPolynomial(8 * (uint64_t) bytes);
+}
+
+struct crc32cTables {
+	uint32_t bytewise[256]; // for the table-driven loop
+	uint32_t longShift[4][256]; // pushes a CRC through CRC32C_LONG zero bytes
+	uint32_t shortShift[4][256]; // and through CRC32C_SHORT
+	uint64_t fold[5][2]; // carry-less multiply constants that move a 16 byte block 256, 64, 48, 32 and 16 bytes on
+};
+
+/*
+ * Constants that move a 16 byte block bits further into the message. The first half of the block
+ * (the higher powers of x, the CRC is bit reversed) is multiplied by x^(64 + bits) and the second
+ * half by x^bits, each reduced to 32 bits and placed in the high half of a bit reversed 64 bit word.
+ * A carry-less multiply of two bit reversed words comes out one bit short, hence the - 1.
+ */
+inline void buildFoldConstants(uint64_t constants[2], uint64_t bits) {
+	constants[0] = (uint64_t) xPowerModPolynomial(bits + 64 - 1) << 32;
+	constants[1] = (uint64_t) xPowerModPolynomial(bits - 1) << 32;
+}
+
+inline void buildShiftTable(uint32_t table[4][256], size_t bytes) {
+	uint32_t shift = zeroBytesOperator(bytes);
+
+	for (int position = 0; position < 4; position++) {
+		for (uint32_t value = 0; value < 256; value++) {
+			table[position][value] = multiplyModPolynomial(shift, value << (8 * position));
+		}
+	}
+}
+
+inline struct crc32cTables* buildCrc32cTables() {
+	struct crc32cTables* tables = new crc32cTables;
+
+	for (uint32_t value = 0; value < 256; value++) {
+		uint32_t crc = value;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		}
+		tables->bytewise[value] = crc;
+	}
+
+	buildShiftTable(tables->longShift, CRC32C_LONG);
+	buildShiftTable(tables->shortShift, CRC32C_SHORT);
+
+	const size_t foldBytes[5] = { CRC32C_FOLD, 64, 48, 32, 16 };
+	for (int i = 0; i < 5; i++) {
+		buildFoldConstants(tables->fold[i], 8 * foldBytes[i]);
+	}
+	return tables;
+}
+
+// built on first use (C++ makes that thread safe) and kept, 12 KB
+inline const struct crc32cTables& getCrc32cTables() {
+	static struct crc32cTables* tables = buildCrc32cTables();
+	return *tables;
+}
+
+inline uint32_t shiftCrc(const uint32_t table[4][256], uint32_t crc) {
+	return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+/*
+ * The CRC of A followed by B, given the CRC of each and the length of B. Lets a digest over many
+ * messages be built from the CRCs of the messages.
+ */
+inline uint32_t crc32cCombine(uint32_t crcA, uint32_t crcB, size_t lengthB) {
+	return multiplyModPolynomial(zeroBytesOperator(lengthB), crcA) ^ crcB;
+}
+
+// table-driven CRC of the raw register (no inversions)
+inline uint32_t crc32cSoftware(uint32_t crc, const unsigned char* data, size_t length) {
+	const struct crc32cTables& tables = getCrc32cTables();
+
+	for (size_t i = 0; i < length; i++) {
+		crc = tables.bytewise[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+inline bool crc32cHardware() {
+	static bool supported = __builtin_cpu_supports("sse4.2");
+	return supported;
+}
+
+// runs three blocks of blockSize bytes side by side, data must have 3 * blockSize bytes
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cThreeBlocks(uint32_t crc, const unsigned char* data, size_t blockSize, const uint32_t shift[4][256]) {
+	uint64_t first = crc;
+	uint64_t second = 0;
+	uint64_t third = 0;
+	const unsigned char* end = data + blockSize;
+
+	while (data < end) {
+		uint64_t words[3];
+		memcpy(&words[0], data, 8);
+		memcpy(&words[1], data + blockSize, 8);
+		memcpy(&words[2], data + 2 * blockSize, 8);
+		first = _mm_crc32_u64(first, words[0]);
+		second = _mm_crc32_u64(second, words[1]);
+		third = _mm_crc32_u64(third, words[2]);
+		data += 8;
+	}
+
+	uint32_t joined = shiftCrc(shift, (uint32_t) first) ^ (uint32_t) second;
+	return shiftCrc(shift, joined) ^ (uint32_t) third;
+}
+
+inline bool crc32cCarryless() {
+	static bool supported = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+		&& __builtin_cpu_supports("vpclmulqdq") && __builtin_cpu_supports("pclmul");
+	return supported;
+}
+
+#define CRC32C_CARRYLESS_TARGET __attribute__((target("sse4.2,pclmul,avx512f,avx512vl,vpclmulqdq")))
+
+// the four 16 byte blocks of value moved on by constants, xored with the blocks of next
+CRC32C_CARRYLESS_TARGET
+inline __m512i foldBlocks(__m512i value, __m512i constants, __m512i next) {
+	__m512i first = _mm512_clmulepi64_epi128(value, constants, 0x00);
+	__m512i second = _mm512_clmulepi64_epi128(value, constants, 0x11);
+	return _mm512_xor_si512(_mm512_xor_si512(first, second), next);
+}
+
+CRC32C_CARRYLESS_TARGET
+inline __m128i foldBlock(__m128i value, const uint64_t constants[2], __m128i next) {
+	__m128i multiplier = _mm_loadu_si128((const __m128i*) constants);
+	__m128i first = _mm_clmulepi64_si128(value, multiplier, 0x00);
+	__m128i second = _mm_clmulepi64_si128(value, multiplier, 0x11);
+	return _mm_xor_si128(_mm_xor_si128(first, second), next);
+}
+
+CRC32C_CARRYLESS_TARGET
+inline __m512i broadcastConstants(const uint64_t constants[2]) {
+	return _mm512_set4_epi64(constants[1], constants[0], constants[1], constants[0]);
+}
+
+/*
+ * CRC of the raw register over length bytes with carry-less multiplies, see the top of the file.
+ * length must be a multiple of 16 and at least CRC32C_FOLD.
+ */
+CRC32C_CARRYLESS_TARGET
+inline uint32_t crc32cFold(uint32_t crc, const unsigned char* data, size_t length) {
+	const struct crc32cTables& tables = getCrc32cTables();
+
+	// the register goes into the first 4 bytes, a CRC from crc over data is the CRC from 0 over data xor crc
+	__m512i blocks[4];
+	for (int i = 0; i < 4; i++) {
+		blocks[i] = _mm512_loadu_si512(data + 64 * i);
+	}
+	blocks[0] = _mm512_xor_si512(blocks[0], _mm512_zextsi128_si512(_mm_cvtsi32_si128(crc)));
+	data += CRC32C_FOLD;
+	length -= CRC32C_FOLD;
+
+	__m512i round = broadcastConstants(tables.fold[0]);
+	while (length >= CRC32C_FOLD) {
+		for (int i = 0; i < 4; i++) {
+			blocks[i] = foldBlocks(blocks[i], round, _mm512_loadu_si512(data + 64 * i));
+		}
+		data += CRC32C_FOLD;
+		length -= CRC32C_FOLD;
+	}
+
+	// four registers into one, then its four blocks into one
+	__m512i register64 = broadcastConstants(tables.fold[1]);
+	blocks[1] = foldBlocks(blocks[0], register64, blocks[1]);
+	blocks[2] = foldBlocks(blocks[1], register64, blocks[2]);
+	blocks[3] = foldBlocks(blocks[2], register64, blocks[3]);
+
+	__m128i last[4];
+	_mm512_storeu_si512(last, blocks[3]);
+	__m128i block = foldBlock(last[2], tables.fold[4], last[3]);
+	block = foldBlock(last[1], tables.fold[3], block);
+	block = foldBlock(last[0], tables.fold[2], block);
+
+	while (length >= 16) {
+		block = foldBlock(block, tables.fold[4], _mm_loadu_si128((const __m128i*) data));
+		data += 16;
+		length -= 16;
+	}
+
+	// what is left is one block that leaves the same CRC as everything before it
+	uint64_t wide = _mm_crc32_u64(0, (uint64_t) _mm_cvtsi128_si64(block));
+	wide = _mm_crc32_u64(wide, (uint64_t) _mm_extract_epi64(block, 1));
+	return (uint32_t) wide;
+}
+
+// CRC of the raw register with the crc32 instruction
+__attribute__((target("sse4.2")))
+inline uint32_t crc32cSse42(uint32_t crc, const unsigned char* data, size_t length) {
+	const struct crc32cTables& tables = getCrc32cTables();
+
+	if (length >= 2 * CRC32C_FOLD && crc32cCarryless()) {
+		size_t folded = length & ~(size_t) 15;
+		crc = crc32cFold(crc, data, folded);
+		data += folded;
+		length -= folded;
+	}
+
+	// up to an 8 byte boundary one byte at a time
+	while (length > 0 && ((uintptr_t) data & 7) != 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+		length--;
+	}
+
+	while (length >= 3 * CRC32C_LONG) {
+		crc = crc32cThreeBlocks(crc, data, CRC32C_LONG, tables.longShift);
+		data += 3 * CRC32C_LONG;
+		length -= 3 * CRC32C_LONG;
+	}
+	while (length >= 3 * CRC32C_SHORT) {
+		crc = crc32cThreeBlocks(crc, data, CRC32C_SHORT, tables.shortShift);
+		data += 3 * CRC32C_SHORT;
+		length -= 3 * CRC32C_SHORT;
+	}
+
+	uint64_t wide = crc;
+	while (length >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		wide = _mm_crc32_u64(wide, word);
+		data += 8;
+		length -= 8;
+	}
+
+	crc = (uint32_t) wide;
+	while (length > 0) {
+		crc = _mm_crc32_u8(crc, *data++);
+		length--;
+	}
+
+	return crc;
+}
+#endif
+
+// continues crc (0 to start) over length bytes of data
+inline uint32_t crc32c(uint32_t crc, const char* data, size_t length) {
+	const unsigned char* bytes = (const unsigned char*) data;
+
+#if defined(__x86_64__)
+	if (crc32cHardware()) {
+		return ~crc32cSse42(~crc, bytes, length);
+	}
+#endif
+
+	return ~crc32cSoftware(~crc, bytes, length);
+}
+
+#endif
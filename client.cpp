@@ -1,7 +1,28 @@
 /*
  * This file will create a new socket, connect to the server, and send data uisng
- * three different ways of writing data/ transferring data. Once it does this,
+ * different ways of writing data/ transferring data. Once it does this,
  * it will wait for a response and print it.
+ * Types 1 to 3 are from the assignment. Type 4 sends with MSG_ZEROCOPY so the kernel reads the
+ * data straight out of our buffer instead of copying it, and type 5 gathers many iterations
+ * into one writev() call. Type 6 streams the payload from a file (--file, or an in-memory file
+ * when none is given) with sendfile(), so it goes from the page cache to the socket without being
+ * copied through our buffers. Every iteration goes over the wire as one framed message (see
+ * protocol.h) and the server acknowledges after the last one.
+ * With --pipeline=1,8,64,256 the client instead keeps its connection open and sends iterations
+ * requests at each of those pipeline depths, reporting per-request latency and messages/sec.
+ * With --connections/--threads it becomes a load generator (see runLoadGenerator).
+ * The server's name can resolve to IPv6 and IPv4 addresses; they are raced with Happy Eyeballs and
+ * the load generator caches the lookups for --dns-ttl seconds (see resolver.h).
+ * With --clients=N one thread runs N simulated clients at once, each one a coroutine doing the same
+ * connect, send, wait-for-acknowledgement sequence as the single connection (see async.h). That part
+ * needs the client compiled with -std=c++20, without it --clients says so and exits.
+ * --profile and the flags next to it pick the socket options every connection gets (see sockettuning.h).
+ * --verify fills the payload with a pattern made from --seed and has the server checksum every
+ * message (FLAG_CHECKSUM, see protocol.h). The digest it returns with the acknowledgement has to match
+ * the one computed here, or the client reports the mismatch and fails.
+ * --udp sends every bufsize chunk as a datagram to a server in the udp mode instead, batched with
+ * sendmmsg() and with --gso cut up by the kernel (UDP_SEGMENT), and reports packets/sec, loss,
+ * reordering and one-way latency from the server's count (see datagram.h). The type does not apply.
  */
 
 // header files provided by professor. Needed to call the OS functions
@@ -15,14 +36,56 @@
 #include <strings.h>      // bzero 
 #include <netinet/tcp.h>  // SO_REUSEADDR 
 #include <sys/uio.h>      // writev
+#include <sys/resource.h> // getrusage
+#include <linux/errqueue.h> // sock_extended_err, SO_EE_ORIGIN_ZEROCOPY
+#include <poll.h>         // poll
+#include <limits.h>       // IOV_MAX
+#include <errno.h>        // errno, ENOBUFS
+#include <pthread.h>      // pthread_create, pthread_setaffinity_np
+#include <sched.h>        // cpu_set_t, CPU_SET
+#include <sys/sendfile.h> // sendfile
+#include <sys/mman.h>     // memfd_create
+#include <sys/stat.h>     // fstat
+#include <fcntl.h>        // open, fallocate
+#include <netinet/udp.h>  // UDP_SEGMENT, SOL_UDP
+#include <signal.h>       // signal, SIGPIPE
 
 #include <iostream>
 #include <stdio.h>
 #include <cstring> // for memset
-#include <sys/time.h> // needed for gettimeofday()
+
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <atomic>
+
+#include "options.h"
+#include "protocol.h"
+#include "histogram.h"
+#include "bufferpool.h"
+#include "sockettuning.h"
+#include "resolver.h"
+#include "datagram.h"
+
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#include "async.h"
+#define HAVE_COROUTINES 1
+#endif
 
 using namespace std;
 
+// socket options every connection gets (see sockettuning.h), picked with --profile and friends
+struct socketProfile tuning;
+atomic<bool> tuningWarned(false); // so a refused option is only reported once, not per connection
+
+// where type 6 takes its payload from, opened by main (see openPayloadFile)
+int payloadFile = -1;
+long payloadFileSize = 0;
+
+// integrity mode (--verify): the payload is a pattern made from patternSeed and the server checksums every message
+bool verifyPayloads = false;
+uint64_t patternSeed = 1;
+
 /*
  * This function returns the head of a linked list of guesses for the socket information.
  * Uses the getaddrinfo() function provided by socket.h to acquire this.
@@ -30,14 +93,15 @@ using namespace std;
  * We feed this function the port number of the process runningo on the server, the ip address
  * of the server, and a set of hints for locating this socket information.
  * getaddrinfo itself returns an integer representing if it worked or not so we feed it the resulting
- * linked list of addrinfo structures.
+ * linked list of addrinfo structures. Both IPv6 and IPv4 addresses come back, so a dual-stack server
+ * can be reached over either one (see resolver.h for the order they are tried in).
  */
 struct addrinfo* getAddressGuesses (char* portNumber, char* ipAddress) {
     //cout << "entered getAddressGuesses!" << endl;
     // give the following hints of the server
     struct addrinfo hints;
     memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET; // tells the hint that the address family is internet
+    hints.ai_family = AF_UNSPEC; // tells the hint that the address family can be internet version 4 or 6
 	hints.ai_socktype = SOCK_STREAM; // tells hint that it is a stream socket protocol
 	hints.ai_protocol = IPPROTO_TCP; // TCP isnt the only sock stream protocol so we need to explicitly say TCP
 
@@ -60,175 +124,1514 @@ struct addrinfo* getAddressGuesses (char* portNumber, char* ipAddress) {
 }
 
 /*
- * Returns a socket descriptor to the process running on the server side
- * Loops through the linked list of guesses of socket information and tries to connect to each.
- * If one of them works, returns its descriptor. Head is just the guesses pointer as its the first guess.
+ * Returns a socket descriptor to the process running on the server side, connected to the first of
+ * the addresses that answers. The addresses are raced with staggered non-blocking connects instead of
+ * being tried one by one (see connectHappyEyeballs in resolver.h), so an address that does not answer
+ * costs a quarter second instead of a whole TCP timeout. Fills report if it is not NULL.
  */
-int getSocketDescriptor (struct addrinfo* head) {
-    //cout << "entered getSocketDescriptor" << endl;
-    struct addrinfo* curr; // the current record in the linked list (will initilize to head)
+int connectToServer(const vector<struct resolvedAddress>& addresses, struct connectReport* report = NULL) {
+    struct connectReport attempt;
+    int clientSocket = connectHappyEyeballs(addresses, &tuning, &attempt);
+
+    if (attempt.refused != NULL && !tuningWarned.exchange(true)) {
+        cout << "the kernel refused " << attempt.refused << ", continuing without it" << endl;
+    }
 
-    int sd = -1; // the return value
+    if (clientSocket == -1) {
+        cout << "couldnt connect to any of the " << addresses.size() << " guesses" << endl;
+    }
+
+    if (report != NULL) {
+        *report = attempt;
+    }
 
-    int guessCount = 1; // for debuggin purposes
+    return clientSocket;
+}
 
-    int clientSocket;
+// the same for the linked list of guesses getAddressGuesses returns. Head is just the guesses pointer as its the first guess
+int getSocketDescriptor (struct addrinfo* head, struct connectReport* report = NULL) {
+    return connectToServer(orderAddresses(head), report);
+}
 
-    for (curr = head; curr != NULL; curr = curr->ai_next) {
-        //cout << "guess " << guessCount << " address: " << curr->ai_addr << ", socket number: " << socket << endl;
+/*
+ * Keeps calling writev() until every byte described by the segments went out. A short write just
+ * moves the cursor: whole segments that were sent are skipped and the first unfinished one is
+ * trimmed, so the next call picks up exactly where the last one stopped. The segments array is
+ * changed in the process. Returns the number of writev() calls, or -1 if the connection broke.
+ */
+int writevAll(int socketDescriptor, struct iovec* segments, int count) {
+    int calls = 0;
 
-        clientSocket = socket(curr->ai_family, curr-> ai_socktype, curr->ai_protocol);
+    while (count > 0) {
+        int batch = count < IOV_MAX ? count : IOV_MAX; // the kernel refuses more than IOV_MAX segments at once
+        long written = writev(socketDescriptor, segments, batch);
+        calls++;
 
-        if (clientSocket == -1) {
-            cout << "Couldnt create socket with guess " << guessCount << endl;
-            continue;
+        if (written == -1) {
+            return -1;
         }
 
-        //cout << "Created socket with descriptor: " << clientSocket << endl;
-        // if the connection results in a value that isnt -1, break out of this as we have the correct client socket
-        if(connect(clientSocket, curr->ai_addr, curr->ai_addrlen) != -1) {
-            //cout << "successfully connected on the socket created and returning socket descriptor: " << clientSocket << endl;
-            return clientSocket;
+        // skip over everything that was fully sent
+        while (count > 0 && written >= (long) segments->iov_len) {
+            written -= segments->iov_len;
+            segments++;
+            count--;
         }
 
-        cout << "Couldnt connect on this guess after successfully creating the socket" << endl;
+        // and trim the segment that was only partly sent
+        if (written > 0) {
+            segments->iov_base = (char*) segments->iov_base + written;
+            segments->iov_len -= written;
+        }
+    }
+
+    return calls;
+}
+
+/*
+ * Same as writevAll for a single plain buffer, so types 1 and 2 resume after a short write the same
+ * way type 3 does. flags go to send(), MSG_MORE tells the kernel more of the message follows right
+ * away so it can hold the bytes back until it has a full segment. Returns the number of send
+ * calls, or -1 if the connection broke.
+ */
+int writeAll(int socketDescriptor, char* data, long length, int flags = 0) {
+    int calls = 0;
+
+    while (length > 0) {
+        long written = send(socketDescriptor, data, length, flags);
+        calls++;
 
-        // if the connection failed, close the socket we just created since it successfully created one, and move on
-        close(clientSocket);
+        if (written == -1) {
+            return -1;
+        }
 
-        guessCount++;
+        data += written;
+        length -= written;
     }
 
-    cout << "couldnt connect to any of the guesses" << endl;
-    return -1;
+    return calls;
+}
 
-    /*
+/*
+ * Bookkeeping for MSG_ZEROCOPY sends. Every send() call with the flag gets the next id from the
+ * kernel, and once the kernel is done with the buffer it puts a notification covering a range of ids
+ * on the socket's error queue. Until then we must not change the buffer.
+ */
+struct zerocopyState {
+    long sent; // zerocopy send() calls made
+    long completed; // of those, how many the kernel has told us it finished with
+    bool copied; // the kernel fell back to copying at least once (always the case over loopback)
+};
 
-    while (curr != NULL) {
-        // Step 1 - Create the socket to test with the information from the guess (3 parameters)
-        // Parameter 1 - Domain (an integer representing the family (ipv4/ ipv6))
-        // Parameter 2 - Type (an integer representing the type (datagram vs. stream))
-        // Parameter 3 - Protocol (an integer for the protocol (TCP vs. UDP))
+const int ZEROCOPY_WAIT = 100; // milliseconds readZerocopyCompletions waits for a notification at most
+const long ZEROCOPY_DRAIN = 5000000000L; // nanoseconds finishZerocopy waits for the last notifications at most
 
-        // socket descriptor points to a index in a table (like a file descriptor)
-        // this call is creating that socket and returning the index of that socket in the table
-        // this client.cpp program is going to be using this socket
-        sd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+/*
+ * Reads every zerocopy notification that is waiting on the socket's error queue. If wait is true
+ * it first waits up to ZEROCOPY_WAIT for at least one notification to be there.
+ */
+void readZerocopyCompletions(int socketDescriptor, struct zerocopyState* state, bool wait) {
+    if (wait) {
+        // notifications show up as POLLERR on the socket
+        struct pollfd pollDescriptor;
+        pollDescriptor.fd = socketDescriptor;
+        pollDescriptor.events = 0;
+        poll(&pollDescriptor, 1, ZEROCOPY_WAIT);
+    }
 
-        cout << "guess " << guessCount << " address: " << curr->ai_addr << ", socket number: " << socket << endl;
-        guessCount++;
+    while (1) {
+        char control[128];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
 
-        // if sd is -1, it means it cant connect so try next guess
-        if (sd == -1) {
-            cout << "couldnt connect" << endl;
-            curr = curr->ai_next;
-            cout << "next guess: " << curr->ai_addr << endl;
-        } // step 2 - check to see if you can actually connect
-        else {
-            // if it didnt return -1, it returned 1 meaning success, so check to see if it can actually connect
-            // to do that, call connect with three parameters
-            // 1. The socket descriptor we just recieved
-            // 2. The address information of the socket
-            // 3. The length of the address
-            int successfulConnection = connect(sd, curr->ai_addr, curr->ai_addrlen);
+        // MSG_ERRQUEUE never blocks, it fails with EAGAIN once the queue is empty
+        if (recvmsg(socketDescriptor, &message, MSG_ERRQUEUE) == -1) {
+            return;
+        }
 
-            bool debuggingSuccess = false; // for debugging, true if connection was successful, false otherwise
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            bool isIpError = (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR);
 
-            if (successfulConnection != -1) {
-                debuggingSuccess = true;
+            if (!isIpError) {
+                continue;
             }
 
-            int actualCount = guessCount - 1;
+            struct sock_extended_err* error = (struct sock_extended_err*) CMSG_DATA(cmsg);
 
-            cout << "guess " << actualCount << " successful connection: " << debuggingSuccess << endl;
+            if (error->ee_errno == 0 && error->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                // ee_info to ee_data is the (inclusive) range of send ids that finished
+                state->completed += error->ee_data - error->ee_info + 1;
 
-            // if this is not -1, it means it failed and we should move on
-            if (successfulConnection != -1) {
-                close(sd);
-                curr = curr->ai_next;
+                if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                    state->copied = true;
+                }
             }
-            else {
-                break;
+        }
+    }
+}
+
+/*
+ * The buffer belongs to the kernel until every zerocopy send is confirmed, so this waits for the rest
+ * before the caller reuses or frees it. A connection that broke may never confirm them, so it gives
+ * up after ZEROCOPY_DRAIN. Returns false if some were still outstanding then.
+ */
+bool finishZerocopy(int socketDescriptor, struct zerocopyState* state) {
+    long deadline = monotonicNanoseconds() + ZEROCOPY_DRAIN;
+
+    while (state->completed < state->sent && monotonicNanoseconds() < deadline) {
+        readZerocopyCompletions(socketDescriptor, state, true);
+    }
+
+    return state->completed >= state->sent;
+}
+
+/*
+ * Fills in the header for iteration i. Every iteration is one message whose payload is all the
+ * buffers, numbered by the iteration, and the final one is marked so the server knows to acknowledge.
+ */
+void fillHeader(char* header, int i, int iterations, long length) {
+    uint16_t flags = (i == iterations - 1) ? FLAG_LAST : 0;
+    encodeHeader(header, length, i, verifyPayloads ? (flags | FLAG_CHECKSUM) : flags);
+}
+
+/*
+ * Fills data with a pseudo random pattern (xorshift64*) that only depends on seed, so a byte that
+ * arrives changed, missing or out of place changes the server's checksum.
+ */
+void fillPattern(char* data, long length, uint64_t seed) {
+    uint64_t state = (seed * 0x9E3779B97F4A7C15ULL) | 1; // xorshift must never start from zero
+
+    for (long i = 0; i < length; i += 8) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t word = state * 0x2545F4914F6CDD1DULL;
+        memcpy(data + i, &word, min(8L, length - i));
+    }
+}
+
+/*
+ * Sends one message (a filled in header followed by nbufs buffers of bufsize bytes, all next to each
+ * other in message) the way transfer types 1 to 3 do it. vector needs room for nbufs + 1 segments.
+ * Returns how many write/writev calls it took, or -1 if the connection broke.
+ */
+int sendMessage(int socketDescriptor, int type, char* message, int nbufs, int bufsize, struct iovec* vector) {
+    char* header = message;
+    char* databuf = message + HEADERSIZE;
+    int calls = 0;
+
+    if(type == 1) {
+        // if type is 1, we do multiple writes so send the header and then each string individually.
+        // a corking profile marks every piece but the last with MSG_MORE so they leave as full segments
+        int more = tuning.cork ? MSG_MORE : 0;
+        calls = writeAll(socketDescriptor, header, HEADERSIZE, more);
+
+        for(int j = 0; j < nbufs && calls != -1; j++){
+            int flags = (j == nbufs - 1) ? 0 : more;
+            int bufferCalls = writeAll(socketDescriptor, databuf + (long) j * bufsize, bufsize, flags); // each buffer is size buffsize
+            calls = (bufferCalls == -1) ? -1 : calls + bufferCalls;
+        }
+    }
+    else if(type == 2){
+        // single write of the header and all the buffers, which sit next to each other in memory
+        calls = writeAll(socketDescriptor, message, HEADERSIZE + (long) nbufs * bufsize);
+    }
+    else{
+        // store the header and all the segments with the base and length
+        vector[0].iov_base = header;
+        vector[0].iov_len = HEADERSIZE;
+
+        for (int j = 0; j < nbufs; j++) {
+            vector[j + 1].iov_base = databuf + (long) j * bufsize;
+            vector[j + 1].iov_len = bufsize;
+        }
+
+        // gather all the segments in one writev (writevAll splits it if nbufs is over IOV_MAX)
+        calls = writevAll(socketDescriptor, vector, nbufs + 1);
+    }
+
+    return calls;
+}
+
+/*
+ * Gets a buffer for one message (a header followed by length bytes of payload) from the buffer pool
+ * (see bufferpool.h). The header is placed so that the payload right after it starts on a cache line.
+ */
+char* allocateMessage(long length) {
+    return poolAllocate(CACHELINE + length) + CACHELINE - HEADERSIZE;
+}
+
+void freeMessage(char* message, long length) {
+    poolFree(message - (CACHELINE - HEADERSIZE), CACHELINE + length);
+}
+
+/*
+ * Opens the file type 6 sends from and sets payloadFile and payloadFileSize. With no path it makes an
+ * in-memory file (memfd) of one message's payload, so sendfile() still reads from page cache pages
+ * rather than from our buffers. Returns false if the file cannot be opened or is empty.
+ */
+bool openPayloadFile(const char* path, long length) {
+    if (path == NULL) {
+        payloadFile = memfd_create("payload", 0);
+
+        // allocate the pages now, so the timed sends read real (zeroed) pages instead of faulting holes in
+        if (payloadFile == -1 || fallocate(payloadFile, 0, 0, length) == -1) {
+            return false;
+        }
+
+        payloadFileSize = length;
+
+        // --verify sends the same pattern as the other types
+        if (verifyPayloads) {
+            char* pattern = poolAllocate(length);
+            fillPattern(pattern, length, patternSeed);
+            long written = pwrite(payloadFile, pattern, length, 0);
+            poolFree(pattern, length);
+            return written == length;
+        }
+        return true;
+    }
+
+    payloadFile = open(path, O_RDONLY);
+    struct stat status;
+
+    if (payloadFile == -1 || fstat(payloadFile, &status) == -1 || status.st_size == 0) {
+        return false;
+    }
+
+    payloadFileSize = status.st_size;
+    return true;
+}
+
+/*
+ * Does the sending for writeToSocket with the message buffer and iovec array it allocated.
+ * The type variable describes the type of write we are doing (described over each if statement).
+ * Every iteration goes out as one framed message (see protocol.h), so each type also has to send a
+ * header in front of its buffers. Every type keeps going after a short write until all of its data
+ * is out. How long each message (each batch for type 5) took to hand to the kernel is recorded in
+ * sendTimes. Returns how many write/writev/send calls it took, or -1 if the connection broke.
+ */
+long writeMessages(int iterations, int nbufs, int bufsize, int type, int socketDescriptor, struct latencyHistogram* sendTimes, char* message, struct iovec* vector) {
+	long length = (long) nbufs * bufsize; // payload bytes per message
+	char* header = message;
+	char* databuf = message + HEADERSIZE; // buffer j starts at databuf + j * bufsize
+
+    long syscalls = 0; // write, writev, send and sendfile calls made
+
+    if (type == 6) {
+        // file streaming: the payload goes from the page cache straight to the socket with sendfile() and never
+        // passes through databuf. The file is read from where the previous message stopped and wraps around
+        // at its end, so iterations * nbufs * bufsize equal to the file's size sends it exactly once
+        off_t offset = 0;
+
+        for (int i = 0; i < iterations; i++) {
+            long messageStart = monotonicNanoseconds();
+
+            // MSG_MORE holds the header back so it leaves in the same segment as the start of the payload
+            fillHeader(header, i, iterations, length);
+            int headerCalls = writeAll(socketDescriptor, header, HEADERSIZE, MSG_MORE);
+
+            if (headerCalls == -1) {
+                return -1;
             }
-            //else {
-                //close(sd);
-            //}
+
+            syscalls += headerCalls;
+            long left = length;
+
+            while (left > 0) {
+                if (offset == payloadFileSize) {
+                    offset = 0;
+                }
+
+                long written = sendfile(socketDescriptor, payloadFile, &offset, min(left, payloadFileSize - (long) offset));
+                syscalls++;
+
+                if (written <= 0) {
+                    return -1;
+                }
+
+                left -= written;
+            }
+
+            recordValue(sendTimes, monotonicNanoseconds() - messageStart);
         }
+
+        return syscalls;
     }
-    
 
-    cout << "sd in getSocketDescriptor: " << sd << endl;
+    if (type == 4) {
+        // zero copy: one send of the whole payload per iteration, the kernel pins our pages instead of copying them
+        int enable = 1;
+        int flags = MSG_ZEROCOPY;
 
-    return sd;
-    */
+        if (setsockopt(socketDescriptor, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) == -1) {
+            cout << "SO_ZEROCOPY is not supported here, sending with normal copies" << endl;
+            flags = 0;
+        }
+
+        struct zerocopyState state;
+        state.sent = 0;
+        state.completed = 0;
+        state.copied = false;
+
+        const long MAXOUTSTANDING = 1024; // sends we let the kernel hold on to before waiting for some to finish
+
+        for (int i = 0; i < iterations; i++) {
+            long messageStart = monotonicNanoseconds();
+
+            // the header changes every iteration, so it is sent with a normal (copying) write. Its 16 bytes
+            // are not worth pinning, and it means we never touch memory the kernel is still reading from
+            fillHeader(header, i, iterations, length);
+            int headerCalls = writeAll(socketDescriptor, header, HEADERSIZE, tuning.cork ? MSG_MORE : 0);
+
+            if (headerCalls == -1) {
+                finishZerocopy(socketDescriptor, &state);
+                return -1;
+            }
+
+            syscalls += headerCalls;
+            long offset = 0;
+
+            while (offset < length) {
+                long written = send(socketDescriptor, databuf + offset, length - offset, flags);
+                bool pinned = flags != 0;
+
+                if (written == -1 && errno == ENOBUFS && pinned) {
+                    if (state.sent > state.completed) {
+                        // too much memory pinned for this socket, wait for the kernel to release some and try again
+                        readZerocopyCompletions(socketDescriptor, &state, true);
+                        continue;
+                    }
+
+                    // none of our sends are pinned, so no notification is coming to make room: copy this one
+                    written = send(socketDescriptor, databuf + offset, length - offset, 0);
+                    pinned = false;
+                }
+
+                syscalls++;
+
+                if (written == -1) {
+                    finishZerocopy(socketDescriptor, &state);
+                    return -1;
+                }
+
+                offset += written;
+                if (pinned) {
+                    state.sent++;
+                }
+            }
+
+            readZerocopyCompletions(socketDescriptor, &state, state.sent - state.completed > MAXOUTSTANDING);
+            recordValue(sendTimes, monotonicNanoseconds() - messageStart);
+        }
+
+        if (!finishZerocopy(socketDescriptor, &state)) {
+            cout << "gave up waiting for " << state.sent - state.completed << " zerocopy sends to be confirmed" << endl;
+        }
+
+        if (state.copied) {
+            cout << "note: the kernel copied some zerocopy sends anyway (it always does over loopback)" << endl;
+        }
+        return syscalls;
+    }
+
+    if (type == 5) {
+        // batched: describe the header and every buffer of as many iterations as fit in IOV_MAX segments,
+        // and let writevAll send them together, so an iteration no longer costs a syscall. Each iteration
+        // in a batch needs its own header since the sequence numbers differ
+        int segmentsPerIteration = nbufs + 1;
+        int iterationsPerBatch = IOV_MAX / segmentsPerIteration;
+
+        if (iterationsPerBatch < 1) {
+            iterationsPerBatch = 1; // a single iteration is bigger than IOV_MAX, writevAll will split it
+        }
+
+        long batchSegments = (long) iterationsPerBatch * segmentsPerIteration;
+        long headerBytes = (long) iterationsPerBatch * HEADERSIZE;
+        struct iovec* batch = (struct iovec*) poolAllocate(batchSegments * sizeof(struct iovec));
+        char* headers = poolAllocate(headerBytes);
+
+        for (int first = 0; first < iterations; first += iterationsPerBatch) {
+            long batchStart = monotonicNanoseconds();
+            int count = 0; // segments in this batch
+
+            for (int i = first; i < iterations && i < first + iterationsPerBatch; i++) {
+                char* batchHeader = headers + (long) (i - first) * HEADERSIZE;
+                fillHeader(batchHeader, i, iterations, length);
+
+                batch[count].iov_base = batchHeader;
+                batch[count].iov_len = HEADERSIZE;
+                count++;
+
+                for (int j = 0; j < nbufs; j++) {
+                    batch[count].iov_base = databuf + (long) j * bufsize;
+                    batch[count].iov_len = bufsize;
+                    count++;
+                }
+            }
+
+            int calls = writevAll(socketDescriptor, batch, count);
+
+            if (calls == -1) {
+                poolFree(batch, batchSegments * sizeof(struct iovec));
+                poolFree(headers, headerBytes);
+                return -1;
+            }
+
+            syscalls += calls;
+            recordValue(sendTimes, monotonicNanoseconds() - batchStart);
+        }
+
+        poolFree(batch, batchSegments * sizeof(struct iovec));
+        poolFree(headers, headerBytes);
+        return syscalls;
+    }
+
+	// the assignment says to call the write iteration times in all cases so does this in a loop iteration times
+	for (int i = 0; i < iterations; i++) {
+        //cout << "write iteration: " << i << endl;
+        long messageStart = monotonicNanoseconds();
+        fillHeader(header, i, iterations, length);
+        int calls = sendMessage(socketDescriptor, type, message, nbufs, bufsize, vector);
+
+        if (calls == -1) {
+            return -1;
+        }
+
+        syscalls += calls;
+        recordValue(sendTimes, monotonicNanoseconds() - messageStart);
+	}
+
+    //cout << "finished writing!" << endl;
+    return syscalls;
+}
+
+/*
+ * The digest the server should send back for iterations messages of length bytes: the CRC32C of
+ * every payload in the order they were sent (see FLAG_CHECKSUM in protocol.h). Every type but 6
+ * sends the same pattern each time, so its CRC is computed once and chained with crc32cCombine.
+ * Type 6 walks the file the way writeMessages sends it. Runs before anything is timed.
+ */
+uint32_t expectedDigest(int iterations, long length, int type) {
+    if (type != 6) {
+        char* payload = poolAllocate(length);
+        fillPattern(payload, length, patternSeed);
+        uint32_t crc = crc32c(0, payload, length);
+        poolFree(payload, length);
+
+        uint32_t digest = 0;
+        uint32_t shift = zeroBytesOperator(length); // crc32cCombine without working this out every time
+
+        for (int i = 0; i < iterations; i++) {
+            digest = multiplyModPolynomial(shift, digest) ^ crc;
+        }
+        return digest;
+    }
+
+    char* file = (char*) mmap(NULL, payloadFileSize, PROT_READ, MAP_PRIVATE, payloadFile, 0);
+
+    if (file == MAP_FAILED) {
+        return 0;
+    }
+
+    uint32_t digest = 0;
+    long offset = 0;
+
+    for (long left = (long) iterations * length; left > 0; ) {
+        if (offset == payloadFileSize) {
+            offset = 0;
+        }
+
+        long piece = min(left, payloadFileSize - offset);
+        digest = crc32c(digest, file + offset, piece);
+        offset += piece;
+        left -= piece;
+    }
+
+    munmap(file, payloadFileSize);
+    return digest;
 }
 
 /*
  * This function creates a data buffer and uses the write() and writev() sys calls to send write
- * information over to the process running on the server. The type variable describes the type of
- * write we are doing (described over each if statement)
+ * information over to the process running on the server (see writeMessages for how each type
+ * sends). Returns how many write/writev/send calls it took, or -1 if the connection broke.
  */
-void writeToSocket (int iterations, int nbufs, int bufsize, int type, int socketDescriptor) {
+long writeToSocket (int iterations, int nbufs, int bufsize, int type, int socketDescriptor, struct latencyHistogram* sendTimes) {
     //cout << "entered writeToSocket" << endl;
     // allocate a data buffer to send to the server
 	// data buffers are temporary storage to transfer between different media and storage
 	// basically a array of strings (array of array of characters) with each string sized (bufsize - in bytes)
 	// and the number of strings is equivalent to the nbufs (number of data buffers)
-	char databuf[nbufs][bufsize]; // where nbufs * bufsize = 1500 (whole load is 1500 bytes)
+	// the message header sits right in front of the buffers so type 2 can send both with a single write.
+	// both come from the buffer pool rather than the stack, so multi-megabyte messages are fine
+	long length = (long) nbufs * bufsize; // payload bytes per message
+	char* message = allocateMessage(length);
 
-    // incase it is type 2, need to break the data to segments
-    struct iovec vector[nbufs];
+    if (verifyPayloads) {
+        fillPattern(message + HEADERSIZE, length, patternSeed);
+    }
 
-	// the assignment says to call the write iteration times in all cases so does this in a loop iteration times
-	for (int i = 0; i < iterations; i++) {
-        //cout << "write iteration: " << i << endl;
-		if(type == 1) {
-			// if type is 1, we do multiple writes so send each string individually
-			for(int j = 0; j < nbufs; j++){
-				write(socketDescriptor, databuf[j], bufsize); // each buffer is size buffsize
-			}
-		}
-		else if(type == 2){
-			// single write all the buffers
-			int length = nbufs * bufsize;
-			write(socketDescriptor, databuf, length);
-		}
-		else{
-            // store the all the segments with the base and length
-			for (int j = 0; j < nbufs; j++) {
-                vector[j].iov_base = databuf[j];
-                vector[j].iov_len = bufsize;
+    // incase it is type 3, need to break the data to segments (plus one for the header)
+    struct iovec* vector = (struct iovec*) poolAllocate((nbufs + 1) * sizeof(struct iovec));
+
+    long syscalls = writeMessages(iterations, nbufs, bufsize, type, socketDescriptor, sendTimes, message, vector);
+
+    freeMessage(message, length);
+    poolFree(vector, (nbufs + 1) * sizeof(struct iovec));
+    return syscalls;
+}
+
+/*
+ * Persistent connection mode. Sends requests messages on the already open socket, each marked as a
+ * request so the server answers it on its own, and keeps up to depth of them outstanding before it
+ * waits for answers. The connection stays open afterwards so several depths can be measured on it.
+ * Every request's latency (send to answer, in nanoseconds) is recorded in latencies. Returns how
+ * long the whole run took in nanoseconds, or -1 if the connection broke.
+ */
+long runPipeline(int socketDescriptor, int type, int requests, int nbufs, int bufsize, int depth, struct latencyHistogram* latencies) {
+    long length = (long) nbufs * bufsize;
+    char* message = allocateMessage(length);
+    struct iovec* segments = (struct iovec*) poolAllocate((nbufs + 1) * sizeof(struct iovec));
+    long* sentAt = new long[requests]; // when each request went out, indexed by its sequence number
+
+    memset(message, 0, HEADERSIZE + length);
+
+    char answers[HEADERSIZE * 256]; // answers read so far that have not been matched yet
+    size_t answerBytes = 0;
+    int sent = 0;
+    int answered = 0;
+    bool broken = false;
+    long start = monotonicNanoseconds();
+
+    while (answered < requests && !broken) {
+        // fill the pipeline back up to depth
+        while (sent < requests && sent - answered < depth) {
+            encodeHeader(message, length, sent, FLAG_REQUEST);
+            sentAt[sent] = monotonicNanoseconds();
+
+            if (sendMessage(socketDescriptor, type, message, nbufs, bufsize, segments) == -1) {
+                broken = true;
+                break;
             }
 
-            // write over the segments
-            write (socketDescriptor, vector, bufsize);
-		}
-	}
+            sent++;
+        }
 
-    //cout << "finished writing!" << endl;
+        if (broken) {
+            break;
+        }
+
+        // then wait for at least one answer, and take every complete one that came with it
+        long bytes = read(socketDescriptor, answers + answerBytes, sizeof(answers) - answerBytes);
+
+        if (bytes <= 0) {
+            broken = true;
+            break;
+        }
+
+        answerBytes += bytes;
+        long now = monotonicNanoseconds();
+        size_t used = 0;
+
+        while (answerBytes - used >= (size_t) HEADERSIZE) {
+            struct messageHeader answer;
+
+            if (!decodeHeader(answers + used, &answer) || !(answer.flags & FLAG_RESPONSE) || answer.sequence >= (uint32_t) sent) {
+                broken = true;
+                break;
+            }
+
+            recordValue(latencies, now - sentAt[answer.sequence]);
+            answered++;
+            used += HEADERSIZE;
+        }
+
+        // keep a partly received answer for the next read
+        memmove(answers, answers + used, answerBytes - used);
+        answerBytes -= used;
+    }
+
+    long elapsed = monotonicNanoseconds() - start;
+
+    freeMessage(message, length);
+    poolFree(segments, (nbufs + 1) * sizeof(struct iovec));
+    delete[] sentAt;
+
+    return broken ? -1 : elapsed;
+}
+
+/*
+ * Load generator mode. Instead of one connection driven from main, --connections=M connections are
+ * spread over --threads=T threads, each thread pinned to its own core. Every connection sends request
+ * messages with the selected transfer type and matches up the server's answers. It runs for
+ * --duration=seconds, or until --bytes=N bytes of payload went out in total.
+ *
+ * closed loop (the default): each connection keeps --depth requests outstanding and sends the next one
+ *   as soon as an answer comes back, so a slow server slows the load down with it.
+ * open loop (--rate=R): requests are sent on a fixed schedule of R messages/sec in total, whether or
+ *   not the server keeps up. Latency is measured from when a request was supposed to go out, not from
+ *   when it actually did, so a stalled server shows up in the numbers instead of hiding behind the
+ *   requests it kept us from sending (coordinated omission).
+ */
+const int MAXOUTSTANDING = 4096; // requests one connection can have waiting for answers
+const long LOAD_DRAIN = 5000000000L; // nanoseconds a thread waits for its last answers once it stopped sending
+
+// everything one connection of the load generator keeps track of
+struct loadConnection {
+    int socketDescriptor;
+    uint32_t sent; // requests sent, also the next sequence number
+    uint32_t answered;
+    long payloadBytes; // payload bytes sent
+    long byteTarget; // stop sending once this many payload bytes went out (0 means no limit)
+    long nextSendAt; // open loop only, when the next request is due
+    long intendedAt[MAXOUTSTANDING]; // when each outstanding request was meant to go out, by sequence number
+    char answers[HEADERSIZE * 64]; // answer bytes not matched yet
+    size_t answerBytes;
+    bool broken;
+};
+
+// what each load generator thread is handed, and what it hands back
+struct loadThreadData {
+    struct resolverCache* resolver; // every connection looks the server up here
+    const char* host;
+    const char* port;
+    int type;
+    int nbufs;
+    int bufsize;
+    int connections; // how many connections this thread drives
+    int core; // cpu this thread is pinned to
+    int depth; // closed loop outstanding requests per connection
+    long interval; // open loop nanoseconds between requests on one connection (0 for closed loop)
+    long deadline; // stop sending at this time (0 means no time limit)
+    long bytesPerConnection; // byte count mode (0 means no byte limit)
+    vector<long> connectionBytes; // payload bytes each connection sent
+    struct latencyHistogram* latencies; // request latencies of this thread, nanoseconds
+    struct latencyHistogram* connectTimes; // how long each connection took to set up
+    long messages;
+    long abandoned; // answers that had not come LOAD_DRAIN after the thread stopped sending
+};
+
+// sends one request on the connection, stamped with the time it was meant to go out
+bool sendRequest(struct loadConnection* connection, struct loadThreadData* data, char* message, struct iovec* segments, long intendedAt) {
+    long length = (long) data->nbufs * data->bufsize;
+
+    encodeHeader(message, length, connection->sent, FLAG_REQUEST);
+    connection->intendedAt[connection->sent % MAXOUTSTANDING] = intendedAt;
+
+    if (sendMessage(connection->socketDescriptor, data->type, message, data->nbufs, data->bufsize, segments) == -1) {
+        connection->broken = true;
+        return false;
+    }
+
+    connection->sent++;
+    connection->payloadBytes += length;
+    return true;
+}
+
+// reads whatever answers have arrived on the connection and records their latencies
+void readAnswers(struct loadConnection* connection, struct loadThreadData* data) {
+    long bytes = read(connection->socketDescriptor, connection->answers + connection->answerBytes, sizeof(connection->answers) - connection->answerBytes);
+
+    if (bytes <= 0) {
+        connection->broken = true;
+        return;
+    }
+
+    connection->answerBytes += bytes;
+    long now = monotonicNanoseconds();
+    size_t used = 0;
+
+    while (connection->answerBytes - used >= (size_t) HEADERSIZE) {
+        struct messageHeader answer;
+
+        if (!decodeHeader(connection->answers + used, &answer) || !(answer.flags & FLAG_RESPONSE)) {
+            connection->broken = true;
+            return;
+        }
+
+        // only a request that is still outstanding has its send time in intendedAt, anything else would record a wrong latency
+        if (answer.sequence - connection->answered >= connection->sent - connection->answered) {
+            connection->broken = true;
+            return;
+        }
+
+        recordValue(data->latencies, now - connection->intendedAt[answer.sequence % MAXOUTSTANDING]);
+        data->messages++;
+        connection->answered++;
+        used += HEADERSIZE;
+    }
+
+    memmove(connection->answers, connection->answers + used, connection->answerBytes - used);
+    connection->answerBytes -= used;
+}
+
+// true while the connection should keep sending new requests
+bool stillSending(struct loadConnection* connection, struct loadThreadData* data, long now) {
+    if (connection->broken) {
+        return false;
+    }
+    if (data->deadline != 0 && now >= data->deadline) {
+        return false;
+    }
+    if (connection->byteTarget != 0 && connection->payloadBytes >= connection->byteTarget) {
+        return false;
+    }
+
+    return true;
+}
+
+void* runLoadThread(void* input) {
+    struct loadThreadData* data = (struct loadThreadData*)input;
+
+    // pin the thread so the threads dont fight over cores with each other
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(data->core, &cores);
+    pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+
+    long length = (long) data->nbufs * data->bufsize;
+    char* message = allocateMessage(length); // every connection of this thread sends from the same buffer
+    struct iovec* segments = (struct iovec*) poolAllocate((data->nbufs + 1) * sizeof(struct iovec));
+    memset(message, 0, HEADERSIZE + length);
+
+    vector<struct loadConnection*> connections;
+    vector<struct pollfd> pollDescriptors;
+    long start = monotonicNanoseconds();
+
+    for (int i = 0; i < data->connections; i++) {
+        vector<struct resolvedAddress> addresses;
+
+        if (resolveCached(data->resolver, data->host, data->port, &addresses) != 0) {
+            continue;
+        }
+
+        // connect time only covers the connection setup, the lookup above is (almost always) a cache hit
+        long connectStart = monotonicNanoseconds();
+        int sd = connectToServer(addresses);
+        recordValue(data->connectTimes, monotonicNanoseconds() - connectStart);
+
+        if (sd == -1) {
+            continue;
+        }
+
+        struct loadConnection* connection = new loadConnection;
+        connection->socketDescriptor = sd;
+        connection->sent = 0;
+        connection->answered = 0;
+        connection->payloadBytes = 0;
+        connection->byteTarget = data->bytesPerConnection;
+        // spread the first requests of an open loop over one interval so the connections dont all fire together
+        connection->nextSendAt = start + (data->interval * i) / (data->connections > 0 ? data->connections : 1);
+        connection->answerBytes = 0;
+        connection->broken = false;
+        connections.push_back(connection);
+
+        struct pollfd pollDescriptor;
+        pollDescriptor.fd = sd;
+        pollDescriptor.events = POLLIN;
+        pollDescriptors.push_back(pollDescriptor);
+    }
+
+    long drainUntil = 0; // once nobody sends anymore, when to stop waiting for the answers still missing
+
+    while (1) {
+        long now = monotonicNanoseconds();
+        bool anySending = false;
+        bool anyWaiting = false; // somebody stopped sending but still waits for answers
+        long wakeAt = now + 10000000L; // when poll should give up waiting if nothing arrives
+
+        for (size_t i = 0; i < connections.size(); i++) {
+            struct loadConnection* connection = connections[i];
+
+            if (data->interval == 0) {
+                while (stillSending(connection, data, now) && connection->sent - connection->answered < (uint32_t) data->depth) {
+                    sendRequest(connection, data, message, segments, monotonicNanoseconds());
+                }
+            }
+            else {
+                while (stillSending(connection, data, now) && connection->nextSendAt <= now
+                    && connection->sent - connection->answered < (uint32_t) MAXOUTSTANDING) {
+                    sendRequest(connection, data, message, segments, connection->nextSendAt);
+                    connection->nextSendAt += data->interval;
+                }
+
+                if (stillSending(connection, data, now) && connection->nextSendAt < wakeAt) {
+                    wakeAt = connection->nextSendAt;
+                }
+            }
+
+            if (stillSending(connection, data, now)) {
+                anySending = true;
+            }
+            else if (!connection->broken && connection->answered < connection->sent) {
+                anyWaiting = true;
+            }
+        }
+
+        if (!anySending && !anyWaiting) {
+            break;
+        }
+
+        if (!anySending) {
+            if (drainUntil == 0) {
+                drainUntil = now + LOAD_DRAIN;
+            }
+            else if (now >= drainUntil) {
+                // a lost answer must not keep the run from ever reporting, so give up on what is still missing
+                for (size_t i = 0; i < connections.size(); i++) {
+                    if (!connections[i]->broken) {
+                        data->abandoned += connections[i]->sent - connections[i]->answered;
+                        connections[i]->broken = true;
+                    }
+                }
+                break;
+            }
+        }
+
+        long timeout = (wakeAt - now) / 1000000L;
+        poll(pollDescriptors.data(), pollDescriptors.size(), timeout > 0 ? timeout : 0);
+
+        for (size_t i = 0; i < connections.size(); i++) {
+            if (pollDescriptors[i].revents != 0 && !connections[i]->broken) {
+                readAnswers(connections[i], data);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < connections.size(); i++) {
+        data->connectionBytes.push_back(connections[i]->payloadBytes);
+        close(connections[i]->socketDescriptor);
+        delete connections[i];
+    }
+
+    freeMessage(message, length);
+    poolFree(segments, (data->nbufs + 1) * sizeof(struct iovec));
+    return NULL;
+}
+
+/*
+ * Starts the load generator threads, waits for them and prints the combined results: throughput,
+ * messages/sec, latency percentiles, and how evenly the connections were served (Jain's fairness
+ * index over the bytes each connection sent, where 1 means perfectly even).
+ */
+void runLoadGenerator(const char* host, const char* port, int type, int nbufs, int bufsize, int argc, char** argv) {
+    int connections = getIntOption(argc, argv, "connections", 1);
+    int threads = getIntOption(argc, argv, "threads", 1);
+    int depth = getIntOption(argc, argv, "depth", 1);
+    long rate = getIntOption(argc, argv, "rate", 0);
+    long duration = getIntOption(argc, argv, "duration", 0);
+    long bytes = getIntOption(argc, argv, "bytes", 0);
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // every connection looks the server up again, served from this cache for --dns-ttl seconds
+    struct resolverCache resolver;
+    initResolverCache(&resolver, getIntOption(argc, argv, "dns-ttl", 60));
+
+    if (duration <= 0 && bytes <= 0) {
+        duration = 10; // need some way to stop
+    }
+    if (connections < 1 || threads < 1) {
+        cout << "--connections and --threads must both be at least 1" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (threads > connections) {
+        threads = connections;
+    }
+    if (depth < 1) {
+        depth = 1;
+    }
+    if (depth > MAXOUTSTANDING) {
+        // intendedAt only has room for MAXOUTSTANDING requests, deeper ones would overwrite ones still in flight
+        cout << "--depth is capped at " << MAXOUTSTANDING << ", using " << MAXOUTSTANDING << endl;
+        depth = MAXOUTSTANDING;
+    }
+
+    long start = monotonicNanoseconds();
+    vector<struct loadThreadData> threadData(threads);
+    vector<pthread_t> threadIds(threads);
+
+    for (int t = 0; t < threads; t++) {
+        struct loadThreadData& data = threadData[t];
+        data.resolver = &resolver;
+        data.host = host;
+        data.port = port;
+        data.type = type;
+        data.nbufs = nbufs;
+        data.bufsize = bufsize;
+        data.connections = connections / threads + (t < connections % threads ? 1 : 0);
+        data.core = t % cores;
+        data.depth = depth;
+        // each connection gets an equal share of the total rate
+        data.interval = (rate > 0) ? (1000000000L * connections) / rate : 0;
+        data.deadline = (duration > 0) ? start + duration * 1000000000L : 0;
+        data.bytesPerConnection = (bytes > 0) ? bytes / connections : 0;
+        data.messages = 0;
+        data.abandoned = 0;
+        data.latencies = newHistogram();
+        data.connectTimes = newHistogram();
+
+        pthread_create(&threadIds[t], NULL, runLoadThread, &data);
+    }
+
+    // every thread recorded into its own histograms, merge them once they are all done
+    struct latencyHistogram* latencies = newHistogram();
+    struct latencyHistogram* connectTimes = newHistogram();
+    vector<long> connectionBytes;
+    long messages = 0;
+    long abandoned = 0;
+
+    for (int t = 0; t < threads; t++) {
+        pthread_join(threadIds[t], NULL);
+        mergeHistogram(latencies, threadData[t].latencies);
+        mergeHistogram(connectTimes, threadData[t].connectTimes);
+        delete threadData[t].latencies;
+        delete threadData[t].connectTimes;
+        connectionBytes.insert(connectionBytes.end(), threadData[t].connectionBytes.begin(), threadData[t].connectionBytes.end());
+        messages += threadData[t].messages;
+        abandoned += threadData[t].abandoned;
+    }
+
+    long elapsed = monotonicNanoseconds() - start;
+
+    // Jain's fairness index: (sum of x)^2 / (n * sum of x^2)
+    double sum = 0;
+    double sumOfSquares = 0;
+    long fewest = connectionBytes.empty() ? 0 : connectionBytes[0];
+    long most = fewest;
+
+    for (size_t i = 0; i < connectionBytes.size(); i++) {
+        sum += connectionBytes[i];
+        sumOfSquares += (double) connectionBytes[i] * connectionBytes[i];
+        fewest = min(fewest, connectionBytes[i]);
+        most = max(most, connectionBytes[i]);
+    }
+
+    double fairness = (sumOfSquares > 0) ? (sum * sum) / (connectionBytes.size() * sumOfSquares) : 0;
+    double seconds = elapsed / 1e9;
+
+    cout << "load: " << connectionBytes.size() << " connections on " << threads << " threads, "
+        << ((rate > 0) ? "open loop at " + to_string(rate) + " messages/sec" : "closed loop at depth " + to_string(depth))
+        << ", ran " << elapsed / 1000 << " usec" << endl;
+    cout << "load: " << messages << " messages, " << (long) (messages / seconds) << " messages/sec, "
+        << sum / 1e6 / seconds << " MB/s" << endl;
+
+    if (abandoned > 0) {
+        cout << "load: gave up on " << abandoned << " answers that had not come " << LOAD_DRAIN / 1000000000L
+            << " seconds after sending stopped" << endl;
+    }
+
+    printHistogram(cout, "load: request latency", latencies);
+    printHistogram(cout, "load: connect time", connectTimes);
+
+    cout << "load: resolver cache = " << resolver.lookups << " lookups, " << resolver.misses << " resolved with getaddrinfo" << endl;
+
+    cout << "load: fairness (Jain) = " << fairness << ", per-connection MB min = " << fewest / 1e6
+        << ", max = " << most / 1e6 << endl;
+
+    const char* histogramPath = getOption(argc, argv, "histogram", NULL);
+
+    if (histogramPath != NULL) {
+        vector<string> names;
+        names.push_back("request_latency_ns");
+        names.push_back("connect_ns");
+        vector<const struct latencyHistogram*> histograms;
+        histograms.push_back(latencies);
+        histograms.push_back(connectTimes);
+
+        if (!writeHistograms(histogramPath, names, histograms)) {
+            cout << "Could not write the histograms to " << histogramPath << endl;
+        }
+    }
+
+    delete latencies;
+    delete connectTimes;
+}
+
+#ifdef HAVE_COROUTINES
+// what the simulated clients record, shared by all of them since they run on the same thread
+struct simulationResults {
+    struct latencyHistogram* connectTimes; // nanoseconds from the first socket() to a connected socket
+    struct latencyHistogram* roundTrips; // nanoseconds from the first send to the acknowledgement
+    long bytes; // payload bytes of the clients that got their acknowledgement
+    int finished;
+    int failed;
+};
+
+/*
+ * One simulated client. It does what main does for a single connection: try every address guess
+ * until a connect works (like getSocketDescriptor), send iterations messages with type 1, 2 or 3
+ * (like sendMessage), then wait for the acknowledgement. Each co_await gives the thread to the
+ * other clients until the socket is ready.
+ */
+asyncTask simulateClient(struct reactor* loop, struct addrinfo* server, int iterations, int nbufs, int bufsize, int type,
+    struct simulationResults* results) {
+    long connectStart = monotonicNanoseconds();
+    struct asyncSocket* socket = NULL;
+
+    for (struct addrinfo* guess = server; guess != NULL && socket == NULL; guess = guess->ai_next) {
+        socket = openAsyncSocket(loop, guess->ai_family, guess->ai_socktype, guess->ai_protocol);
+
+        if (socket == NULL) {
+            continue;
+        }
+
+        applySocketProfile(socket->descriptor, &tuning);
+
+        if (co_await asyncConnect(socket, guess->ai_addr, guess->ai_addrlen) == -1) {
+            closeAsyncSocket(socket);
+            socket = NULL;
+        }
+    }
+
+    if (socket == NULL) {
+        results->failed++;
+        co_return;
+    }
+
+    recordValue(results->connectTimes, monotonicNanoseconds() - connectStart);
+
+    // every client needs its own message, the headers of two clients differ while both are suspended mid-send
+    long length = (long) nbufs * bufsize;
+    char* message = allocateMessage(length);
+    char* databuf = message + HEADERSIZE;
+    struct iovec* segments = (struct iovec*) poolAllocate((nbufs + 1) * sizeof(struct iovec));
+    memset(message, 0, HEADERSIZE + length);
+
+    long start = monotonicNanoseconds();
+    bool broken = false;
+
+    for (int i = 0; i < iterations && !broken; i++) {
+        fillHeader(message, i, iterations, length);
+
+        if (type == 1) {
+            broken = co_await asyncSend(socket, message, HEADERSIZE, tuning.cork ? MSG_MORE : 0) == -1;
+
+            for (int j = 0; j < nbufs && !broken; j++) {
+                int flags = (tuning.cork && j < nbufs - 1) ? MSG_MORE : 0;
+                broken = co_await asyncSend(socket, databuf + (long) j * bufsize, bufsize, flags) == -1;
+            }
+        }
+        else if (type == 2) {
+            broken = co_await asyncSend(socket, message, HEADERSIZE + length) == -1;
+        }
+        else {
+            segments[0].iov_base = message;
+            segments[0].iov_len = HEADERSIZE;
+
+            for (int j = 0; j < nbufs; j++) {
+                segments[j + 1].iov_base = databuf + (long) j * bufsize;
+                segments[j + 1].iov_len = bufsize;
+            }
+
+            broken = co_await asyncSendv(socket, segments, nbufs + 1) == -1;
+        }
+    }
+
+    int numReads = 0;
+
+    if (!broken && co_await asyncReceive(socket, (char*) &numReads, sizeof(numReads)) == sizeof(numReads)) {
+        recordValue(results->roundTrips, monotonicNanoseconds() - start);
+        results->bytes += iterations * length;
+        results->finished++;
+    }
+    else {
+        results->failed++;
+    }
+
+    closeAsyncSocket(socket);
+    freeMessage(message, length);
+    poolFree(segments, (nbufs + 1) * sizeof(struct iovec));
+}
+
+/*
+ * Simulated clients mode. Starts clients coroutines on this thread, every one of them connecting
+ * right away, and runs the reactor until all of them are done. Prints how many finished, the
+ * clients per second and throughput, the connect and round-trip percentiles, and the syscalls the
+ * one thread made in total.
+ */
+void runSimulatedClients(struct addrinfo* server, int iterations, int nbufs, int bufsize, int type, int clients) {
+    struct reactor loop;
+
+    if (!initReactor(&loop)) {
+        cout << "Could not create an epoll instance" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    struct simulationResults results;
+    results.connectTimes = newHistogram();
+    results.roundTrips = newHistogram();
+    results.bytes = 0;
+    results.finished = 0;
+    results.failed = 0;
+
+    long start = monotonicNanoseconds();
+
+    for (int i = 0; i < clients; i++) {
+        simulateClient(&loop, server, iterations, nbufs, bufsize, type, &results); // runs until its first wait
+    }
+
+    runReactor(&loop);
+    long elapsed = max(monotonicNanoseconds() - start, 1L);
+
+    cout << "simulated clients = " << clients << " on one thread: " << results.finished << " finished, " << results.failed
+        << " failed in " << elapsed / 1000 << " usec (" << (long) (results.finished / (elapsed / 1e9)) << " clients/sec, "
+        << results.bytes / (elapsed / 1e9) / 1e9 << " GB/s)" << endl;
+    cout << "socket syscalls = " << loop.syscalls << endl;
+    printHistogram(cout, "connect time", results.connectTimes);
+    printHistogram(cout, "round-trip time", results.roundTrips);
+
+    close(loop.epollDescriptor);
+    delete results.connectTimes;
+    delete results.roundTrips;
+}
+#endif
+
+const int DATAGRAM_CALL = 32; // messages one sendmmsg call hands the kernel
+const int DATAGRAM_REPORT_TRIES = 50; // DONE datagrams sent before giving up on the server's report
+const int DATAGRAM_REPORT_WAIT = 100; // milliseconds each one waits for the report
+
+/*
+ * Opens a UDP socket connected to the first of the server's addresses that takes one. connect() on
+ * a UDP socket only sets where send() goes (nothing goes over the wire), but it also means an ICMP
+ * "port unreachable" comes back as ECONNREFUSED on the next send or receive. Returns -1 if none worked.
+ */
+int getDatagramSocket(const char* host, const char* port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    struct addrinfo* results;
+
+    if (getaddrinfo(host, port, &hints, &results) != 0) {
+        return -1;
+    }
+
+    int sd = -1;
+
+    for (struct addrinfo* current = results; current != NULL && sd == -1; current = current->ai_next) {
+        sd = socket(current->ai_family, current->ai_socktype, current->ai_protocol);
+
+        if (sd != -1 && connect(sd, current->ai_addr, current->ai_addrlen) == -1) {
+            close(sd);
+            sd = -1;
+        }
+    }
+
+    freeaddrinfo(results);
+    return sd;
+}
+
+/*
+ * Sends DATAGRAM_DONE until the server's report comes back. Returns false if it never did, or if the
+ * kernel says nobody is receiving on the port.
+ */
+bool askForReport(int sd, uint32_t flow, uint32_t sent, struct datagramReport* report) {
+    char done[DATAGRAM_HEADERSIZE];
+    encodeDatagramHeader(done, DATAGRAM_DONE, flow, sent, monotonicNanoseconds());
+
+    for (int attempt = 0; attempt < DATAGRAM_REPORT_TRIES; attempt++) {
+        if (send(sd, done, sizeof(done), 0) == -1 && errno == ECONNREFUSED) {
+            return false;
+        }
+
+        struct pollfd answer;
+        answer.fd = sd;
+        answer.events = POLLIN;
+        answer.revents = 0;
+
+        // a report for an earlier DONE of ours is just as good, anything else is skipped
+        while (poll(&answer, 1, DATAGRAM_REPORT_WAIT) == 1) {
+            char buffer[DATAGRAM_HEADERSIZE + DATAGRAM_REPORTSIZE];
+            long bytes = recv(sd, buffer, sizeof(buffer), 0);
+            struct datagramHeader header;
+
+            if (bytes == -1 && errno == ECONNREFUSED) {
+                return false;
+            }
+            if (bytes == (long) sizeof(buffer) && decodeDatagramHeader(buffer, bytes, &header)
+                && header.flags == DATAGRAM_REPORT && header.flow == flow) {
+                decodeDatagramReport(buffer + DATAGRAM_HEADERSIZE, report);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * The --udp transfer (see datagram.h). Sends iterations * nbufs datagrams of bufsize bytes (header
+ * included) to a server in the udp mode as fast as the socket takes them, DATAGRAM_CALL messages per
+ * sendmmsg() call, then gets the server's report. With gso every message carries up to
+ * DATAGRAM_MAX_SEGMENTS datagrams back to back and the kernel cuts them apart (UDP_SEGMENT), so a
+ * call moves that many times more datagrams. A blocking socket only waits for room in our own send
+ * buffer; whatever does not fit in the server's receive buffer is dropped and shows up as loss.
+ * Prints the same time, throughput and syscall lines as the TCP transfer, then packets/sec, loss,
+ * reordering and the one-way latency. Returns the program's exit status.
+ */
+int runDatagramTransfer(const char* host, const char* port, int iterations, int nbufs, int bufsize, bool gso) {
+    long total = (long) iterations * nbufs;
+
+    if (bufsize < DATAGRAM_HEADERSIZE || bufsize > DATAGRAM_MAXSIZE) {
+        cout << "with --udp bufsize must be between " << DATAGRAM_HEADERSIZE << " and " << DATAGRAM_MAXSIZE << " bytes" << endl;
+        return EXIT_FAILURE;
+    }
+    if (total > UINT32_MAX) {
+        cout << "with --udp iterations * nbufs must fit the 32 bit sequence numbers" << endl;
+        return EXIT_FAILURE;
+    }
+
+    int sd = getDatagramSocket(host, port);
+
+    if (sd == -1) {
+        cout << "Could not open a UDP socket to " << host << " port " << port << endl;
+        return EXIT_FAILURE;
+    }
+
+    applyBufferSizes(sd, &tuning);
+
+    // with GSO a message holds as many datagrams as fit in the largest UDP send, up to the kernel's limit
+    int perMessage = 1;
+
+    if (gso) {
+        perMessage = max(1, min(DATAGRAM_MAX_SEGMENTS, DATAGRAM_MAXSIZE / bufsize));
+
+        int segmentSize = bufsize;
+        if (setsockopt(sd, SOL_UDP, UDP_SEGMENT, &segmentSize, sizeof(int)) == -1) {
+            cout << "the kernel refused UDP_SEGMENT, run without --gso" << endl;
+            close(sd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    long bufferLength = (long) DATAGRAM_CALL * perMessage * bufsize;
+    char* datagrams = poolAllocate(bufferLength);
+    memset(datagrams, 0, bufferLength);
+
+    struct mmsghdr messages[DATAGRAM_CALL];
+    struct iovec segments[DATAGRAM_CALL];
+    memset(messages, 0, sizeof(messages));
+
+    for (int i = 0; i < DATAGRAM_CALL; i++) {
+        segments[i].iov_base = datagrams + (long) i * perMessage * bufsize;
+        messages[i].msg_hdr.msg_iov = &segments[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    // the flow number keeps our datagrams apart from other clients' on the server
+    uint32_t flow = (uint32_t) (monotonicNanoseconds() ^ ((long) getpid() << 16));
+    long syscalls = 0;
+    long sent = 0;
+    bool refused = false;
+
+    struct rusage usageBefore;
+    struct rusage usageAfter;
+    getrusage(RUSAGE_SELF, &usageBefore);
+    long start = monotonicNanoseconds();
+
+    while (sent < total && !refused) {
+        // stamp the datagrams of this call, every one gets its own sequence number and the same send time
+        long now = monotonicNanoseconds();
+        int count = 0;
+        long planned = sent;
+
+        while (count < DATAGRAM_CALL && planned < total) {
+            int inMessage = (int) min((long) perMessage, total - planned);
+            char* datagram = (char*) segments[count].iov_base;
+
+            for (int j = 0; j < inMessage; j++) {
+                encodeDatagramHeader(datagram + (long) j * bufsize, DATAGRAM_DATA, flow, (uint32_t) (planned + j), now);
+            }
+
+            segments[count].iov_len = (long) inMessage * bufsize;
+            planned += inMessage;
+            count++;
+        }
+
+        // sendmmsg can stop early (a signal, or an error after the first message), so send the rest again
+        int done = 0;
+
+        while (done < count) {
+            int result = sendmmsg(sd, messages + done, count - done, 0);
+            syscalls++;
+
+            if (result == -1) {
+                if (errno == ECONNREFUSED) {
+                    refused = true; // nobody is receiving, an earlier datagram came back as port unreachable
+                    break;
+                }
+                if (errno == EAGAIN || errno == ENOBUFS || errno == EINTR) {
+                    continue;
+                }
+
+                cout << "sendmmsg failed: " << strerror(errno) << (gso ? " (--gso needs bufsize to fit the path MTU)" : "") << endl;
+                poolFree(datagrams, bufferLength);
+                close(sd);
+                return EXIT_FAILURE;
+            }
+
+            done += result;
+        }
+
+        sent = planned;
+    }
+
+    long lap = monotonicNanoseconds();
+    getrusage(RUSAGE_SELF, &usageAfter);
+
+    struct datagramReport report;
+    bool reported = !refused && askForReport(sd, flow, (uint32_t) total, &report);
+    long end = monotonicNanoseconds();
+
+    poolFree(datagrams, bufferLength);
+    close(sd);
+
+    if (!reported) {
+        cout << "no report from the server, is it running with --mode=udp?" << endl;
+        return EXIT_FAILURE;
+    }
+
+    long transferTime = (lap - start) / 1000;
+    long totalTime = (end - start) / 1000;
+    long cpuTime = ((usageAfter.ru_utime.tv_sec - usageBefore.ru_utime.tv_sec) * 1000000L) + (usageAfter.ru_utime.tv_usec - usageBefore.ru_utime.tv_usec)
+        + ((usageAfter.ru_stime.tv_sec - usageBefore.ru_stime.tv_sec) * 1000000L) + (usageAfter.ru_stime.tv_usec - usageBefore.ru_stime.tv_usec);
+    double gigabytes = (double) total * bufsize / 1e9;
+    long sendingTime = max(transferTime, 1L);
+    long lost = total - (long) report.received;
+
+    cout << "data-transmission time = " << transferTime << " usec, round-trip time = " << totalTime << " usec (until the server's report)" << endl;
+    cout << "throughput = " << gigabytes / (sendingTime / 1e6) << " GB/s, cpu utilization = " << 100.0 * cpuTime / sendingTime << "%" << endl;
+    cout << "write syscalls = " << syscalls << " (" << (double) syscalls / iterations << " per iteration, "
+        << (gso ? "GSO, up to " + to_string(perMessage) + " datagrams per message" : "one datagram per message") << ")" << endl;
+    cout << "packets/sec = " << (long) (total / (sendingTime / 1e6)) << " sent, "
+        << (long) (report.received / (max((long) report.receiveTime, 1000L) / 1e9)) << " received" << endl;
+    cout << "datagrams sent = " << total << ", received = " << report.received << ", loss = " << 100.0 * lost / total << "% (" << lost
+        << " lost), reordered = " << report.reordered << ", duplicates = " << report.duplicates << ", late = " << report.late << endl;
+    cout << "one-way latency p50 = " << report.latencyP50 / 1000.0 << ", p99 = " << report.latencyP99 / 1000.0 << ", max = "
+        << report.latencyMax / 1000.0 << " usec (the server's clock minus ours, only meaningful on one machine)" << endl;
+
+    return 0;
 }
 
 int main(int argc, char** argv) {
     //cout << "opened program" << endl;
+    // a server that closes or resets a connection would otherwise kill the whole client with SIGPIPE on the next
+    // write. sendfile() has no MSG_NOSIGNAL, so ignore it once here and let every write see EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc < 7) {
+        cout << "usage: client port host iterations nbufs bufsize type [--pipeline=1,8,64,256] [--histogram=file.json|file.csv] [--hugepages] [--file=path]" << endl;
+        cout << "       [--profile=default|latency|throughput] [--nodelay] [--cork] [--quickack] [--sndbuf=N] [--rcvbuf=N] [--busypoll=usec] [--rcvlowat=N]" << endl;
+        cout << "       [--verify [--seed=N]] [--udp [--gso]]" << endl;
+        cout << "       [--connections=M --threads=T [--depth=N | --rate=R] [--duration=seconds | --bytes=N] [--dns-ttl=seconds]] [--clients=N]" << endl;
+        exit(EXIT_FAILURE);
+    }
+
     char* serverPort = argv[1]; // first argument is the port to the server
 	char* serverName = argv[2]; // servers IP address or host name
 	int iterations = atoi(argv[3]); // number of iterations a client performs on data transmission using one of the three methods
 	int nbufs = atoi(argv[4]); // the number of data buffers
 	int bufsize = atoi(argv[5]); // the size of each data buffer (in bytes)
-	int type = atoi(argv[6]); // the type of transfer scenario (1 for "multiple writes", 2 for "writev", 3 for "single write")
+	int type = atoi(argv[6]); // the type of transfer scenario (1 for "multiple writes", 2 for "single write", 3 for "writev", 4 for "zerocopy", 5 for "batched writev", 6 for "sendfile")
+
+	// if the type is not between 1 and 6, need to tell user as it is not valid
+	if(type < 1 || type > 6){
+		cout << "type must be bteween 1 and 6" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// the server only answers after the message marked as the last one, so there has to be at least one
+	if (iterations < 1 || nbufs < 1 || bufsize < 1) {
+		cout << "iterations, nbufs and bufsize must all be at least 1" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// --hugepages backs the buffer pool with huge pages when the system has them
+	setPoolHugepages(getOption(argc, argv, "hugepages", NULL) != NULL);
+
+	if (!getSocketProfile(argc, argv, &tuning)) {
+		cout << "profile must be default, latency or throughput" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	cout << "socket profile = " << describeProfile(&tuning) << endl;
 
-	// if the type is not between 1 and 3, need to tell user as it is not valid
-	if(type < 1 || type > 3){
-		cout << "type must be bteween 1 and 3" << endl;
+	// --verify has the server checksum the payloads, which only the single connection transfer checks
+	verifyPayloads = getOption(argc, argv, "verify", NULL) != NULL;
+	patternSeed = getIntOption(argc, argv, "seed", 1);
+
+	if (verifyPayloads && (getOption(argc, argv, "pipeline", NULL) != NULL || getOption(argc, argv, "connections", NULL) != NULL
+		|| getOption(argc, argv, "threads", NULL) != NULL || getOption(argc, argv, "clients", NULL) != NULL)) {
+		cout << "--verify works with the single connection transfer, not with --pipeline, --connections or --clients" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// --udp (or --gso, which implies it) sends datagrams to a server in the udp mode instead of the TCP transfer
+	if (getOption(argc, argv, "udp", NULL) != NULL || getOption(argc, argv, "gso", NULL) != NULL) {
+		if (verifyPayloads || getOption(argc, argv, "pipeline", NULL) != NULL || getOption(argc, argv, "connections", NULL) != NULL
+			|| getOption(argc, argv, "threads", NULL) != NULL || getOption(argc, argv, "clients", NULL) != NULL) {
+			cout << "--udp works on its own, not with --verify, --pipeline, --connections or --clients" << endl;
+			exit(EXIT_FAILURE);
+		}
+
+		return runDatagramTransfer(serverName, serverPort, iterations, nbufs, bufsize, getOption(argc, argv, "gso", NULL) != NULL);
+	}
+
+	// type 6 sends from a file, --file=path or an in-memory one
+	const char* payloadPath = getOption(argc, argv, "file", NULL);
+
+	if (type == 6 && !openPayloadFile(payloadPath, (long) nbufs * bufsize)) {
+		cout << "Could not open " << (payloadPath != NULL ? payloadPath : "an in-memory file") << " to send from (or it is empty)" << endl;
 		exit(EXIT_FAILURE);
 	}
 
+	uint32_t digest = verifyPayloads ? expectedDigest(iterations, (long) nbufs * bufsize, type) : 0;
+
 	// get the linked list of addrinfo that the connection() can understand
+	long resolveStart = monotonicNanoseconds();
 	struct addrinfo* addressGuesses = getAddressGuesses(serverPort, serverName);
+	long resolveTime = monotonicNanoseconds() - resolveStart;
 
     //cout << "guess 1: " << addressGuesses->ai_addr << endl;
 
-    int sd = getSocketDescriptor(addressGuesses);
+    // --connections or --threads turn the client into a load generator with many connections
+    if (getOption(argc, argv, "connections", NULL) != NULL || getOption(argc, argv, "threads", NULL) != NULL) {
+        if (type > 3) {
+            cout << "the load generator works with types 1 to 3" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        runLoadGenerator(serverName, serverPort, type, nbufs, bufsize, argc, argv);
+        freeaddrinfo(addressGuesses);
+        return 0;
+    }
+
+    // --clients=N runs N simulated clients as coroutines on this one thread
+    if (getOption(argc, argv, "clients", NULL) != NULL) {
+#ifdef HAVE_COROUTINES
+        if (type > 3) {
+            cout << "the simulated clients work with types 1 to 3" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        runSimulatedClients(addressGuesses, iterations, nbufs, bufsize, type, max(getIntOption(argc, argv, "clients", 1), 1L));
+        freeaddrinfo(addressGuesses);
+        return 0;
+#else
+        cout << "the client was built without C++20 coroutines, compile it with -std=c++20 for --clients" << endl;
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    struct connectReport connection;
+    long connectStart = monotonicNanoseconds();
+    int sd = getSocketDescriptor(addressGuesses, &connection);
+    long connectTime = monotonicNanoseconds() - connectStart;
 
     //cout << "successfully grabbed socket descriptor witha  value: " << sd << endl;
 
@@ -238,49 +1641,172 @@ int main(int argc, char** argv) {
         exit (EXIT_FAILURE);
     }
 
+    // connection setup is reported on its own so it does not hide in the transfer times below
+    cout << "resolve time = " << resolveTime / 1000 << " usec, connection setup time = " << connectTime / 1000 << " usec ("
+        << ((connection.family == AF_INET6) ? "IPv6" : "IPv4") << ", " << connection.attempts << " attempt"
+        << ((connection.attempts == 1) ? "" : "s") << ")" << endl;
+
+    // --pipeline=1,8,64,256 keeps the connection open and runs iterations requests at each of those depths
+    const char* pipelineDepths = getOption(argc, argv, "pipeline", NULL);
+    const char* histogramPath = getOption(argc, argv, "histogram", NULL); // --histogram=file.json or file.csv
+
+    if (pipelineDepths != NULL) {
+        if (type > 3) {
+            cout << "pipelining works with types 1 to 3" << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        vector<string> histogramNames;
+        vector<const struct latencyHistogram*> histograms;
+
+        for (const char* depthText = pipelineDepths; depthText != NULL; depthText = strchr(depthText, ',')) {
+            if (*depthText == ',') {
+                depthText++;
+            }
+
+            int depth = atoi(depthText);
+            if (depth < 1) {
+                depth = 1;
+            }
+
+            struct latencyHistogram* latencies = newHistogram();
+            long elapsed = runPipeline(sd, type, iterations, nbufs, bufsize, depth, latencies);
+
+            if (elapsed == -1) {
+                cout << "the connection broke at pipeline depth " << depth << endl;
+                delete latencies;
+                break;
+            }
+
+            cout << "pipeline depth = " << depth << ": " << iterations << " requests in " << elapsed / 1000 << " usec, "
+                << (long) (iterations / (elapsed / 1e9)) << " messages/sec" << endl;
+            printHistogram(cout, "pipeline depth = " + to_string(depth) + " latency", latencies);
+
+            histogramNames.push_back("pipeline_depth_" + to_string(depth) + "_ns");
+            histograms.push_back(latencies);
+        }
+
+        if (histogramPath != NULL && !writeHistograms(histogramPath, histogramNames, histograms)) {
+            cout << "Could not write the histograms to " << histogramPath << endl;
+        }
+
+        for (size_t i = 0; i < histograms.size(); i++) {
+            delete histograms[i];
+        }
+
+        close(sd);
+        return 0;
+    }
+
     // need to calculate the transfer time so steps for that are
 
-    // 1. declare needed variables (timeval is just a structure with 2 variables: seconds, and microseconds)
-    struct timeval start; // start time of sending data
-    struct timeval end; // end total time after sending and reading data
-    struct timeval lap; // end time of sending data
-    long transferTime; // lap - start
-    long totalTime; // end - start
+    // 1. declare needed variables (all times are monotonic clock nanoseconds, see histogram.h)
+    long start; // start time of sending data
+    long end; // end total time after sending and reading data
+    long lap; // end time of sending data
+    long transferTime; // lap - start, in usec
+    long totalTime; // end - start, in usec
+    struct latencyHistogram* sendTimes = newHistogram(); // how long each message took to write
 
-    // 2. start the starttime with the current time of day (i believe this is just linux time)
-    gettimeofday(&start, NULL); // sets start tot he current time of day. Second parameter is timezone
+    // cpu time (user + system) this process spends sending, which shows how much copying we save
+    struct rusage usageBefore;
+    struct rusage usageAfter;
+
+    // 2. start the starttime with the current time
+    getrusage(RUSAGE_SELF, &usageBefore);
+    start = monotonicNanoseconds();
 
     //cout << "start time: " << start.tv_usec << endl;
 
     // 3. Call the function to write to socket
     // if we have found a successful connection, write the data to the socket
-    writeToSocket(iterations, nbufs, bufsize, type, sd);
+    long syscalls = writeToSocket(iterations, nbufs, bufsize, type, sd, sendTimes);
 
-    // 4. When it is done writing, set the value of lap to the current time of day
-    gettimeofday(&lap, NULL);
+    // 4. When it is done writing, set the value of lap to the current time
+    lap = monotonicNanoseconds();
+    getrusage(RUSAGE_SELF, &usageAfter);
 
     //cout << "time done writing data: " << lap.tv_usec << endl;
 
     // 5. Now read back the information from the server (takes some time)
-    int numReads = 0;
-    read(sd, &numReads, sizeof(numReads)); // read takes in a pointer so need to dereference
+    // with --verify the digest of the payloads comes right after the number of reads
+    uint32_t acknowledgement[2] = { 0, 0 };
+    long wanted = verifyPayloads ? sizeof(acknowledgement) : sizeof(acknowledgement[0]);
+    long acknowledged = 0;
+
+    while (acknowledged < wanted) {
+        long bytes = read(sd, (char*) acknowledgement + acknowledged, wanted - acknowledged);
+        if (bytes <= 0) {
+            break;
+        }
+        acknowledged += bytes;
+    }
+
+    int numReads = ntohl(acknowledgement[0]); // the server sends it in network byte order
 
     // 6. Now check the time after reading (store as end)
-    gettimeofday(&end, NULL);
+    end = monotonicNanoseconds();
 
     //cout << "time done reading data back from server: " << end.tv_sec << endl;
 
     // 7. Calculate the transfer time (lap - start) & the total time (end - start)
-    transferTime = ((lap.tv_sec - start.tv_sec) * 1000000L) + (lap.tv_usec - start.tv_usec);
-    totalTime = ((end.tv_sec - start.tv_sec) * 1000000L) + (end.tv_usec - start.tv_usec);
+    transferTime = (lap - start) / 1000;
+    totalTime = (end - start) / 1000;
+
+    long cpuTime = ((usageAfter.ru_utime.tv_sec - usageBefore.ru_utime.tv_sec) * 1000000L) + (usageAfter.ru_utime.tv_usec - usageBefore.ru_utime.tv_usec)
+        + ((usageAfter.ru_stime.tv_sec - usageBefore.ru_stime.tv_sec) * 1000000L) + (usageAfter.ru_stime.tv_usec - usageBefore.ru_stime.tv_usec);
+    double gigabytes = (double) iterations * nbufs * bufsize / 1e9;
 
     // 8. Print the values in the format from the spec
     cout << "data-transmission time = " << transferTime << " usec, round-trip time = "
-        << totalTime << " usec, #reads = " << numReads << endl;
+        << totalTime << " usec, #reads = " << numReads << ", cpu time per GB = " << (long) (cpuTime / gigabytes) << " usec" << endl;
+
+    // how fast the data went out and how busy sending kept the CPU, to compare the copying types with type 6
+    long sendingTime = max(transferTime, 1L);
+    cout << "throughput = " << gigabytes / (sendingTime / 1e6) << " GB/s, cpu utilization = " << 100.0 * cpuTime / sendingTime << "%" << endl;
+
+    if (syscalls == -1) {
+        cout << "the connection broke while writing" << endl;
+    }
+    else {
+        cout << "write syscalls = " << syscalls << " (" << (double) syscalls / iterations << " per iteration)" << endl;
+        printHistogram(cout, (type == 5) ? "batch send time" : "message send time", sendTimes);
+    }
+
+    if (histogramPath != NULL) {
+        vector<string> names(1, "send_ns");
+        vector<const struct latencyHistogram*> histograms(1, sendTimes);
+
+        if (!writeHistograms(histogramPath, names, histograms)) {
+            cout << "Could not write the histograms to " << histogramPath << endl;
+        }
+    }
+
+    delete sendTimes;
+
+    if (payloadFile != -1) {
+        close(payloadFile);
+    }
 
     // 9. Finally, close the socket
     close(sd);
 
+    // the benchmark looks for "integrity = ok" in --verify runs
+    if (verifyPayloads) {
+        uint32_t received = ntohl(acknowledgement[1]);
+
+        if (acknowledged < wanted) {
+            cout << "integrity = no digest from the server (a --sink server does not check payloads)" << endl;
+            return EXIT_FAILURE;
+        }
+        if (received != digest) {
+            cout << "integrity = MISMATCH (sent crc32c " << hex << digest << ", the server computed " << received << dec << ")" << endl;
+            return EXIT_FAILURE;
+        }
+
+        cout << "integrity = ok (crc32c " << hex << digest << dec << " over " << (long) iterations * nbufs * bufsize << " bytes)" << endl;
+    }
+
     return 0;
 }
 
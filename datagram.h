@@ -0,0 +1,206 @@
+/*
+ * Datagram File Description:
+ * The wire format of the UDP transfer (client --udp, server --mode=udp). Every bufsize chunk the
+ * client sends is one datagram, and every datagram starts with a 24 byte header:
+ *
+ *   magic (4 bytes) | flags (2) | unused (2) | flow (4) | sequence number (4) | sent at (8)
+ *
+ * in network byte order. flow is a random number the client picks, so the server can keep the
+ * counts of several clients apart, and the sequence numbers run from 0 within a flow. sent at is the
+ * client's monotonic clock in nanoseconds when the datagram went out. The server subtracts it from
+ * its own monotonic clock for the one-way latency, which only means something when both run on the
+ * same machine (the loopback benchmarks), since two machines' monotonic clocks have nothing in common.
+ *
+ * UDP does not resend anything, so the server records which sequence numbers arrived in a bitmap
+ * (see sequenceTracker): a number seen twice is a duplicate, and one that arrives after a higher
+ * number is counted as reordered. The bitmap only covers the last SEQUENCE_WINDOW numbers below the
+ * highest one, so a datagram claiming a huge sequence number cannot make the server allocate for
+ * it; one that arrives even later than that is counted as late and not as received. When the client
+ * is done it sends a DATAGRAM_DONE datagram with the number it sent in the sequence field, and the
+ * server answers with a DATAGRAM_REPORT carrying its counts and latency percentiles (see
+ * datagramReport). The client counts the difference between sent and received as lost, and prints
+ * the late count next to it. DONE can get lost as well, so the client sends it again until the
+ * report arrives, and the server answers every copy.
+ *
+ * With GSO (client --gso) the client hands the kernel up to DATAGRAM_MAX_SEGMENTS datagrams in one
+ * buffer and the kernel cuts it into datagrams of bufsize (UDP_SEGMENT), so one sendmmsg() call
+ * moves many times more datagrams through the stack. The server turns on UDP_GRO, which makes the
+ * kernel join datagrams of the same flow back into one buffer and say how big each one was, so a
+ * recvmmsg() call can bring in up to 64 KB per slot.
+ */
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include <stdint.h>
+#include <endian.h>       // htobe64, be64toh
+#include <arpa/inet.h>    // htonl, ntohl, htons, ntohs
+
+#include <vector>
+#include <cstring>
+
+const uint32_t DATAGRAM_MAGIC = 0x42534B55; // "BSKU"
+const int DATAGRAM_HEADERSIZE = 24;
+const int DATAGRAM_MAXSIZE = 65507; // the most a UDP datagram over IPv4 can carry
+const int DATAGRAM_MAX_SEGMENTS = 64; // datagrams one UDP_SEGMENT send can be cut into (the kernel's UDP_MAX_SEGMENTS)
+
+const uint16_t DATAGRAM_DATA = 1; // a chunk of the transfer
+const uint16_t DATAGRAM_DONE = 2; // the client sent everything, sequence says how many
+const uint16_t DATAGRAM_REPORT = 4; // the server's answer to DONE, followed by a datagramReport
+
+struct datagramHeader {
+	uint32_t magic;
+	uint16_t flags;
+	uint32_t flow;
+	uint32_t sequence;
+	uint64_t sentAt; // client's monotonic clock, nanoseconds
+};
+
+// writes a datagram header into out (which must have DATAGRAM_HEADERSIZE bytes of room)
+inline void encodeDatagramHeader(char* out, uint16_t flags, uint32_t flow, uint32_t sequence, uint64_t sentAt) {
+	uint32_t magic = htonl(DATAGRAM_MAGIC);
+	uint16_t networkFlags = htons(flags);
+	uint32_t networkFlow = htonl(flow);
+	uint32_t networkSequence = htonl(sequence);
+	uint64_t networkSentAt = htobe64(sentAt);
+
+	memcpy(out, &magic, 4);
+	memcpy(out + 4, &networkFlags, 2);
+	memset(out + 6, 0, 2);
+	memcpy(out + 8, &networkFlow, 4);
+	memcpy(out + 12, &networkSequence, 4);
+	memcpy(out + 16, &networkSentAt, 8);
+}
+
+// reads a header back out of a datagram of length bytes, returns false if it is not one of ours
+inline bool decodeDatagramHeader(const char* in, long length, struct datagramHeader* header) {
+	if (length < DATAGRAM_HEADERSIZE) {
+		return false;
+	}
+
+	memcpy(&header->magic, in, 4);
+	memcpy(&header->flags, in + 4, 2);
+	memcpy(&header->flow, in + 8, 4);
+	memcpy(&header->sequence, in + 12, 4);
+	memcpy(&header->sentAt, in + 16, 8);
+
+	header->magic = ntohl(header->magic);
+	header->flags = ntohs(header->flags);
+	header->flow = ntohl(header->flow);
+	header->sequence = ntohl(header->sequence);
+	header->sentAt = be64toh(header->sentAt);
+
+	return header->magic == DATAGRAM_MAGIC;
+}
+
+// what the server saw of one flow, sent back in the DATAGRAM_REPORT
+struct datagramReport {
+	uint64_t received; // distinct sequence numbers that arrived
+	uint64_t duplicates;
+	uint64_t reordered; // arrived after a higher sequence number
+	uint64_t late; // arrived too far behind to tell whether they were new (see sequenceTracker)
+	uint64_t receiveTime; // nanoseconds from the first datagram to the last one
+	uint64_t latencyP50; // one-way, nanoseconds
+	uint64_t latencyP99;
+	uint64_t latencyMax;
+};
+
+const int DATAGRAM_REPORTSIZE = 8 * 8;
+
+inline void encodeDatagramReport(char* out, const struct datagramReport* report) {
+	const uint64_t fields[8] = { report->received, report->duplicates, report->reordered, report->late,
+		report->receiveTime, report->latencyP50, report->latencyP99, report->latencyMax };
+
+	for (int i = 0; i < 8; i++) {
+		uint64_t field = htobe64(fields[i]);
+		memcpy(out + 8 * i, &field, 8);
+	}
+}
+
+inline void decodeDatagramReport(const char* in, struct datagramReport* report) {
+	uint64_t fields[8];
+
+	for (int i = 0; i < 8; i++) {
+		memcpy(&fields[i], in + 8 * i, 8);
+		fields[i] = be64toh(fields[i]);
+	}
+
+	report->received = fields[0];
+	report->duplicates = fields[1];
+	report->reordered = fields[2];
+	report->late = fields[3];
+	report->receiveTime = fields[4];
+	report->latencyP50 = fields[5];
+	report->latencyP99 = fields[6];
+	report->latencyMax = fields[7];
+}
+
+const uint32_t SEQUENCE_WINDOW = 1 << 16; // sequence numbers below the highest one a flow remembers, a power of two
+
+/*
+ * Which sequence numbers of a flow arrived, one bit each, plus the counts the report needs. The
+ * bitmap is a ring of SEQUENCE_WINDOW bits (8 KB) that slides up with the highest number seen:
+ * number n lives in bit n % SEQUENCE_WINDOW, and a bit is cleared when the window moves past it.
+ */
+struct sequenceTracker {
+	std::vector<uint64_t> seen;
+	uint64_t end; // one past the highest sequence number seen, 0 before the first one
+	uint64_t received;
+	uint64_t duplicates;
+	uint64_t reordered;
+	uint64_t late; // arrived after the window moved past them, so whether they were new is unknown
+};
+
+inline void resetSequenceTracker(struct sequenceTracker* tracker) {
+	tracker->seen.assign(SEQUENCE_WINDOW / 64, 0);
+	tracker->end = 0;
+	tracker->received = 0;
+	tracker->duplicates = 0;
+	tracker->reordered = 0;
+	tracker->late = 0;
+}
+
+inline void clearSequence(struct sequenceTracker* tracker, uint64_t sequence) {
+	uint32_t bit = sequence % SEQUENCE_WINDOW;
+	tracker->seen[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+inline void trackSequence(struct sequenceTracker* tracker, uint32_t sequence) {
+	bool behind = false; // a higher number arrived before this one
+
+	if (sequence >= tracker->end) {
+		// slide the window up, forgetting the numbers that fall out of it (all of them after a big jump)
+		if (sequence - tracker->end >= SEQUENCE_WINDOW) {
+			tracker->seen.assign(SEQUENCE_WINDOW / 64, 0);
+		}
+		else {
+			for (uint64_t passed = tracker->end; passed <= sequence; passed++) {
+				clearSequence(tracker, passed);
+			}
+		}
+		tracker->end = (uint64_t) sequence + 1;
+	}
+	else if (tracker->end - sequence > SEQUENCE_WINDOW) {
+		tracker->late++;
+		return;
+	}
+	else {
+		behind = true;
+	}
+
+	uint32_t bit = sequence % SEQUENCE_WINDOW;
+	uint64_t mask = 1ULL << (bit % 64);
+
+	if (tracker->seen[bit / 64] & mask) {
+		tracker->duplicates++;
+		return;
+	}
+
+	tracker->seen[bit / 64] |= mask;
+	tracker->received++;
+
+	if (behind) {
+		tracker->reordered++;
+	}
+}
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Handoff File Description:
+ * Hot restart for the server: a running server hands its listening sockets to a new server process,
+ * so a new build can take over the port without a moment where nobody listens and without losing the
+ * connections that are waiting in the listen backlog (the backlog belongs to the socket, not the
+ * process, so it moves along with it).
+ *
+ * The running server is started with --handoff=/path/to/socket and listens there. The new one is
+ * started with --takeover=/path/to/socket: it connects, receives every listening socket in one message
+ * as SCM_RIGHTS ancillary data (receiveListeningSockets), finishes every setup step that could still
+ * make it exit, and only then answers with one byte (confirmTakeover). The old server echoes that byte
+ * back, and only once the echo went out does it stop accepting and drain its connections. The new
+ * server only starts serving once it read the echo. If either side gives up waiting (HANDOFF_TIMEOUT)
+ * or goes away first, the old server keeps serving and the new one exits, so the two never both
+ * accept. The new server usually gets --handoff with the same path too, so it can be replaced the
+ * same way later.
+ */
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <sys/types.h>    // socket
+#include <sys/socket.h>   // socket, sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/un.h>       // sockaddr_un
+#include <sys/time.h>     // timeval
+#include <unistd.h>       // read, write, close, unlink
+
+#include <vector>
+#include <cstring>
+
+const int MAXHANDOFF = 253; // descriptors one SCM_RIGHTS message can carry (the kernel's SCM_MAX_FD)
+const int HANDOFF_TIMEOUT = 5; // seconds either server waits for the other's answer
+
+// makes reads on a handoff connection give up after HANDOFF_TIMEOUT instead of waiting forever
+inline void limitHandoffWait(int connection) {
+	struct timeval answerTime;
+	answerTime.tv_sec = HANDOFF_TIMEOUT;
+	answerTime.tv_usec = 0;
+	setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &answerTime, sizeof(answerTime));
+}
+
+inline void handoffAddress(const char* path, struct sockaddr_un* address) {
+	memset(address, 0, sizeof(*address));
+	address->sun_family = AF_UNIX;
+	strncpy(address->sun_path, path, sizeof(address->sun_path) - 1);
+}
+
+// the Unix socket a running server waits on for the server that replaces it, or -1
+inline int openHandoffSocket(const char* path) {
+	struct sockaddr_un address;
+	handoffAddress(path, &address);
+
+	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path); // left over from an earlier run, or the socket of the server this one replaced
+
+	if (sd == -1 || bind(sd, (struct sockaddr*) &address, sizeof(address)) == -1 || listen(sd, 1) == -1) {
+		return -1;
+	}
+
+	return sd;
+}
+
+// sends the listening sockets over a connection from a new server, returns false if that failed
+inline bool sendListeningSockets(int connection, const std::vector<int>& sockets) {
+	if (sockets.empty() || sockets.size() > (size_t) MAXHANDOFF) {
+		return false;
+	}
+
+	int count = sockets.size();
+	struct iovec data;
+	data.iov_base = &count;
+	data.iov_len = sizeof(count);
+
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data();
+	message.msg_controllen = control.size();
+
+	struct cmsghdr* descriptors = CMSG_FIRSTHDR(&message);
+	descriptors->cmsg_level = SOL_SOCKET;
+	descriptors->cmsg_type = SCM_RIGHTS;
+	descriptors->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(descriptors), sockets.data(), sizeof(int) * count);
+
+	return sendmsg(connection, &message, MSG_NOSIGNAL) == sizeof(count);
+}
+
+/*
+ * Waits for the new server sendListeningSockets sent to to answer and echoes the answer back. Returns
+ * true once the echo went out, false if the new server went away or did not answer in time (the
+ * sockets are still ours then).
+ */
+inline bool acknowledgeTakeover(int connection) {
+	limitHandoffWait(connection); // a new server that never answers must not keep this one from stopping forever
+	char answer;
+	if (read(connection, &answer, 1) != 1) {
+		return false;
+	}
+
+	return send(connection, &answer, 1, MSG_NOSIGNAL) == 1;
+}
+
+/*
+ * Connects to the running server at path and receives its listening sockets. The old server keeps
+ * accepting until confirmTakeover answers on the connection this returns. Returns -1 if there is no
+ * server there or it had nothing to hand over.
+ */
+inline int receiveListeningSockets(const char* path, std::vector<int>* sockets) {
+	struct sockaddr_un address;
+	handoffAddress(path, &address);
+
+	int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sd == -1 || connect(sd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+		close(sd);
+		return -1;
+	}
+
+	int count = 0;
+	struct iovec data;
+	data.iov_base = &count;
+	data.iov_len = sizeof(count);
+
+	std::vector<char> control(CMSG_SPACE(sizeof(int) * MAXHANDOFF));
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control.data();
+	message.msg_controllen = control.size();
+
+	// MSG_CMSG_CLOEXEC so the sockets do not leak into anything this server starts later
+	long bytes = recvmsg(sd, &message, MSG_CMSG_CLOEXEC);
+	struct cmsghdr* descriptors = CMSG_FIRSTHDR(&message);
+
+	if (bytes != sizeof(count) || descriptors == NULL || descriptors->cmsg_type != SCM_RIGHTS) {
+		close(sd);
+		return -1;
+	}
+
+	int received = (descriptors->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	sockets->resize(received);
+	memcpy(sockets->data(), CMSG_DATA(descriptors), sizeof(int) * received);
+
+	if (received == 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+/*
+ * Tells the old server over the connection receiveListeningSockets returned that this one is ready
+ * to serve, and waits for it to echo that back, which it only does once it stops accepting. Returns
+ * false if the echo did not come, then the old server kept its sockets and is still serving.
+ */
+inline bool confirmTakeover(int connection) {
+	char answer = 1;
+	limitHandoffWait(connection);
+	bool answered = send(connection, &answer, 1, MSG_NOSIGNAL) == 1 && read(connection, &answer, 1) == 1;
+	close(connection);
+
+	return answered;
+}
+
+#endif
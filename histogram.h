@@ -0,0 +1,280 @@
+/*
+ * Histogram File Description:
+ * An HDR-style latency histogram. Values (nanoseconds) go into log-linear buckets: every power of
+ * two is split into 64 equal sub-buckets, so a recorded value is off by at most 1/64 (about 1.5%)
+ * no matter if it is 200 nanoseconds or 20 seconds, and the whole range fits in a few thousand
+ * counters. That is what lets us report tail percentiles instead of one average.
+ *
+ * Every thread records into its own histogram. The counters are atomics, but since only the owning
+ * thread ever writes them a record is a plain load and store with no lock and no locked instruction.
+ * Other threads can still read them at any time, which is how the histograms are merged at the end of
+ * a run. Times come from clock_gettime(CLOCK_MONOTONIC), which does not jump when the wall clock is
+ * adjusted and is served from the vDSO without a real syscall.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+const int HISTOGRAM_SUBBUCKET_BITS = 7; // 2^7 exact values below 128, then 64 sub-buckets per power of two
+const int HISTOGRAM_HALF = 1 << (HISTOGRAM_SUBBUCKET_BITS - 1);
+const int HISTOGRAM_BUCKETS = (64 - HISTOGRAM_SUBBUCKET_BITS + 2) * HISTOGRAM_HALF;
+
+// current time in nanoseconds from the monotonic clock
+inline long monotonicNanoseconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+struct latencyHistogram {
+	std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS];
+	std::atomic<uint64_t> total; // values recorded
+	std::atomic<uint64_t> sum; // of all values, for the mean
+	std::atomic<uint64_t> max;
+};
+
+inline void resetHistogram(struct latencyHistogram* histogram) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		histogram->counts[i].store(0, std::memory_order_relaxed);
+	}
+
+	histogram->total.store(0, std::memory_order_relaxed);
+	histogram->sum.store(0, std::memory_order_relaxed);
+	histogram->max.store(0, std::memory_order_relaxed);
+}
+
+inline struct latencyHistogram* newHistogram() {
+	struct latencyHistogram* histogram = new latencyHistogram;
+	resetHistogram(histogram);
+	return histogram;
+}
+
+// which bucket a value lands in
+inline int histogramIndex(uint64_t value) {
+	int highestBit = 63 - __builtin_clzll(value | 1);
+
+	if (highestBit < HISTOGRAM_SUBBUCKET_BITS) {
+		return (int) value; // small values get a bucket each
+	}
+
+	// keep the top HISTOGRAM_SUBBUCKET_BITS bits of the value and count how many we dropped
+	int shift = highestBit - HISTOGRAM_SUBBUCKET_BITS + 1;
+	return shift * HISTOGRAM_HALF + (int) (value >> shift);
+}
+
+// the smallest value that lands in a bucket
+inline uint64_t histogramLowestValue(int index) {
+	if (index < 2 * HISTOGRAM_HALF) {
+		return index;
+	}
+
+	int shift = index / HISTOGRAM_HALF - 1;
+	uint64_t subBucket = index - shift * HISTOGRAM_HALF;
+	return subBucket << shift;
+}
+
+// the largest value that lands in a bucket, which is what percentiles report (never under-reports)
+inline uint64_t histogramHighestValue(int index) {
+	return histogramLowestValue(index + 1) - 1;
+}
+
+/*
+ * Adds one value. Must only be called by the thread that owns the histogram, which is why a load
+ * followed by a store is enough and no atomic read-modify-write is needed.
+ */
+inline void recordValue(struct latencyHistogram* histogram, long value) {
+	uint64_t positive = (value < 0) ? 0 : (uint64_t) value;
+	std::atomic<uint64_t>& bucket = histogram->counts[histogramIndex(positive)];
+
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	histogram->total.store(histogram->total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	histogram->sum.store(histogram->sum.load(std::memory_order_relaxed) + positive, std::memory_order_relaxed);
+
+	if (positive > histogram->max.load(std::memory_order_relaxed)) {
+		histogram->max.store(positive, std::memory_order_relaxed);
+	}
+}
+
+// adds every count in from into into (into must not be written by anyone else while this runs)
+inline void mergeHistogram(struct latencyHistogram* into, const struct latencyHistogram* from) {
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		uint64_t count = from->counts[i].load(std::memory_order_relaxed);
+
+		if (count != 0) {
+			into->counts[i].store(into->counts[i].load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+		}
+	}
+
+	into->total.store(into->total.load(std::memory_order_relaxed) + from->total.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	into->sum.store(into->sum.load(std::memory_order_relaxed) + from->sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	if (from->max.load(std::memory_order_relaxed) > into->max.load(std::memory_order_relaxed)) {
+		into->max.store(from->max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+}
+
+// the value below which the given fraction (0.99 for p99) of the recorded values fall
+inline uint64_t valueAtPercentile(const struct latencyHistogram* histogram, double fraction) {
+	uint64_t total = histogram->total.load(std::memory_order_relaxed);
+
+	if (total == 0) {
+		return 0;
+	}
+
+	uint64_t wanted = (uint64_t) (fraction * total + 0.5);
+	if (wanted < 1) {
+		wanted = 1;
+	}
+
+	uint64_t seen = 0;
+
+	for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i].load(std::memory_order_relaxed);
+
+		if (seen >= wanted) {
+			return std::min(histogramHighestValue(i), histogram->max.load(std::memory_order_relaxed));
+		}
+	}
+
+	return histogram->max.load(std::memory_order_relaxed);
+}
+
+/*
+ * Prints one line with the count and the usual percentiles, converted to microseconds.
+ */
+inline void printHistogram(std::ostream& out, const std::string& label, const struct latencyHistogram* histogram) {
+	uint64_t total = histogram->total.load(std::memory_order_relaxed);
+	double mean = (total == 0) ? 0 : (double) histogram->sum.load(std::memory_order_relaxed) / total;
+
+	char line[256];
+	snprintf(line, sizeof(line), "count = %lu, mean = %.1f, p50 = %.1f, p90 = %.1f, p99 = %.1f, p99.9 = %.1f, max = %.1f usec",
+		(unsigned long) total, mean / 1000,
+		valueAtPercentile(histogram, 0.50) / 1000.0, valueAtPercentile(histogram, 0.90) / 1000.0,
+		valueAtPercentile(histogram, 0.99) / 1000.0, valueAtPercentile(histogram, 0.999) / 1000.0,
+		histogram->max.load(std::memory_order_relaxed) / 1000.0);
+
+	out << label << ": " << line << std::endl;
+}
+
+/*
+ * Writes several histograms to a file for other tools to read. A path ending in .json gets one JSON
+ * object per histogram with its percentiles and every non-empty bucket; anything else gets CSV rows
+ * of name,bucket_ns,count. Returns false if the file could not be written.
+ */
+inline bool writeHistograms(const std::string& path, const std::vector<std::string>& names, const std::vector<const struct latencyHistogram*>& histograms) {
+	std::ofstream out(path.c_str());
+
+	if (!out) {
+		return false;
+	}
+
+	bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+
+	if (json) {
+		out << "{" << std::endl;
+	}
+	else {
+		out << "name,bucket_ns,count" << std::endl;
+	}
+
+	for (size_t h = 0; h < histograms.size(); h++) {
+		const struct latencyHistogram* histogram = histograms[h];
+
+		if (json) {
+			out << "  \"" << names[h] << "\": {\"count\": " << histogram->total.load(std::memory_order_relaxed)
+				<< ", \"p50_ns\": " << valueAtPercentile(histogram, 0.50)
+				<< ", \"p90_ns\": " << valueAtPercentile(histogram, 0.90)
+				<< ", \"p99_ns\": " << valueAtPercentile(histogram, 0.99)
+				<< ", \"p999_ns\": " << valueAtPercentile(histogram, 0.999)
+				<< ", \"max_ns\": " << histogram->max.load(std::memory_order_relaxed)
+				<< ", \"buckets\": [";
+		}
+
+		bool first = true;
+
+		for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+			uint64_t count = histogram->counts[i].load(std::memory_order_relaxed);
+
+			if (count == 0) {
+				continue;
+			}
+
+			if (json) {
+				out << (first ? "" : ", ") << "[" << histogramLowestValue(i) << ", " << count << "]";
+			}
+			else {
+				out << names[h] << "," << histogramLowestValue(i) << "," << count << std::endl;
+			}
+
+			first = false;
+		}
+
+		if (json) {
+			out << "]}" << (h + 1 < histograms.size() ? "," : "") << std::endl;
+		}
+	}
+
+	if (json) {
+		out << "}" << std::endl;
+	}
+
+	return true;
+}
+
+/*
+ * Keeps track of the per-thread histograms of one measurement so they can be merged at the end.
+ * The lock is only taken when a thread registers or retires its histogram, never while recording.
+ * A retired histogram (its thread is gone) is folded into retired so the memory can be freed.
+ */
+struct histogramRegistry {
+	pthread_mutex_t lock;
+	std::vector<struct latencyHistogram*> live;
+	struct latencyHistogram* retired;
+};
+
+inline void initRegistry(struct histogramRegistry* registry) {
+	pthread_mutex_init(&registry->lock, NULL);
+	registry->retired = newHistogram();
+}
+
+inline struct latencyHistogram* registerHistogram(struct histogramRegistry* registry) {
+	struct latencyHistogram* histogram = newHistogram();
+
+	pthread_mutex_lock(&registry->lock);
+	registry->live.push_back(histogram);
+	pthread_mutex_unlock(&registry->lock);
+
+	return histogram;
+}
+
+inline void retireHistogram(struct histogramRegistry* registry, struct latencyHistogram* histogram) {
+	pthread_mutex_lock(&registry->lock);
+	mergeHistogram(registry->retired, histogram);
+	registry->live.erase(std::find(registry->live.begin(), registry->live.end(), histogram));
+	pthread_mutex_unlock(&registry->lock);
+
+	delete histogram;
+}
+
+// merges every live and retired histogram of the registry into into
+inline void collectRegistry(struct histogramRegistry* registry, struct latencyHistogram* into) {
+	pthread_mutex_lock(&registry->lock);
+	mergeHistogram(into, registry->retired);
+	for (size_t i = 0; i < registry->live.size(); i++) {
+		mergeHistogram(into, registry->live[i]);
+	}
+	pthread_mutex_unlock(&registry->lock);
+}
+
+#endif
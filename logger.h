@@ -0,0 +1,247 @@
+/*
+ * Logger File Description:
+ * An asynchronous logger that keeps formatting and console writes off the threads serving clients.
+ * Every such thread owns a logRing, a fixed size single-producer single-consumer ring of small
+ * binary logRecords. Logging something is a level check and a copy of one record into the ring,
+ * with no lock, no formatting and no syscall. One drain thread takes the records out of every
+ * ring, formats them and writes them in batches with a single write() per pass.
+ *
+ * When a ring is full the record is dropped instead of making the serving thread wait, and the
+ * ring counts how many it dropped so the loss shows up in the report instead of going unnoticed.
+ */
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <unistd.h>       // write, usleep
+#include <pthread.h>      // pthread_create, pthread_mutex_lock
+#include <stdio.h>        // snprintf
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+const int LOG_RING_SIZE = 1024; // records each thread can have waiting, must be a power of two
+const int LOG_DRAIN_INTERVAL = 1000; // microseconds the drain thread sleeps when every ring was empty
+
+enum logLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+// what a record is about, which decides how the drain thread formats its fields
+enum logEvent {
+	EVENT_CONNECTION_DONE, // a connection was acknowledged: times, payload bytes and reads
+	EVENT_CONNECTION_REJECTED, // the pool's queue was full: reads holds the number rejected so far
+	EVENT_ACCEPT_FAILED, // accept() failed: bytes holds the errno
+	EVENT_SINK_DONE, // a sink mode connection ended: times, bytes spliced and the CPU time it took
+	EVENT_THREAD_FAILED // no thread could be started for a connection: bytes holds the error
+};
+
+struct logRecord {
+	int level;
+	int event;
+	long connection; // numbered per thread, printed as thread.connection
+	long startedAt; // monotonic nanoseconds
+	long endedAt;
+	long bytes;
+	long reads;
+	long cpuTime; // nanoseconds of CPU the serving thread spent, only set for EVENT_SINK_DONE
+};
+
+/*
+ * head and tail only ever count up, the slot is the count masked by LOG_RING_SIZE - 1. The owning
+ * thread is the only one that moves tail and the drain thread the only one that moves head, so
+ * each side just publishes its index with a release store. They sit on their own cache lines so
+ * the two threads do not keep stealing the line from each other.
+ */
+struct logRing {
+	struct logRecord records[LOG_RING_SIZE];
+	alignas(64) std::atomic<size_t> head; // next record to drain
+	alignas(64) std::atomic<size_t> tail; // next free slot
+	std::atomic<long> dropped; // records thrown away because the ring was full
+	std::atomic<bool> retired; // the owning thread is gone, free the ring once it is drained
+	int thread; // number printed in front of connection ids
+	long nextConnection; // only touched by the owning thread
+};
+
+struct asyncLogger {
+	pthread_mutex_t lock; // guards rings and the draining itself, never taken while logging
+	pthread_mutex_t writeLock; // held across a whole drain so two drains write in order
+	std::vector<struct logRing*> rings;
+	std::atomic<int> level; // records below this level are skipped before they are copied
+	long retiredDropped; // drops of rings that were already freed
+	int nextThread;
+	int output; // file descriptor the drain thread writes to
+};
+
+// turns "debug", "info", "warn" or "error" into a logLevel, -1 if it is none of them
+inline int parseLogLevel(const char* name) {
+	const char* names[] = { "debug", "info", "warn", "error" };
+
+	for (int i = 0; i < 4; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+inline void initLogger(struct asyncLogger* logger, int level, int output) {
+	pthread_mutex_init(&logger->lock, NULL);
+	pthread_mutex_init(&logger->writeLock, NULL);
+	logger->level.store(level, std::memory_order_relaxed);
+	logger->retiredDropped = 0;
+	logger->nextThread = 0;
+	logger->output = output;
+}
+
+inline struct logRing* registerLogRing(struct asyncLogger* logger) {
+	struct logRing* ring = new logRing;
+	ring->head.store(0, std::memory_order_relaxed);
+	ring->tail.store(0, std::memory_order_relaxed);
+	ring->dropped.store(0, std::memory_order_relaxed);
+	ring->retired.store(false, std::memory_order_relaxed);
+	ring->nextConnection = 0;
+
+	pthread_mutex_lock(&logger->lock);
+	ring->thread = logger->nextThread++;
+	logger->rings.push_back(ring);
+	pthread_mutex_unlock(&logger->lock);
+
+	return ring;
+}
+
+// called by the owning thread as it ends, the drain thread frees the ring after its last records
+inline void retireLogRing(struct logRing* ring) {
+	ring->retired.store(true, std::memory_order_release);
+}
+
+inline bool logEnabled(struct asyncLogger* logger, int level) {
+	return level >= logger->level.load(std::memory_order_relaxed);
+}
+
+/*
+ * Copies one record into the calling thread's ring. Must only be called by the thread that owns
+ * the ring. Returns false if the record was filtered out or dropped.
+ */
+inline bool appendLog(struct asyncLogger* logger, struct logRing* ring, const struct logRecord& record) {
+	if (!logEnabled(logger, record.level)) {
+		return false;
+	}
+
+	size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+	if (tail - ring->head.load(std::memory_order_acquire) >= (size_t) LOG_RING_SIZE) {
+		ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return false;
+	}
+
+	ring->records[tail & (LOG_RING_SIZE - 1)] = record;
+	ring->tail.store(tail + 1, std::memory_order_release);
+	return true;
+}
+
+// writes the text for one record into out, returns its length
+inline int formatLogRecord(const struct logRecord& record, int thread, char* out, size_t room) {
+	switch (record.event) {
+	case EVENT_CONNECTION_DONE:
+		return snprintf(out, room, "data-receiving time = %ld usec (connection %d.%ld, %ld bytes in %ld reads)\n",
+			(record.endedAt - record.startedAt) / 1000, thread, record.connection, record.bytes, record.reads);
+	case EVENT_CONNECTION_REJECTED:
+		return snprintf(out, room, "queue full, rejected connection (%ld so far)\n", record.reads);
+	case EVENT_ACCEPT_FAILED:
+		return snprintf(out, room, "Failed to accept client connection request: %s\n", strerror((int) record.bytes));
+	case EVENT_SINK_DONE: {
+		long elapsed = std::max(record.endedAt - record.startedAt, 1L);
+		return snprintf(out, room, "sink: %ld bytes in %ld usec = %.3f GB/s, cpu time = %ld usec (%.1f%% of a core) (connection %d.%ld)\n",
+			record.bytes, elapsed / 1000, (double) record.bytes / elapsed, record.cpuTime / 1000,
+			100.0 * record.cpuTime / elapsed, thread, record.connection);
+	}
+	case EVENT_THREAD_FAILED:
+		return snprintf(out, room, "Could not start a thread for a client connection, closed it: %s\n", strerror((int) record.bytes));
+	default:
+		return snprintf(out, room, "unknown log event %d\n", record.event);
+	}
+}
+
+/*
+ * Takes every waiting record out of every ring, formats them and writes them out with one write(),
+ * and frees the rings of threads that have ended. Safe to call from any thread, which is how the
+ * last records get out when the server stops. The write happens after lock is released, so a
+ * thread registering its ring never waits on the output. Returns how many records it wrote.
+ */
+inline long drainLog(struct asyncLogger* logger) {
+	std::string text;
+	long drained = 0;
+	char line[256];
+
+	pthread_mutex_lock(&logger->writeLock);
+	pthread_mutex_lock(&logger->lock);
+
+	for (size_t i = 0; i < logger->rings.size(); ) {
+		struct logRing* ring = logger->rings[i];
+		bool retired = ring->retired.load(std::memory_order_acquire); // read first, nothing is logged after it is set
+		size_t head = ring->head.load(std::memory_order_relaxed);
+		size_t tail = ring->tail.load(std::memory_order_acquire);
+
+		for (; head != tail; head++) {
+			int length = formatLogRecord(ring->records[head & (LOG_RING_SIZE - 1)], ring->thread, line, sizeof(line));
+			text.append(line, std::min((size_t) length, sizeof(line) - 1));
+			drained++;
+		}
+
+		ring->head.store(head, std::memory_order_release);
+
+		if (retired) {
+			logger->retiredDropped += ring->dropped.load(std::memory_order_relaxed);
+			logger->rings.erase(logger->rings.begin() + i);
+			delete ring;
+		}
+		else {
+			i++;
+		}
+	}
+
+	pthread_mutex_unlock(&logger->lock);
+
+	size_t written = 0;
+	while (written < text.size()) {
+		long bytes = write(logger->output, text.data() + written, text.size() - written);
+
+		if (bytes <= 0) {
+			break; // nobody is reading the output anymore, the records are lost either way
+		}
+
+		written += bytes;
+	}
+
+	pthread_mutex_unlock(&logger->writeLock);
+	return drained;
+}
+
+// records dropped so far because a ring was full
+inline long logDropped(struct asyncLogger* logger) {
+	pthread_mutex_lock(&logger->lock);
+	long dropped = logger->retiredDropped;
+	for (size_t i = 0; i < logger->rings.size(); i++) {
+		dropped += logger->rings[i]->dropped.load(std::memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&logger->lock);
+
+	return dropped;
+}
+
+// body of the drain thread, started with pthread_create(&thread, NULL, runLogDrain, logger)
+inline void* runLogDrain(void* input) {
+	struct asyncLogger* logger = (struct asyncLogger*)input;
+
+	while (1) {
+		if (drainLog(logger) == 0) {
+			usleep(LOG_DRAIN_INTERVAL);
+		}
+	}
+
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * MPMC Queue File Description:
+ * A fixed size, lock-free queue that any number of threads can push into and pop from at the
+ * same time (multi-producer, multi-consumer). It is the ring buffer design by Dmitry Vyukov:
+ * every slot carries a sequence number, and a thread claims a slot by moving the shared head or
+ * tail index forward with a compare-and-swap. Nobody ever holds a lock, so a slow thread can
+ * not stop the others. The server uses it to hand accepted sockets to its worker pool.
+ */
+#ifndef MPMCQUEUE_H
+#define MPMCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+
+template <typename T>
+class MPMCQueue {
+public:
+	// capacity is rounded up to a power of two so the slot index is a cheap bit mask
+	explicit MPMCQueue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity) {
+			size *= 2;
+		}
+
+		mask = size - 1;
+		slots = new Slot[size];
+
+		// slot i is free for the push that has position i
+		for (size_t i = 0; i < size; i++) {
+			slots[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		tail.store(0, std::memory_order_relaxed);
+		head.store(0, std::memory_order_relaxed);
+	}
+
+	~MPMCQueue() {
+		delete[] slots;
+	}
+
+	// returns false instead of waiting when the queue is full
+	bool push(const T& value) {
+		size_t position = tail.load(std::memory_order_relaxed);
+
+		while (1) {
+			Slot* slot = &slots[position & mask];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			long difference = (long) sequence - (long) position;
+
+			if (difference == 0) {
+				// the slot is free, try to claim it by moving the tail past it
+				if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					slot->value = value;
+					slot->sequence.store(position + 1, std::memory_order_release); // publish it to the poppers
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false; // the slot still holds a value from one lap ago, so we are full
+			}
+			else {
+				position = tail.load(std::memory_order_relaxed); // somebody else claimed it, try again
+			}
+		}
+	}
+
+	// returns false instead of waiting when the queue is empty
+	bool pop(T& value) {
+		size_t position = head.load(std::memory_order_relaxed);
+
+		while (1) {
+			Slot* slot = &slots[position & mask];
+			size_t sequence = slot->sequence.load(std::memory_order_acquire);
+			long difference = (long) sequence - (long) (position + 1);
+
+			if (difference == 0) {
+				if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+					value = slot->value;
+					slot->sequence.store(position + mask + 1, std::memory_order_release); // free it for the next lap
+					return true;
+				}
+			}
+			else if (difference < 0) {
+				return false; // nothing has been pushed into this slot yet, so we are empty
+			}
+			else {
+				position = head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+private:
+	struct Slot {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	// head and tail on their own cache lines so pushers and poppers dont keep stealing the line from each other
+	alignas(64) std::atomic<size_t> tail;
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) Slot* slots;
+	size_t mask;
+
+	MPMCQueue(const MPMCQueue&);
+	MPMCQueue& operator=(const MPMCQueue&);
+};
+
+#endif
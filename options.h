@@ -0,0 +1,53 @@
+/*
+ * Options File Description:
+ * Both programs take their required arguments positionally (port, iterations, ...). Anything
+ * extra is passed as an optional "--name=value" flag after those arguments, for example
+ * "./server 2648 100 --mode=epoll". These helpers find a flag by name and fall back to a
+ * default value when it was not given, so the old command lines keep working unchanged.
+ */
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstring>
+#include <cstdlib>
+
+/*
+ * Returns the value of "--name=value" if it is somewhere in argv, otherwise defaultValue.
+ * A bare "--name" (no equals sign) returns "1" so it can be used as an on/off switch.
+ */
+inline const char* getOption(int argc, char** argv, const char* name, const char* defaultValue) {
+	size_t nameLength = strlen(name);
+
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+
+		// only look at things that start with the two dashes
+		if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, nameLength) != 0) {
+			continue;
+		}
+
+		const char* rest = arg + 2 + nameLength;
+
+		if (*rest == '=') {
+			return rest + 1;
+		}
+		if (*rest == '\0') {
+			return "1";
+		}
+	}
+
+	return defaultValue;
+}
+
+// same as getOption but converts the value to a number
+inline long getIntOption(int argc, char** argv, const char* name, long defaultValue) {
+	const char* value = getOption(argc, argv, name, NULL);
+
+	if (value == NULL) {
+		return defaultValue;
+	}
+
+	return atol(value);
+}
+
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Protocol File Description:
+ * The wire format the client and server speak. Every message starts with a 16 byte header and is
+ * followed by length bytes of payload:
+ *
+ *   magic (4 bytes) | version (2) | flags (2) | length (4) | sequence number (4)
+ *
+ * All fields are in network byte order. The client numbers its messages from 0 and sets FLAG_LAST
+ * on the final one, which tells the server it can send the acknowledgement. Because every message
+ * says how long it is, the two sides no longer have to agree on the iteration count or the size of
+ * each iteration ahead of time.
+ *
+ * The server reads into a receiveRing and parseMessages() pulls messages out of it as the bytes
+ * arrive, so a read() can hold many small messages or a piece of one big message.
+ *
+ * A message can also carry FLAG_REQUEST, which asks the server to answer that message on its own
+ * with a header-only FLAG_RESPONSE message carrying the same sequence number. That is what lets a
+ * client keep one connection open and pipeline many requests on it; such a client simply closes
+ * the connection when it is done instead of sending a FLAG_LAST message.
+ *
+ * FLAG_CHECKSUM asks the server to run a CRC32C (see checksum.h) over the message's payload. The
+ * CRC continues from one such message to the next, so it covers every checked payload of the
+ * connection in order, and the acknowledgement carries it as a second 4 byte field after the read
+ * count. A byte that was changed, lost or moved anywhere in the stream changes the digest.
+ */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <arpa/inet.h>    // htonl, ntohl, htons, ntohs
+#include <sys/uio.h>      // readv
+#include <sys/socket.h>   // recvmsg
+#include <unistd.h>
+#include <cstring>
+
+#include "histogram.h"
+#include "bufferpool.h"
+#include "checksum.h"
+
+const uint32_t MESSAGE_MAGIC = 0x42534B54; // "BSKT"
+const uint16_t MESSAGE_VERSION = 1;
+const int HEADERSIZE = 16;
+
+const uint16_t FLAG_LAST = 1; // last message on this connection, acknowledge after it
+const uint16_t FLAG_REQUEST = 2; // answer this message with its own response
+const uint16_t FLAG_RESPONSE = 4; // set on the server's answer to a FLAG_REQUEST message
+const uint16_t FLAG_CHECKSUM = 8; // add this payload to the connection's digest, which goes back with the acknowledgement
+
+struct messageHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t length; // payload bytes after the header
+	uint32_t sequence;
+};
+
+// writes the header for one message into out (which must have HEADERSIZE bytes of room)
+inline void encodeHeader(char* out, uint32_t length, uint32_t sequence, uint16_t flags) {
+	uint32_t magic = htonl(MESSAGE_MAGIC);
+	uint16_t version = htons(MESSAGE_VERSION);
+	uint16_t networkFlags = htons(flags);
+	uint32_t networkLength = htonl(length);
+	uint32_t networkSequence = htonl(sequence);
+
+	// memcpy instead of casting so it works no matter how out is aligned
+	memcpy(out, &magic, 4);
+	memcpy(out + 4, &version, 2);
+	memcpy(out + 6, &networkFlags, 2);
+	memcpy(out + 8, &networkLength, 4);
+	memcpy(out + 12, &networkSequence, 4);
+}
+
+// reads a header back out of HEADERSIZE bytes, returns false if it is not one of ours
+inline bool decodeHeader(const char* in, struct messageHeader* header) {
+	memcpy(&header->magic, in, 4);
+	memcpy(&header->version, in + 4, 2);
+	memcpy(&header->flags, in + 6, 2);
+	memcpy(&header->length, in + 8, 4);
+	memcpy(&header->sequence, in + 12, 4);
+
+	header->magic = ntohl(header->magic);
+	header->version = ntohs(header->version);
+	header->flags = ntohs(header->flags);
+	header->length = ntohl(header->length);
+	header->sequence = ntohl(header->sequence);
+
+	return header->magic == MESSAGE_MAGIC && header->version == MESSAGE_VERSION;
+}
+
+/*
+ * A fixed size circular byte buffer. head and tail only ever count up, and the position in the
+ * buffer is the count masked by capacity - 1, which is why the capacity is a power of two.
+ * Bytes between head and tail have been received but not parsed yet.
+ */
+struct receiveRing {
+	char* data;
+	size_t capacity;
+	size_t head; // next byte to parse
+	size_t tail; // next byte to receive into
+};
+
+inline void initRing(struct receiveRing* ring, size_t capacity) {
+	size_t size = 2;
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	ring->data = poolAllocate(size); // page aligned, see bufferpool.h
+	ring->capacity = size;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+inline void freeRing(struct receiveRing* ring) {
+	poolFree(ring->data, ring->capacity);
+	ring->data = NULL;
+}
+
+inline void resetRing(struct receiveRing* ring) {
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+inline size_t ringAvailable(const struct receiveRing* ring) {
+	return ring->tail - ring->head;
+}
+
+/*
+ * Reads as much as fits into the free space with one readv() call. The free space is at most two
+ * pieces (up to the end of the buffer, then from the start), so both are handed over at once.
+ * With flags (like MSG_DONTWAIT) it is the same read done with recvmsg() so the flags can be passed.
+ * Returns what readv() returned.
+ */
+inline long readIntoRing(int socketDescriptor, struct receiveRing* ring, int flags = 0) {
+	size_t mask = ring->capacity - 1;
+	size_t freeSpace = ring->capacity - ringAvailable(ring);
+	size_t start = ring->tail & mask;
+	size_t firstPiece = ring->capacity - start;
+
+	if (firstPiece > freeSpace) {
+		firstPiece = freeSpace;
+	}
+
+	struct iovec pieces[2];
+	pieces[0].iov_base = ring->data + start;
+	pieces[0].iov_len = firstPiece;
+	pieces[1].iov_base = ring->data;
+	pieces[1].iov_len = freeSpace - firstPiece;
+
+	long bytes;
+
+	if (flags == 0) {
+		bytes = readv(socketDescriptor, pieces, pieces[1].iov_len > 0 ? 2 : 1);
+	}
+	else {
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = pieces;
+		message.msg_iovlen = pieces[1].iov_len > 0 ? 2 : 1;
+		bytes = recvmsg(socketDescriptor, &message, flags);
+	}
+
+	if (bytes > 0) {
+		ring->tail += bytes;
+	}
+
+	return bytes;
+}
+
+// copies bytes that were received some other way (like io_uring) into the ring, returns how many fit
+inline size_t appendToRing(struct receiveRing* ring, const char* bytes, size_t length) {
+	size_t mask = ring->capacity - 1;
+	size_t freeSpace = ring->capacity - ringAvailable(ring);
+
+	if (length > freeSpace) {
+		length = freeSpace;
+	}
+
+	size_t start = ring->tail & mask;
+	size_t firstPiece = ring->capacity - start;
+
+	if (firstPiece > length) {
+		firstPiece = length;
+	}
+
+	memcpy(ring->data + start, bytes, firstPiece);
+	memcpy(ring->data, bytes + firstPiece, length - firstPiece);
+	ring->tail += length;
+
+	return length;
+}
+
+// copies length bytes from the front of the ring into out without removing them
+inline void peekRing(const struct receiveRing* ring, char* out, size_t length) {
+	size_t mask = ring->capacity - 1;
+	size_t start = ring->head & mask;
+	size_t firstPiece = ring->capacity - start;
+
+	if (firstPiece > length) {
+		firstPiece = length;
+	}
+
+	memcpy(out, ring->data + start, firstPiece);
+	memcpy(out + firstPiece, ring->data, length - firstPiece);
+}
+
+// continues crc (see checksum.h) over the next length bytes of the ring without removing them
+inline uint32_t checksumRing(const struct receiveRing* ring, size_t length, uint32_t crc) {
+	size_t mask = ring->capacity - 1;
+	size_t start = ring->head & mask;
+	size_t firstPiece = ring->capacity - start;
+
+	if (firstPiece > length) {
+		firstPiece = length;
+	}
+
+	crc = crc32c(crc, ring->data + start, firstPiece);
+	return crc32c(crc, ring->data, length - firstPiece);
+}
+
+inline void consumeRing(struct receiveRing* ring, size_t length) {
+	ring->head += length;
+}
+
+/*
+ * Responses the parser produced that still have to be written to the socket. Every response is
+ * a bare header, and since each request takes at least a header's worth of ring space, one parse
+ * of a full ring can never produce more than capacity bytes of responses.
+ */
+struct responseBuffer {
+	char* data;
+	size_t used;
+	size_t capacity;
+};
+
+inline void initResponses(struct responseBuffer* responses, size_t capacity) {
+	responses->data = poolAllocate(capacity);
+	responses->used = 0;
+	responses->capacity = capacity;
+}
+
+inline void freeResponses(struct responseBuffer* responses) {
+	poolFree(responses->data, responses->capacity);
+	responses->data = NULL;
+}
+
+/*
+ * Where the parser is within the stream of one connection. A connection alternates between
+ * waiting for a full header and skipping over that header's payload.
+ */
+struct messageParser {
+	bool inPayload; // false while we still need the next header
+	struct messageHeader current; // header of the message whose payload we are in
+	uint32_t payloadLeft;
+	long messages; // complete messages seen so far
+	long payloadBytes; // payload bytes seen so far
+	bool sawLast; // the FLAG_LAST message is complete
+	bool broken; // got something that was not a valid header or had no room to answer, the connection should be dropped
+	long receivedAt; // set by the caller to the time of the read that is being parsed
+	long messageStartedAt; // receivedAt of the read that brought the current message's header
+	struct latencyHistogram* messageTimes; // if set, gets how long each message took to arrive
+	bool checksummed; // a FLAG_CHECKSUM message came in, so the acknowledgement carries digest
+	uint32_t digest; // CRC32C of every FLAG_CHECKSUM payload so far
+};
+
+inline void resetParser(struct messageParser* parser) {
+	memset(&parser->current, 0, sizeof(parser->current));
+	parser->inPayload = false;
+	parser->payloadLeft = 0;
+	parser->messages = 0;
+	parser->payloadBytes = 0;
+	parser->sawLast = false;
+	parser->broken = false;
+	parser->receivedAt = 0;
+	parser->messageStartedAt = 0;
+	parser->messageTimes = NULL;
+	parser->checksummed = false;
+	parser->digest = 0;
+}
+
+/*
+ * Pulls every complete header and as much payload as there is out of the ring. A header that has
+ * only partly arrived is left in the ring for the next call. Payload bytes are consumed as soon as
+ * they are there, so a message can be much bigger than the ring. Stops after the FLAG_LAST message
+ * or at the first bad header. Every completed FLAG_REQUEST message gets a response added to
+ * responses (pass NULL to ignore requests), and one that does not fit marks the parser broken.
+ * Returns how many messages were completed by this call.
+ */
+inline int parseMessages(struct receiveRing* ring, struct messageParser* parser, struct responseBuffer* responses) {
+	int completed = 0;
+
+	while (!parser->sawLast && !parser->broken) {
+		if (!parser->inPayload) {
+			if (ringAvailable(ring) < (size_t) HEADERSIZE) {
+				break;
+			}
+
+			char headerBytes[HEADERSIZE];
+			peekRing(ring, headerBytes, HEADERSIZE);
+			consumeRing(ring, HEADERSIZE);
+
+			if (!decodeHeader(headerBytes, &parser->current)) {
+				parser->broken = true;
+				break;
+			}
+
+			parser->inPayload = true;
+			parser->payloadLeft = parser->current.length;
+			parser->messageStartedAt = parser->receivedAt;
+		}
+
+		size_t take = ringAvailable(ring);
+		if (take > parser->payloadLeft) {
+			take = parser->payloadLeft;
+		}
+
+		if (parser->current.flags & FLAG_CHECKSUM) {
+			parser->digest = checksumRing(ring, take, parser->digest); // the bytes were just received, so they are still in cache
+			parser->checksummed = true;
+		}
+
+		consumeRing(ring, take);
+		parser->payloadLeft -= take;
+		parser->payloadBytes += take;
+
+		if (parser->payloadLeft > 0) {
+			break; // the rest of this payload has not arrived yet
+		}
+
+		parser->inPayload = false;
+		parser->messages++;
+		completed++;
+
+		if (parser->messageTimes != NULL) {
+			recordValue(parser->messageTimes, parser->receivedAt - parser->messageStartedAt);
+		}
+
+		if ((parser->current.flags & FLAG_REQUEST) && responses != NULL) {
+			// the callers keep room for a ring's worth of answers, so this should never happen. If it does, drop the
+			// connection rather than lose one answer the client would wait for forever
+			if (responses->used + HEADERSIZE > responses->capacity) {
+				parser->broken = true;
+				break;
+			}
+
+			encodeHeader(responses->data + responses->used, 0, parser->current.sequence, FLAG_RESPONSE);
+			responses->used += HEADERSIZE;
+		}
+
+		if (parser->current.flags & FLAG_LAST) {
+			parser->sawLast = true;
+		}
+	}
+
+	return completed;
+}
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Resolver File Description:
+ * How the client finds the server and connects to it on a dual-stack network.
+ *
+ * orderAddresses takes everything getaddrinfo found (IPv6 and IPv4) and interleaves the two
+ * families, keeping getaddrinfo's own preference order (RFC 6724) within each family and starting
+ * with its first choice. This is the ordering RFC 8305 asks for, so a family that is broken does not
+ * hold up every attempt in the other one.
+ *
+ * connectHappyEyeballs races non-blocking connects over that list (RFC 8305 "Happy Eyeballs"). It
+ * starts the first one, and starts the next one every CONNECT_ATTEMPT_DELAY that nothing has
+ * connected yet, or right away when an attempt fails. The first connect to finish wins and the
+ * others are closed, so an unreachable first address costs 250 ms instead of a full TCP timeout.
+ *
+ * A resolverCache keeps resolved lists for a while so the load generator does not call getaddrinfo
+ * for every connection. getaddrinfo does not say how long a DNS answer is good for, so the time to
+ * live is a setting (--dns-ttl) instead of the record's own TTL. When a refresh fails the old answer
+ * keeps being used, and the next try waits RESOLVE_RETRY_INTERVAL instead of happening on every
+ * connect.
+ */
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/types.h>    // socket
+#include <sys/socket.h>   // socket, connect, getsockopt
+#include <netdb.h>        // getaddrinfo
+#include <fcntl.h>        // fcntl, O_NONBLOCK
+#include <poll.h>         // poll
+#include <unistd.h>       // close
+#include <errno.h>        // errno, EINPROGRESS
+#include <pthread.h>      // pthread_mutex_lock, pthread_cond_wait
+
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <cstring>
+
+#include "histogram.h"
+#include "sockettuning.h"
+
+const long CONNECT_ATTEMPT_DELAY = 250 * 1000000L; // nanoseconds, RFC 8305's recommended value
+const long RESOLVE_RETRY_INTERVAL = 1000000000L; // nanoseconds before a lookup that failed is tried again
+
+// one address the client can connect to, copied out of getaddrinfo's list so it can be kept around
+struct resolvedAddress {
+	int family;
+	int type;
+	int protocol;
+	struct sockaddr_storage address;
+	socklen_t length;
+};
+
+// how a connectHappyEyeballs call went
+struct connectReport {
+	int attempts; // connects started
+	int family; // family of the address that won, AF_UNSPEC if none did
+	const char* refused; // first socket option the kernel refused (see applySocketProfile), or NULL
+};
+
+/*
+ * Copies getaddrinfo's list in the order connects should be tried: the families alternate, starting
+ * with the family of getaddrinfo's first choice.
+ */
+inline std::vector<struct resolvedAddress> orderAddresses(const struct addrinfo* head) {
+	std::vector<struct resolvedAddress> byFamily[2]; // [0] is the family getaddrinfo put first
+	int firstFamily = (head != NULL) ? head->ai_family : AF_UNSPEC;
+
+	for (const struct addrinfo* current = head; current != NULL; current = current->ai_next) {
+		struct resolvedAddress address;
+		memset(&address, 0, sizeof(address));
+		address.family = current->ai_family;
+		address.type = current->ai_socktype;
+		address.protocol = current->ai_protocol;
+		address.length = current->ai_addrlen;
+		memcpy(&address.address, current->ai_addr, current->ai_addrlen);
+
+		byFamily[current->ai_family == firstFamily ? 0 : 1].push_back(address);
+	}
+
+	std::vector<struct resolvedAddress> ordered;
+	for (size_t i = 0; i < byFamily[0].size() || i < byFamily[1].size(); i++) {
+		for (int family = 0; family < 2; family++) {
+			if (i < byFamily[family].size()) {
+				ordered.push_back(byFamily[family][i]);
+			}
+		}
+	}
+
+	return ordered;
+}
+
+/*
+ * Resolves host and port (IPv6 and IPv4, TCP) into addresses, in the order orderAddresses gives.
+ * Returns getaddrinfo's status, 0 if it worked.
+ */
+inline int resolveAddresses(const char* host, const char* port, std::vector<struct resolvedAddress>* addresses) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	struct addrinfo* results;
+	int status = getaddrinfo(host, port, &hints, &results);
+
+	if (status == 0) {
+		*addresses = orderAddresses(results);
+		freeaddrinfo(results);
+	}
+
+	return status;
+}
+
+/*
+ * Connects to the first of the candidates that answers, racing them as described at the top. Every
+ * socket gets the profile's options before its connect. Returns the connected socket, switched back
+ * to blocking mode, or -1 if none of them could connect.
+ */
+inline int connectHappyEyeballs(const std::vector<struct resolvedAddress>& candidates, const struct socketProfile* profile,
+	struct connectReport* report) {
+	std::vector<struct pollfd> pending; // attempts still in flight
+	std::vector<int> pendingFamilies;
+	size_t next = 0; // next candidate to start
+	long nextAttemptAt = 0; // when to start it if nothing finished before then
+	int winner = -1;
+
+	report->attempts = 0;
+	report->family = AF_UNSPEC;
+	report->refused = NULL;
+
+	while (winner == -1 && (next < candidates.size() || !pending.empty())) {
+		long now = monotonicNanoseconds();
+
+		if (next < candidates.size() && (pending.empty() || now >= nextAttemptAt)) {
+			const struct resolvedAddress& candidate = candidates[next++];
+			int sd = socket(candidate.family, candidate.type | SOCK_NONBLOCK, candidate.protocol);
+
+			if (sd == -1) {
+				continue; // this family is not available here, go straight to the next
+			}
+
+			const char* refused = applySocketProfile(sd, profile);
+			if (report->refused == NULL) {
+				report->refused = refused;
+			}
+
+			report->attempts++;
+
+			if (connect(sd, (const struct sockaddr*) &candidate.address, candidate.length) == 0) {
+				winner = sd;
+				report->family = candidate.family;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				close(sd); // failed right away (no route for this family for example)
+				continue;
+			}
+
+			struct pollfd attempt;
+			attempt.fd = sd;
+			attempt.events = POLLOUT;
+			attempt.revents = 0;
+			pending.push_back(attempt);
+			pendingFamilies.push_back(candidate.family);
+			nextAttemptAt = now + CONNECT_ATTEMPT_DELAY;
+			continue;
+		}
+
+		// wait for an attempt to finish, or until the next one is due
+		int timeout = -1;
+		if (next < candidates.size()) {
+			timeout = (nextAttemptAt > now) ? (int) ((nextAttemptAt - now + 999999) / 1000000) : 0;
+		}
+
+		poll(pending.data(), pending.size(), timeout);
+
+		for (size_t i = 0; i < pending.size(); ) {
+			if (pending[i].revents == 0) {
+				i++;
+				continue;
+			}
+
+			int error = 0;
+			socklen_t size = sizeof(error);
+			getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &error, &size);
+
+			if (error == 0 && winner == -1) {
+				winner = pending[i].fd;
+				report->family = pendingFamilies[i];
+			}
+			else {
+				close(pending[i].fd);
+				nextAttemptAt = 0; // a failed attempt lets the next one start right away
+			}
+
+			pending.erase(pending.begin() + i);
+			pendingFamilies.erase(pendingFamilies.begin() + i);
+		}
+	}
+
+	// the attempts that lost the race
+	for (size_t i = 0; i < pending.size(); i++) {
+		close(pending[i].fd);
+	}
+
+	if (winner != -1) {
+		fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+	}
+
+	return winner;
+}
+
+// a resolved list and when it has to be resolved again
+struct cachedAddresses {
+	std::vector<struct resolvedAddress> addresses; // empty until a lookup succeeded
+	long expiresAt; // monotonic nanoseconds
+	int status; // what the last getaddrinfo returned
+	bool refreshing; // a thread is resolving it right now
+};
+
+/*
+ * Resolved addresses shared by every thread of the load generator. getaddrinfo is called without
+ * the lock: the thread that finds an entry expired marks it refreshing and resolves it, and the
+ * others keep using the old answer meanwhile. Only when there is no answer yet do they wait (on
+ * resolved) for that thread instead of all asking at once.
+ */
+struct resolverCache {
+	pthread_mutex_t lock;
+	pthread_cond_t resolved; // signalled whenever a refresh finishes
+	long timeToLive; // nanoseconds
+	std::map<std::string, struct cachedAddresses> entries; // by "host port"
+	long lookups;
+	long misses; // lookups that had to call getaddrinfo
+};
+
+inline void initResolverCache(struct resolverCache* cache, long timeToLiveSeconds) {
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->resolved, NULL);
+	cache->timeToLive = timeToLiveSeconds * 1000000000L;
+	cache->lookups = 0;
+	cache->misses = 0;
+}
+
+/*
+ * Copies the addresses of host and port into addresses, calling getaddrinfo only if they are not
+ * cached or the cached ones expired. Returns getaddrinfo's status, 0 if there are addresses.
+ */
+inline int resolveCached(struct resolverCache* cache, const char* host, const char* port, std::vector<struct resolvedAddress>* addresses) {
+	std::string key = std::string(host) + " " + port;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->lookups++;
+
+	std::map<std::string, struct cachedAddresses>::iterator entry = cache->entries.find(key);
+
+	if (entry == cache->entries.end()) {
+		struct cachedAddresses empty;
+		empty.expiresAt = 0;
+		empty.status = EAI_AGAIN;
+		empty.refreshing = false;
+		entry = cache->entries.insert(std::make_pair(key, empty)).first;
+	}
+
+	// nothing to fall back on yet, so wait for the thread that is asking
+	while (entry->second.refreshing && entry->second.addresses.empty()) {
+		pthread_cond_wait(&cache->resolved, &cache->lock);
+	}
+
+	long now = monotonicNanoseconds();
+
+	if (now < entry->second.expiresAt || entry->second.refreshing) {
+		// still good, or another thread is refreshing it and the old answer does until then
+		*addresses = entry->second.addresses;
+		int status = addresses->empty() ? entry->second.status : 0;
+		pthread_mutex_unlock(&cache->lock);
+		return status;
+	}
+
+	entry->second.refreshing = true;
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	// map entries stay where they are when others are added, so entry is still good after this
+	std::vector<struct resolvedAddress> fresh;
+	int status = resolveAddresses(host, port, &fresh);
+
+	pthread_mutex_lock(&cache->lock);
+	now = monotonicNanoseconds();
+	entry->second.refreshing = false;
+	entry->second.status = status;
+
+	if (status == 0) {
+		entry->second.addresses = fresh;
+		entry->second.expiresAt = now + cache->timeToLive;
+	}
+	else {
+		// the resolver is down or timed out. An old answer is better than failing every connection, and
+		// asking again on every connect would only line the threads up behind the broken resolver
+		entry->second.expiresAt = now + std::min(cache->timeToLive, RESOLVE_RETRY_INTERVAL);
+	}
+
+	*addresses = entry->second.addresses;
+	if (!addresses->empty()) {
+		status = 0;
+	}
+
+	pthread_cond_broadcast(&cache->resolved);
+	pthread_mutex_unlock(&cache->lock);
+	return status;
+}
+
+#endif
@@ -5,6 +5,65 @@
  * create a new thread (using the pthreads library) that will handle the connection. The
  * new thread will read all the data from the client and respond back to it. This is called
  * the acknowledgment. In this case, I will send back the number of read() calls made.
+ * The client's data comes as framed messages (see protocol.h), and the acknowledgement goes out
+ * once the message marked as the last one has arrived. Messages marked as requests are answered
+ * one by one as they arrive, so a client can also keep the connection open and pipeline requests.
+ *
+ * The server has two modes, picked with --mode (default is thread):
+ * thread - the original design, one new pthread per accepted connection.
+ * epoll  - a small fixed set of event-loop threads (--loops, default one per core). Each loop has its
+ *          own non-blocking listening socket bound with SO_REUSEPORT so the kernel spreads new
+ *          connections across them, and every connection is a small state machine driven by epoll.
+ * pool   - a fixed number of pre-spawned worker threads (--workers). The accept loop pushes each new
+ *          socket into a lock-free queue of --queue slots and a free worker picks it up. --overflow
+ *          says what happens when the queue is full: block (stop accepting until a slot frees up),
+ *          reject (close the new connection right away) or grow (park it in an unbounded spillover list).
+ * udp    - UDP instead of TCP (client --udp, see datagram.h). --loops threads each bind a UDP socket to
+ *          the port with SO_REUSEPORT and take datagrams in batches with recvmmsg() and UDP_GRO. Every
+ *          flow gets its loss, reordering and one-way latency counted and reported back to the client.
+ *
+ * The event loops can use one of two backends, picked with --backend (default is read):
+ * read  - epoll tells us which sockets are ready and we read() each of them.
+ * uring - io_uring with multishot accept, multishot recv and a ring of provided receive buffers, so
+ *         the kernel fills buffers for many connections and one io_uring_enter() call collects them.
+ *         Needs liburing when compiling (g++ server.cpp -o server -lpthread -luring) and a kernel
+ *         that supports it; otherwise the server says so and falls back to the read backend.
+ *
+ * SIGTERM or SIGINT stops the server gracefully: it stops accepting (after taking the connections
+ * already in the listen backlog), lets the open connections finish for up to --drain seconds (default
+ * 10, a second signal cuts them off right away) and waits for every thread serving them. Then it
+ * prints how many socket syscalls it made, which the benchmark uses to compare the backends, and
+ * p50/p90/p99/p99.9/max of how long messages and connections took to arrive. --histogram=file.json
+ * (or .csv) also dumps the full histograms. --backlog=N sets the listen backlog (default SOMAXCONN).
+ *
+ * --handoff=path and --takeover=path restart the server without closing the port: the new server
+ * takes over the listening sockets, backlog and all, and the old one drains (see handoff.h).
+ *
+ * The per-connection "data-receiving time" lines are written by a background thread (see logger.h)
+ * so printing never slows the threads that serve clients. --log=warn leaves them out entirely.
+ * A failed accept is counted and logged and the server keeps accepting.
+ *
+ * --metrics=port (or a Unix socket path) serves live counters in the Prometheus text format: active
+ * connections, accepts, accept failures, bytes and reads per message (see stats.h).
+ *
+ * Receive rings and buffers come from the shared buffer pool (see bufferpool.h); --hugepages backs
+ * it with huge pages.
+ *
+ * --profile=default|latency|throughput (and the flags that change single options) sets the socket
+ * options every accepted connection gets (see sockettuning.h).
+ *
+ * Responses are batched instead of written per read: a thread reading a blocking socket keeps them
+ * while its reads come back full (more requests are already waiting) and an event loop writes every
+ * connection it answered once at the end of the loop turn. The acknowledgement is queued behind the
+ * last responses so they leave in the same write. --flush-delay=usec lets responses wait for later
+ * ones across loop turns for up to that long (default 0, flush at the end of every turn).
+ *
+ * --sink=/dev/null (or a file) is for bulk transfers in the thread and pool modes: the payloads are
+ * moved from the socket into a pipe and on into the sink with splice() instead of being read into
+ * our buffers, and every connection logs the GB/s and CPU time it took (see sinkClient).
+ *
+ * A client that sets FLAG_CHECKSUM (client --verify) gets a CRC32C of its payloads back with the
+ * acknowledgement (see protocol.h). The sink never sees the payloads, so it does not check them.
  */
 #include <sys/types.h>    // socket, bind 
 #include <sys/socket.h>   // socket, bind, listen, inet_ntoa 
@@ -20,83 +79,794 @@
 #include <stdio.h>
 #include <cstring>
 #include <sys/time.h> // needed for gettimeofday()
+#include <sys/epoll.h>    // epoll_create1, epoll_ctl, epoll_wait
+#include <pthread.h>      // pthread_create, pthread_detach, pthread_join
+#include <errno.h>        // errno, EAGAIN
+#include <semaphore.h>    // sem_init, sem_wait, sem_post
+#include <sched.h>        // sched_yield
+#include <signal.h>       // sigwait, pthread_sigmask, SIGTERM
+#include <sys/utsname.h>  // uname
+#include <poll.h>         // poll
+#include <fcntl.h>        // splice, open, F_SETPIPE_SZ
+#include <sys/resource.h> // getrusage, RUSAGE_THREAD
+#include <sys/eventfd.h>  // eventfd
+#include <netinet/udp.h>  // UDP_GRO, SOL_UDP
+
+#include <deque>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <set>
+#include <map>
+
+#if __has_include(<liburing.h>)
+#include <liburing.h>     // io_uring_queue_init, io_uring_prep_recv_multishot, io_uring_setup_buf_ring
+#define HAVE_LIBURING 1
+#endif
+
+#include "options.h"
+#include "mpmcqueue.h"
+#include "protocol.h"
+#include "histogram.h"
+#include "logger.h"
+#include "stats.h"
+#include "sockettuning.h"
+#include "handoff.h"
+#include "datagram.h"
 
 using namespace std; // to use cout and endl
 
+const int BUFSIZE = 1500; // size of each io_uring receive buffer (the assignment's message size)
+const int RINGSIZE = 8192; // bytes each connection can have received but not parsed yet
+const int RESPONSESIZE = 4 * RINGSIZE; // room for the responses of several full rings, so they can go out in one write
+
+// nanoseconds a response may wait so that it leaves in the same write as later ones (--flush-delay, in usec)
+long flushDelay = 0;
+
+// file the thread and pool modes splice payloads into instead of reading them (--sink), NULL to read them as usual
+const char* sinkPath = NULL;
+const int SINK_PIPESIZE = 1024 * 1024; // bytes moved from the socket into the pipe per splice
+
+// connections the kernel queues on a listening socket until we accept them (--backlog). The kernel
+// caps it at net.core.somaxconn
+int listenBacklog = SOMAXCONN;
+
+// set when SIGTERM/SIGINT arrives (see waitForStop). stopEvent, an eventfd, becomes readable at the same
+// moment and stays readable, so every thread waiting for new connections wakes up and stops accepting
+atomic<bool> stopping(false);
+int stopEvent = -1;
+atomic<bool> handedOff(false); // the listening sockets went to a new server (see handoff.h)
+
+// the listening sockets this server has open, which is what a hot restart hands over
+pthread_mutex_t listenersLock = PTHREAD_MUTEX_INITIALIZER;
+vector<int> listeners;
+vector<int> inheritedListeners; // taken over from the server this one replaced (--takeover) and not used yet
+
+// every open client connection, so the ones still open when the drain time is up can be cut off
+pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+set<int> openConnections;
+atomic<long> serviceThreads(0); // thread mode threads that have not finished yet
+
+// total read, write, accept, epoll_wait and io_uring_enter calls made serving clients.
+// Each thread counts into its own pendingSyscalls and adds it here once per connection or loop turn,
+// so the hot loops never touch the shared counter.
+atomic<long> socketSyscalls(0);
+thread_local long pendingSyscalls = 0;
+
+void flushSyscalls() {
+	socketSyscalls.fetch_add(pendingSyscalls, memory_order_relaxed);
+	pendingSyscalls = 0;
+}
+
+// latency histograms (see histogram.h). Every thread that serves clients records into its own pair
+// and the registries merge them when the server is stopped
+struct histogramRegistry messageTimes; // how long each message took from its header to its last byte
+struct histogramRegistry connectionTimes; // the data-receiving time of every acknowledged connection
+thread_local struct latencyHistogram* messageHistogram = NULL;
+thread_local struct latencyHistogram* connectionHistogram = NULL;
+
+// per-connection lines go through the asynchronous logger (see logger.h) instead of cout, so a
+// serving thread only copies a record into its own ring and never waits on the stream lock
+struct asyncLogger logger;
+thread_local struct logRing* threadLog = NULL;
+
+// socket options for every accepted connection (see sockettuning.h), picked with --profile and friends
+struct socketProfile tuning;
+atomic<bool> tuningWarned(false); // so a refused option is only reported once, not per connection
+
+// live counters for the metrics endpoint (see stats.h), one block per thread
+struct statRegistry stats;
+thread_local struct statCounters* threadStats = NULL;
+
+// gives the calling thread its own histograms, log ring and counters
+void registerThreadRecorders() {
+	messageHistogram = registerHistogram(&messageTimes);
+	connectionHistogram = registerHistogram(&connectionTimes);
+	threadLog = registerLogRing(&logger);
+	threadStats = registerStats(&stats);
+}
+
+// for threads that end before the server does (the thread mode), so their counts and records are kept
+void retireThreadRecorders() {
+	retireHistogram(&messageTimes, messageHistogram);
+	retireHistogram(&connectionTimes, connectionHistogram);
+	retireLogRing(threadLog);
+	retireStats(&stats, threadStats);
+	messageHistogram = NULL;
+	connectionHistogram = NULL;
+	threadLog = NULL;
+	threadStats = NULL;
+}
+
+// counts a read that returned data and the messages it completed
+void countReceived(long bytes, int messages) {
+	countStat(threadStats, STAT_BYTES, bytes);
+	countStat(threadStats, STAT_READS, 1);
+	countStat(threadStats, STAT_MESSAGES, messages);
+}
+
+// applies the socket profile to a connection that was just accepted
+void tuneConnection(int socketDescriptor) {
+	const char* refused = applySocketProfile(socketDescriptor, &tuning);
+
+	if (refused != NULL && !tuningWarned.exchange(true)) {
+		cout << "the kernel refused " << refused << ", continuing without it" << endl;
+	}
+}
+
+// remembers an accepted connection until closeConnection
+void trackConnection(int socketDescriptor) {
+	pthread_mutex_lock(&connectionsLock);
+	openConnections.insert(socketDescriptor);
+	pthread_mutex_unlock(&connectionsLock);
+}
+
+// forgets and closes a connection. The set forgets it first so cutConnections never touches a reused descriptor
+void closeConnection(int socketDescriptor) {
+	pthread_mutex_lock(&connectionsLock);
+	openConnections.erase(socketDescriptor);
+	pthread_mutex_unlock(&connectionsLock);
+
+	close(socketDescriptor);
+}
+
+/*
+ * Shuts down every connection that is still open, which makes the blocked reads and writes of the
+ * threads serving them return (and wakes the event loops that own them) so they close up normally.
+ */
+void cutConnections() {
+	pthread_mutex_lock(&connectionsLock);
+	for (set<int>::iterator connection = openConnections.begin(); connection != openConnections.end(); connection++) {
+		shutdown(*connection, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&connectionsLock);
+}
+
+/*
+ * Counts and logs a failed accept. The server keeps going: most failures are about that one
+ * connection (the client gave up already), and running out of descriptors passes once some
+ * connections close, so it just waits a moment instead of spinning on the same error.
+ */
+void acceptFailed(int error) {
+	countStat(threadStats, STAT_ACCEPT_FAILURES, 1);
+
+	struct logRecord record;
+	memset(&record, 0, sizeof(record));
+	record.level = LOG_ERROR;
+	record.event = EVENT_ACCEPT_FAILED;
+	record.bytes = error;
+	appendLog(&logger, threadLog, record);
+
+	if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+		usleep(1000);
+	}
+}
+
+// logs the data-receiving time of an acknowledged connection along with what it received
+void logConnection(long start, long end, long bytes, long reads) {
+	struct logRecord record;
+	record.level = LOG_INFO;
+	record.event = EVENT_CONNECTION_DONE;
+	record.connection = threadLog->nextConnection++;
+	record.startedAt = start;
+	record.endedAt = end;
+	record.bytes = bytes;
+	record.reads = reads;
+	record.cpuTime = 0;
+
+	appendLog(&logger, threadLog, record);
+}
+
+// what the thread that waits for SIGTERM/SIGINT needs, and what main needs to write the report
+struct stopReport {
+	sigset_t signals;
+	long drainTime; // seconds open connections get to finish once the server stops (--drain)
+	const char* histogramPath; // where to dump the histograms, or NULL
+};
+
+/*
+ * Runs on its own thread with SIGTERM and SIGINT blocked everywhere else, so the signal is picked
+ * up here with sigwait() instead of in a signal handler. That means this is ordinary code and can
+ * take locks and use cout. A stop is graceful: the accepting threads see stopEvent, take the
+ * connections already waiting in the backlog and close their listening sockets, and the open
+ * connections are served until they finish. Whatever is still open after --drain seconds (or right
+ * away on a second signal) is cut off. Main prints the report once every serving thread is done.
+ */
+void* waitForStop(void* input) {
+	struct stopReport* report = (struct stopReport*)input;
+	int signalNumber;
+	sigwait(&report->signals, &signalNumber);
+
+	pthread_mutex_lock(&connectionsLock);
+	size_t open = openConnections.size();
+	pthread_mutex_unlock(&connectionsLock);
+
+	cout << "stopping: no longer accepting, draining " << open << " open connections for up to " << report->drainTime << " seconds" << endl;
+
+	stopping.store(true);
+	uint64_t stop = 1;
+	write(stopEvent, &stop, sizeof(stop));
+
+	struct timespec drainTime;
+	drainTime.tv_sec = report->drainTime;
+	drainTime.tv_nsec = 0;
+	sigtimedwait(&report->signals, NULL, &drainTime);
+
+	cutConnections();
+	return NULL;
+}
+
+/*
+ * Prints how many socket syscalls the server made (the benchmark reads that line) and the latency
+ * percentiles, then exits.
+ */
+void printStopReport(struct stopReport* report) {
+	drainLog(&logger); // get the last connection lines out before the report
+
+	struct latencyHistogram* messages = newHistogram();
+	struct latencyHistogram* connections = newHistogram();
+	collectRegistry(&messageTimes, messages);
+	collectRegistry(&connectionTimes, connections);
+
+	cout << "socket syscalls = " << socketSyscalls.load(memory_order_relaxed) << endl;
+	cout << "log records dropped = " << logDropped(&logger) << endl;
+	printHistogram(cout, "message receive time", messages);
+	printHistogram(cout, "connection receive time", connections);
+
+	if (report->histogramPath != NULL) {
+		vector<string> names;
+		names.push_back("message_receive_ns");
+		names.push_back("connection_receive_ns");
+		vector<const struct latencyHistogram*> histograms;
+		histograms.push_back(messages);
+		histograms.push_back(connections);
+
+		if (!writeHistograms(report->histogramPath, names, histograms)) {
+			cout << "Could not write the histograms to " << report->histogramPath << endl;
+		}
+	}
+
+	cout.flush();
+	_exit(0); // the log drain, metrics and signal threads are still blocked, so skip the normal exit cleanup
+}
+
+/*
+ * True once the responses waiting in the buffer have to be written: the buffer could not take the
+ * responses of another full ring, or the oldest of them (queued at pendingSince) has waited flushDelay.
+ */
+bool responsesDue(const struct responseBuffer* responses, long pendingSince, long now) {
+	if (responses->used == 0) {
+		return false;
+	}
+
+	return responses->capacity - responses->used < (size_t) RINGSIZE || now - pendingSince >= flushDelay;
+}
+
+/*
+ * Writes every queued response to the client and empties the buffer. Only for the blocking sockets
+ * of the thread and pool modes, where waiting on a client that does not read stalls nobody but the
+ * thread serving it. The event loops use writeResponses instead. Returns false if the connection broke.
+ */
+bool flushResponses(int socketDescriptor, struct responseBuffer* responses) {
+	size_t sent = 0;
+
+	while (sent < responses->used) {
+		// MSG_NOSIGNAL so a client that reset the connection is just a broken connection, not SIGPIPE for the server
+		long written = send(socketDescriptor, responses->data + sent, responses->used - sent, MSG_NOSIGNAL);
+		pendingSyscalls++;
+
+		if (written <= 0) {
+			return false;
+		}
+
+		sent += written;
+	}
+
+	responses->used = 0;
+	return true;
+}
+
+/*
+ * Writes as much of the queued responses as the socket takes right now, without ever waiting,
+ * and moves whatever it did not take to the front of the buffer. Returns false if the connection
+ * broke.
+ */
+bool sendResponses(int socketDescriptor, struct responseBuffer* responses) {
+	size_t sent = 0;
+
+	while (sent < responses->used) {
+		long written = send(socketDescriptor, responses->data + sent, responses->used - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+		pendingSyscalls++;
+
+		if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break; // the client is not reading, the rest waits
+		}
+		if (written <= 0) {
+			return false;
+		}
+
+		sent += written;
+	}
+
+	memmove(responses->data, responses->data + sent, responses->used - sent);
+	responses->used -= sent;
+	return true;
+}
+
+/*
+ * Queues the acknowledgement (the number of reads, in network byte order) behind the responses that
+ * are still waiting, so the last answers and the acknowledgement go out in one write. If the client
+ * asked for checksums the digest of its payloads follows the count. Returns false if the buffer is
+ * too full, then the caller has to write the responses out first.
+ */
+bool queueAcknowledgement(struct responseBuffer* responses, int count, const struct messageParser* parser) {
+	uint32_t acknowledgement[2];
+	acknowledgement[0] = htonl(count);
+	acknowledgement[1] = htonl(parser->digest);
+	size_t length = parser->checksummed ? sizeof(acknowledgement) : sizeof(acknowledgement[0]);
+
+	if (responses->used + length > responses->capacity) {
+		return false;
+	}
+
+	memcpy(responses->data + responses->used, acknowledgement, length);
+	responses->used += length;
+	return true;
+}
+
 struct communicationThreadData {
 	int socketDescriptor;
-	int numIterations;
 };
 
 /*
- * This function is the meat and potatoes of the server program. Once a connection is accepted and a new thread is
- * created to handl the communication and reponse, this function is called. It takes in the thread data created
- * in the main function which has two variables (iterations and the socket descriptor). This function returns to
- * the client the number of times the buffer was read, and prints to the console the amount of time it took in order
- * to read all of the data.
+ * This function is the meat and potatoes of the server program. Once a connection is accepted and handed to a
+ * thread, this function is called with the connection's socket descriptor, the ring buffer that thread reads
+ * into and the buffer it queues responses in. It answers every request message as it arrives and reads until
+ * the client's last message is complete (or until a pipelining client hangs up), then returns to the client the
+ * number of times the socket was read, and prints to the console the amount of time it took in order to read
+ * all of the data.
  */
-void* genResponse(void* input) {
-	//cout << "Entered genResponse()!" << endl;
-	int comThread = ((struct communicationThreadData*)input)->socketDescriptor; // socket descriptor of the current communication thread
-	int iterations = ((struct communicationThreadData*)input)->numIterations; // number of iterations
-	struct timeval start; // time we start reading
-	struct timeval end; // time we stop reading
+void respondToClient(int comThread, struct receiveRing* ring, struct responseBuffer* responses) {
+	long start; // time we start reading (nanoseconds on the monotonic clock)
+	long end; // time we stop reading
+
+	int count = 0; // number of reads
 
-	int count; // number of reads
-	int dataRecievingTime; // difference between end time and start time (how long it took to read the data)
-	int BUFSIZE = 1500; // number of bytes in the data buffer (assignment spec says to use 1500)
+	struct messageParser parser; // where we are in the client's stream of messages
+	resetParser(&parser);
+	resetRing(ring);
+	responses->used = 0;
+	parser.messageTimes = messageHistogram;
 
-	char databuf[BUFSIZE]; // data buffer we are reading into
+	start = monotonicNanoseconds(); // the monotonic clock never jumps, unlike the time of day
+	countStat(threadStats, STAT_OPENED, 1);
 
-	gettimeofday(&start, NULL); // setting the start time to the current time of day with no input for time zone
+	long pendingSince = 0; // when the oldest response still in the buffer was queued
+	int readFlags = 0; // MSG_DONTWAIT while responses wait on a read that may find nothing
 
 	//cout << "Time right as starting read: " << start.tv_usec << endl;
 
-	// code from spec sheet
-	// reads in data from the client into the buffer iteration times (same iteration number as client side)
-	for (int i = 0; i < iterations; i++) {
-		//cout << "Read Iteration: " << i << endl;
-		for (int nRead = 0; (nRead += read(comThread, databuf, BUFSIZE - nRead)) < BUFSIZE; ++count);
+	// read whatever the client has sent so far into the ring and pull the complete messages out of it.
+	// one read can hold many messages or just part of one, the parser keeps track either way
+	while (!parser.sawLast && !parser.broken) {
+		size_t room = ring->capacity - ringAvailable(ring);
+		long bytes = readIntoRing(comThread, ring, readFlags);
+		pendingSyscalls++;
+
+		if (bytes == -1 && readFlags != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			// nothing more has arrived and the client may be waiting on these answers, so send them before blocking
+			if (!flushResponses(comThread, responses)) {
+				break;
+			}
+			readFlags = 0;
+			continue;
+		}
+		if (bytes <= 0) {
+			break; // the client hung up before its last message or the read failed
+		}
+
+		count++;
+		parser.receivedAt = monotonicNanoseconds();
+		size_t queued = responses->used;
+		countReceived(bytes, parseMessages(ring, &parser, responses));
+		pendingSyscalls += rearmQuickAck(comThread, &tuning);
+
+		if (queued == 0 && responses->used > 0) {
+			pendingSince = parser.receivedAt;
+		}
+
+		// a read that filled the ring probably left more requests in the socket, so their answers wait to
+		// go out in the same write. A shorter read emptied the socket and the answers go out now
+		// (after the last message they wait for the acknowledgement instead)
+		if (responses->used > 0 && !parser.sawLast && ((size_t) bytes < room || responsesDue(responses, pendingSince, parser.receivedAt))) {
+			if (!flushResponses(comThread, responses)) {
+				break;
+			}
+		}
+
+		readFlags = (responses->used > 0) ? MSG_DONTWAIT : 0;
 	}
 
-	// once we are done reading, store the new time of day in the end time
-	gettimeofday(&end, NULL);
+	// once we are done reading, store the new time in the end time
+	end = monotonicNanoseconds();
 
 	//cout << "time once we are done reading: " << end.tv_usec << endl;
 	//cout << "number of reads: " << count << endl;
 
-	// send acknowledgement (response) back to client
-	// this is the value kept in count (the number of reads we performed on the buffer)
-	// this is done via the write system call which takes in a file descriptor, the data, and the size of the data
-	// in this case, the file descriptor points to a communication link (the socket) which in linux is a file (everything is a file)
-	write(comThread, &count, sizeof(count));
+	// only acknowledge a complete conversation, a client that vanished or sent garbage just gets closed
+	if (parser.sawLast) {
+		// send acknowledgement (response) back to client
+		// this is the value kept in count (the number of reads we performed on the buffer), in network byte order
+		// it is queued behind the last responses and written along with them, in one write system call which takes
+		// in a file descriptor, the data, and the size of the data
+		// in this case, the file descriptor points to a communication link (the socket) which in linux is a file (everything is a file)
+		if (queueAcknowledgement(responses, count, &parser)
+			|| (flushResponses(comThread, responses) && queueAcknowledgement(responses, count, &parser))) {
+			flushResponses(comThread, responses);
+		}
+
+		//cout << "succesfully wrote response!" << endl;
 
-	//cout << "succesfully wrote response!" << endl;
+		// print out the time it took to read the data to the console
+		recordValue(connectionHistogram, end - start);
+		logConnection(start, end, parser.payloadBytes, count);
+	}
+	else if (!parser.broken && responses->used > 0) {
+		flushResponses(comThread, responses); // a pipelining client that only closed its sending side still gets its answers
+	}
 
-	// print out the time it took to read the data to the console
-	dataRecievingTime = (((end.tv_sec - start.tv_sec) * 1000000L) + (end.tv_usec - start.tv_usec));
-	cout << "data-receiving time = " << dataRecievingTime << " usec" << endl;
+	flushSyscalls();
+	countStat(threadStats, STAT_CLOSED, 1);
 
 	// finally, once the reponse is formulated and sent, and we no longer need to the communication link, close the socket
 	// thus, terminating the file representing the socket and opening up that descriptor
-	close(comThread);
+	closeConnection(comThread);
+}
+
+// nanoseconds of CPU (user + system) the calling thread has used so far
+long threadCpuTime() {
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000L
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000L;
+}
+
+/*
+ * Moves length bytes from the socket to the sink through the pipe with splice(), so the payload is
+ * only passed along as page references and never copied into our memory. Returns the number of
+ * socket splices it took (each one counts as a read), or -1 if the connection or the sink failed.
+ */
+long spliceToSink(int socketDescriptor, int pipeEnds[2], int sink, long length) {
+	long reads = 0;
+
+	while (length > 0) {
+		long moved = splice(socketDescriptor, NULL, pipeEnds[1], NULL, min(length, (long) SINK_PIPESIZE), SPLICE_F_MOVE | SPLICE_F_MORE);
+		pendingSyscalls++;
+
+		if (moved <= 0) {
+			return -1;
+		}
+
+		reads++;
+		countReceived(moved, 0);
+		length -= moved;
+
+		// empty the pipe into the sink before taking more from the socket
+		while (moved > 0) {
+			long out = splice(pipeEnds[0], NULL, sink, NULL, moved, SPLICE_F_MOVE);
+
+			if (out <= 0) {
+				return -1;
+			}
+
+			moved -= out;
+		}
+	}
+
+	return reads;
+}
+
+/*
+ * The sink mode (--sink) version of respondToClient, for bulk transfers. Every 16-byte header is read
+ * into our memory as usual, but the payload after it goes to the sink file with spliceToSink instead
+ * of being read. Requests are answered and the connection acknowledged just like respondToClient does,
+ * and the rate and CPU time the connection took are logged so they can be compared with reading.
+ */
+void sinkClient(int comThread) {
+	long start = monotonicNanoseconds();
+	long cpuStart = threadCpuTime();
+	countStat(threadStats, STAT_OPENED, 1);
+
+	int count = 0; // reads and socket splices that returned data, acknowledged like the reads of respondToClient
+	long payloadBytes = 0;
+	bool sawLast = false;
+
+	// every connection writes the sink from the start, it is meant for /dev/null or one transfer at a time
+	int sink = open(sinkPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int pipeEnds[2];
+	bool ready = sink != -1 && pipe(pipeEnds) == 0;
+
+	if (ready) {
+		fcntl(pipeEnds[1], F_SETPIPE_SZ, SINK_PIPESIZE); // a bigger pipe takes more per splice, the default 64 KB also works
+	}
+
+	while (ready && !sawLast) {
+		char headerBytes[HEADERSIZE];
+		struct messageHeader header;
+		long got = 0;
+
+		while (got < HEADERSIZE) {
+			long bytes = read(comThread, headerBytes + got, HEADERSIZE - got);
+			pendingSyscalls++;
+
+			if (bytes <= 0) {
+				break;
+			}
+
+			count++;
+			countReceived(bytes, 0);
+			got += bytes;
+		}
+
+		if (got < HEADERSIZE || !decodeHeader(headerBytes, &header)) {
+			break; // the client hung up or sent garbage
+		}
+
+		long messageStart = monotonicNanoseconds();
+		long reads = spliceToSink(comThread, pipeEnds, sink, header.length);
+
+		if (reads == -1) {
+			break;
+		}
+
+		count += reads;
+		payloadBytes += header.length;
+		countStat(threadStats, STAT_MESSAGES, 1);
+		recordValue(messageHistogram, monotonicNanoseconds() - messageStart);
+
+		if (header.flags & FLAG_REQUEST) {
+			char response[HEADERSIZE];
+			encodeHeader(response, 0, header.sequence, FLAG_RESPONSE);
+			long written = send(comThread, response, HEADERSIZE, MSG_NOSIGNAL);
+			pendingSyscalls++;
+
+			if (written != HEADERSIZE) {
+				break; // the client is gone, nothing more will be answered
+			}
+		}
+
+		sawLast = (header.flags & FLAG_LAST) != 0;
+	}
+
+	long end = monotonicNanoseconds();
+
+	if (sawLast) {
+		int networkCount = htonl(count);
+		// a client that hung up before its acknowledgement did not finish the connection
+		sawLast = send(comThread, &networkCount, sizeof(networkCount), MSG_NOSIGNAL) == sizeof(networkCount);
+		pendingSyscalls++;
+	}
+
+	struct logRecord record;
+	record.level = LOG_INFO;
+	record.event = EVENT_SINK_DONE;
+	record.connection = threadLog->nextConnection; // the same number as the connection's data-receiving line
+	record.startedAt = start;
+	record.endedAt = end;
+	record.bytes = payloadBytes;
+	record.reads = count;
+	record.cpuTime = threadCpuTime() - cpuStart;
+	appendLog(&logger, threadLog, record);
+
+	if (sawLast) {
+		recordValue(connectionHistogram, end - start);
+		logConnection(start, end, payloadBytes, count);
+	}
+
+	if (ready) {
+		close(pipeEnds[0]);
+		close(pipeEnds[1]);
+	}
+	if (sink != -1) {
+		close(sink);
+	}
+
+	flushSyscalls();
+	countStat(threadStats, STAT_CLOSED, 1);
+	closeConnection(comThread);
+}
+
+/*
+ * Thread entry for the thread mode. Once a connection is accepted and a new thread is created to handle the
+ * communication and response, this function is called. It takes in the thread data created in the main function
+ * (the socket descriptor) and serves the connection with a ring buffer of its own.
+ */
+void* genResponse(void* input) {
+	//cout << "Entered genResponse()!" << endl;
+	int comThread = ((struct communicationThreadData*)input)->socketDescriptor; // socket descriptor of the current communication thread
+	delete (struct communicationThreadData*)input; // main allocated this with new just for us, so free it now that we copied it out
+	registerThreadRecorders();
+
+	struct receiveRing ring; // data buffer we are reading into
+	struct responseBuffer responses;
+	initRing(&ring, RINGSIZE);
+	initResponses(&responses, RESPONSESIZE);
+
+	if (sinkPath != NULL) {
+		sinkClient(comThread);
+	}
+	else {
+		respondToClient(comThread, &ring, &responses);
+	}
+
+	freeRing(&ring);
+	freeResponses(&responses);
+	retireThreadRecorders();
+	serviceThreads.fetch_sub(1); // a stopping server waits for this to reach zero
 
 	// exit(0); // not sure what to return with void pointer
 	return NULL;
 }
 
+
+// what the worker pool threads share with the accept loop in main
+struct workerPool {
+	MPMCQueue<int>* queue; // accepted sockets waiting for a worker
+	sem_t available; // counts sockets in the queue and the spillover so idle workers can sleep
+	pthread_mutex_t spilloverLock;
+	deque<int> spillover; // only used by the grow policy once the queue is full
+};
+
+// takes the next waiting socket out of the queue, or out of the spillover list if the queue is empty
+bool takeConnection(struct workerPool* pool, int& clientSocketDescriptor) {
+	if (pool->queue->pop(clientSocketDescriptor)) {
+		return true;
+	}
+
+	pthread_mutex_lock(&pool->spilloverLock);
+	bool found = !pool->spillover.empty();
+	if (found) {
+		clientSocketDescriptor = pool->spillover.front();
+		pool->spillover.pop_front();
+	}
+	pthread_mutex_unlock(&pool->spilloverLock);
+
+	return found;
+}
+
+/*
+ * Body of each worker in the pool. A worker allocates its receive buffer once and then serves
+ * one connection after another with it, sleeping on the semaphore whenever there is no work.
+ * A -1 in place of a socket tells it the server is stopping (see stopWorkers).
+ */
+void* runWorker(void* input) {
+	struct workerPool* pool = (struct workerPool*)input;
+	registerThreadRecorders();
+	struct receiveRing ring; // reused for every connection this worker serves
+	struct responseBuffer responses;
+	initRing(&ring, RINGSIZE);
+	initResponses(&responses, RESPONSESIZE);
+
+	while (1) {
+		sem_wait(&pool->available);
+
+		// the semaphore says a socket is on its way, but a push that is still in progress can hide
+		// it from pop() for a moment, so keep trying until we get it
+		int clientSocketDescriptor;
+		while (!takeConnection(pool, clientSocketDescriptor)) {
+			sched_yield();
+		}
+
+		if (clientSocketDescriptor == -1) {
+			break;
+		}
+
+		if (sinkPath != NULL) {
+			sinkClient(clientSocketDescriptor);
+		}
+		else {
+			respondToClient(clientSocketDescriptor, &ring, &responses);
+		}
+	}
+
+	freeRing(&ring);
+	freeResponses(&responses);
+	retireThreadRecorders();
+	return NULL;
+}
+
 /*
- * The program will take in 2 arguments. argv[1] will be the port number (2648)
- * argv[2] will be the number of iterations the server will perfrom on "read"
- * from the socket. If the client performs 100 iterations of data transmission,
- * the server should perform at least 100 reads from the socket to completly
- * recieve all data sent by the client. So the value should be the same as the
- * clients iteration argument.
+ * Tells every worker to finish once the sockets already handed to the pool are served. The stop
+ * markers go to the back of the spillover list, which workers only look at once the queue is empty,
+ * so they come after every real connection.
  */
-int main(int argc, char** argv) {
-	cout << argc << endl;
-	char* port = argv[1]; // 2648 (last four of my student id)
-	int iterations = atoi(argv[2]);
+void stopWorkers(struct workerPool* pool, vector<pthread_t>& workers) {
+	pthread_mutex_lock(&pool->spilloverLock);
+	for (size_t i = 0; i < workers.size(); i++) {
+		pool->spillover.push_back(-1);
+	}
+	pthread_mutex_unlock(&pool->spilloverLock);
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		sem_post(&pool->available);
+	}
+	for (size_t i = 0; i < workers.size(); i++) {
+		pthread_join(workers[i], NULL);
+	}
+}
+
+/*
+ * Hands out one of the listening sockets taken over from the server this one replaced, set up like
+ * getListeningSocket would have (blocking or not, and our backlog). Returns -1 if none are left.
+ */
+int takeInheritedListener(bool nonBlocking) {
+	pthread_mutex_lock(&listenersLock);
+	int serverSocket = -1;
+
+	if (!inheritedListeners.empty()) {
+		serverSocket = inheritedListeners.front();
+		inheritedListeners.erase(inheritedListeners.begin());
+		listeners.push_back(serverSocket);
+	}
+	pthread_mutex_unlock(&listenersLock);
+
+	if (serverSocket != -1) {
+		int flags = fcntl(serverSocket, F_GETFL);
+		fcntl(serverSocket, F_SETFL, nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+		listen(serverSocket, listenBacklog); // listen() again on a listening socket just changes its backlog
+	}
+
+	return serverSocket;
+}
+
+// closes a listening socket and takes it off the list a hot restart hands over
+void closeListener(int serverSocket) {
+	pthread_mutex_lock(&listenersLock);
+	for (size_t i = 0; i < listeners.size(); i++) {
+		if (listeners[i] == serverSocket) {
+			listeners.erase(listeners.begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&listenersLock);
+
+	close(serverSocket);
+}
+
+/*
+ * Creates the socket the server listens on, binds it to the port and calls listen() on it.
+ * When reusePort is true the socket also gets SO_REUSEPORT, which lets several sockets bind the
+ * same port (one per event loop) and has the kernel spread new connections between them.
+ * When nonBlocking is true accept() on the socket returns EAGAIN instead of waiting.
+ * A server started with --takeover gets the sockets of the server it replaces instead.
+ * Returns the listening socket descriptor, or exits the program if any step fails.
+ */
+int getListeningSocket(char* port, bool reusePort, bool nonBlocking) {
+	int inherited = takeInheritedListener(nonBlocking);
+	if (inherited != -1) {
+		return inherited;
+	}
 
 	// Step 1 - Declare an addrinfo structure (defined in netdb.h), initialize it to zero, 
 	// and set its data members to have my port, have an internet family, send streams (not datagrams), and be passive
@@ -125,41 +895,69 @@ int main(int argc, char** argv) {
 	// all socket() does is open a socket file on your computer and return the descriptor for it.
 	// if successful, returns the descriptor, if unsuccessful, returns -1
 	// socket() doesnt actually do anything yet, its like building the doorframe without connecting it to a wall yet (cant send or recieve bytes)
+	// the IPv6 guesses go first: with IPV6_V6ONLY off an IPv6 socket also takes IPv4 connections (as ::ffff:a.b.c.d),
+	// so one socket serves clients of both families. The IPv4 guesses are only tried if the system has no IPv6
 	struct addrinfo* curr = result; // result is the head of the linked list and curr is each record/ node
 
 	int serverSocket = -1;
 
-	while (curr != NULL) {
-		serverSocket = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+	for (int pass = 0; pass < 2 && serverSocket == -1; pass++, curr = result) {
+		while (curr != NULL) {
+			// pass 0 only looks at the IPv6 guesses, pass 1 at the rest
+			if ((curr->ai_family == AF_INET6) != (pass == 0)) {
+				curr = curr->ai_next;
+				continue;
+			}
+
+			// SOCK_NONBLOCK makes the accept() calls on this socket return right away when nobody is waiting
+			int socketType = curr->ai_socktype | (nonBlocking ? SOCK_NONBLOCK : 0);
+			serverSocket = socket(curr->ai_family, socketType, curr->ai_protocol);
 
-		if (serverSocket == -1) {
+			if (serverSocket == -1) {
+				curr = curr->ai_next;
+				continue; // couldnt create a socket so try next addressinfo guess
+			}
+
+			// if it successfully created a socket, we have to configure it
+			// specifically make sure that the listening sockets port can be reused once we create a thread to handle the connection with a new sd
+			// to do this, use setsockopt(). Returns -1 if failes and 0 if succeeds. Arguments:
+			// 1. The sockets file descriptor
+			// 2. The level - the level to manipulate the option
+			// 3. An int for option name - the type of option we want to change
+			// 4. A void pointer optval - the new value we want to set the option to (we are going to assign it the value 1)
+			// 5. Option length - size of previous arguments value
+			// Note: void pointers can hold address of any type and can be typcasted to any type. Cannot be derefrenced
+			int enable = 1; // the value 1 enables the reuse option
+			setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+			// dual-stack, see above. Some systems default to IPv6 only (net.ipv6.bindv6only) so turn it off explicitly
+			if (curr->ai_family == AF_INET6) {
+				int disable = 0;
+				setsockopt(serverSocket, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int));
+			}
+
+			// every event loop binds its own socket to the same port, which is only allowed with SO_REUSEPORT
+			if (reusePort) {
+				setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+			}
+
+			// accepted connections inherit the buffer sizes, and they only shape the window if set before listen()
+			applyBufferSizes(serverSocket, &tuning);
+
+			// Bind the socket descriptor we just created to the PORT we desire
+			// It reserves the port for our current process (whos job is to listen for connections)
+			int successfullyBinded = bind(serverSocket, curr->ai_addr, curr->ai_addrlen);
+
+			// if could bind, returns 0, so we can break and use it
+			if (successfullyBinded == 0) {
+				break;
+			}
+
+			// otherwise, close the socket and try the next guess
+			close(serverSocket);
+			serverSocket = -1;
 			curr = curr->ai_next;
-			continue; // couldnt create a socket so try next addressinfo guess
-		}
-
-		// if it successfully created a socket, we have to configure it
-		// specifically make sure that the listening sockets port can be reused once we create a thread to handle the connection with a new sd
-		// to do this, use setsockopt(). Returns -1 if failes and 0 if succeeds. Arguments:
-		// 1. The sockets file descriptor
-		// 2. The level - the level to manipulate the option
-		// 3. An int for option name - the type of option we want to change
-		// 4. A void pointer optval - the new value we want to set the option to (we are going to assign it the value 1)
-		// 5. Option length - size of previous arguments value
-		// Note: void pointers can hold address of any type and can be typcasted to any type. Cannot be derefrenced
-		int enable = 1; // the value 1 enables the reuse option
-		setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
-
-		// Bind the socket descriptor we just created to the PORT we desire
-		// It reserves the port for our current process (whos job is to listen for connections)
-		int successfullyBinded = bind(serverSocket, curr->ai_addr, curr->ai_addrlen);
-
-		// if could bind, returns 0, so we can break and use it
-		if (successfullyBinded == 0) {
-			break;
 		}
-
-		// otherwise, close the socket and try the next guess
-		close(serverSocket);
 	}
 
 	// if serverSocket is still -1, could not create a socket successfully so abort
@@ -174,8 +972,8 @@ int main(int argc, char** argv) {
 	// Step 4 - Listen on the socket we just created
 	// Tells the OS it is ready to start recieving connections on this port
 	// Needs the serverSocket as a parameter, along with a backlog (number of connections it can handle before it refuses connections)
-	// in this case it is also the number of threads with their own socket descripters handling each users request
-	int listening = listen(serverSocket, 5);
+	// it used to be 5, which dropped SYNs whenever a burst of clients connected at once, so now it is --backlog (SOMAXCONN by default)
+	int listening = listen(serverSocket, listenBacklog);
 
 	// if listen returns -1 it means it failed to listen
 	if (listening == -1) {
@@ -183,29 +981,1531 @@ int main(int argc, char** argv) {
 		exit (EXIT_FAILURE);
 	}
 
-	// displays that it is listening (just for debugging purposes)
-	cout << "Listening for client connection requests on port " << port << "!" << endl;
+	pthread_mutex_lock(&listenersLock);
+	listeners.push_back(serverSocket);
+	pthread_mutex_unlock(&listenersLock);
 
-	// Step 5 - Keep the server running indefinently, listening for client connection requests and accepting them
-	// this is done via an infinite loop
-	// to accept client connections, we use the accept function which takes in
-	// 1. the server socket descriptor
-	// 2. a pointer for a sockaddr - the client address. Where the accept function will store the location of this
-	// 3. a pointer to the length of the variable pointed to by the previous argument
-	// returns -1 if cannot accept, and a new file descriptor if it does accept
+	return serverSocket;
+}
+
+/*
+ * The accept for the thread and pool modes. It waits on the (non-blocking) listening sockets and
+ * stopEvent together, so a stop does not have to wait for one more client to show up. There is
+ * usually one listening socket, but a server that took over an epoll server (--takeover) has one per
+ * loop of that server, and each of them has its own backlog of waiting clients, so all are accepted
+ * from, taking turns. Once the server is stopping it still takes the connections already waiting in
+ * the backlogs, unless the sockets went to a new server (then they are that server's), and then
+ * returns -1.
+ */
+int acceptOrStop(const vector<int>& serverSockets) {
+	static size_t turn = 0; // which socket goes first, so a busy one cannot starve the others
+	size_t count = serverSockets.size();
+	vector<struct pollfd> waitFor(count + 1);
+
+	for (size_t i = 0; i < count; i++) {
+		waitFor[i].fd = serverSockets[i];
+		waitFor[i].events = POLLIN;
+	}
+	waitFor[count].fd = stopEvent;
+	waitFor[count].events = POLLIN;
 
 	while (1) {
-		struct sockaddr clientAddress;
-		socklen_t clientAddressLength = sizeof(clientAddress);
+		if (!stopping.load()) {
+			poll(waitFor.data(), count + 1, -1);
+			socketSyscalls.fetch_add(1, memory_order_relaxed);
+		}
+		else if (handedOff.load()) {
+			return -1;
+		}
 
-		int clientSocketDescriptor = accept(serverSocket, &clientAddress, &clientAddressLength);
+		for (size_t n = 0; n < count; n++) {
+			size_t i = (turn + n) % count;
 
-		//cout << "recieved request from client address: " << clientAddress.sa_data << endl;
+			if (!stopping.load() && (waitFor[i].revents & POLLIN) == 0) {
+				continue;
+			}
+
+			int clientSocketDescriptor = accept(serverSockets[i], NULL, NULL); // the accepted socket blocks even though the listener does not
+			socketSyscalls.fetch_add(1, memory_order_relaxed);
+
+			if (clientSocketDescriptor != -1) {
+				turn = i + 1;
+				return clientSocketDescriptor;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				acceptFailed(errno);
+			}
+			// otherwise the client gave up between the poll and the accept, or this backlog is empty
+		}
+
+		if (stopping.load()) {
+			return -1; // every backlog is empty
+		}
+	}
+}
+
+/*
+ * Everything the epoll mode needs to remember about one connection between wakeups.
+ * It is the same information respondToClient keeps in local variables, except a blocking
+ * thread can keep it on its stack and an event loop has to park it here while it
+ * serves other connections.
+ */
+struct connectionState {
+	int socketDescriptor;
+	struct receiveRing ring; // bytes received but not parsed yet
+	struct responseBuffer responses; // answers to requests that still have to be written
+	struct messageParser parser;
+	int count; // number of read() calls that returned data
+	long start; // time the connection was accepted (nanoseconds on the monotonic clock)
+	long pendingSince; // when the oldest response still in the buffer was queued
+	bool waiting; // on its loop's list of connections with responses to flush
+	bool writing; // the socket did not take all the responses, so reading waits until the rest is out
+	bool acknowledged; // the acknowledgement is queued, the connection closes once it is written
+	int epollDescriptor; // the epoll loop that owns the connection, -1 for the uring backend
+#ifdef HAVE_LIBURING
+	struct io_uring* uring; // the uring loop that owns the connection, NULL for epoll
+	bool receiving; // its multishot recv is armed
+	bool hungUp; // its recv ended without the last message (the client closed or the recv failed)
+	string held; // chunks that arrived while it was writing, parsed once the responses are out
+#endif
+};
+
+#ifdef HAVE_LIBURING
+void armSend(struct io_uring* ring, struct connectionState* state); // in the uring backend below
+#endif
+
+// what each event loop thread is handed when it is created
+struct eventLoopData {
+	char* port;
+};
+
+struct connectionState* newConnection(int socketDescriptor) {
+	struct connectionState* state = new connectionState;
+	state->socketDescriptor = socketDescriptor;
+	initRing(&state->ring, RINGSIZE);
+	initResponses(&state->responses, RESPONSESIZE);
+	resetParser(&state->parser);
+	state->count = 0;
+	state->pendingSince = 0;
+	state->waiting = false;
+	state->writing = false;
+	state->acknowledged = false;
+	state->epollDescriptor = -1;
+#ifdef HAVE_LIBURING
+	state->uring = NULL;
+	state->receiving = false;
+	state->hungUp = false;
+#endif
+	state->parser.messageTimes = messageHistogram;
+	state->start = monotonicNanoseconds();
+	countStat(threadStats, STAT_OPENED, 1);
+
+	return state;
+}
+
+void deleteConnection(struct connectionState* state) {
+	countStat(threadStats, STAT_CLOSED, 1);
+	freeRing(&state->ring);
+	freeResponses(&state->responses);
+	delete state;
+}
+
+/*
+ * Starts writing the queued responses of an epoll or uring connection without ever blocking its
+ * loop. Whatever the socket does not take right away stays in the buffer: an epoll connection then
+ * waits for EPOLLOUT, a uring connection gets a send request, and either one stops reading until the
+ * rest is out. That way a client that sends requests without reading the answers only stalls itself.
+ * Returns false if the connection broke.
+ */
+bool writeResponses(struct connectionState* state) {
+	if (state->writing) {
+		return true; // the rest goes out when the socket takes it
+	}
+	if (!sendResponses(state->socketDescriptor, &state->responses)) {
+		return false;
+	}
+	if (state->responses.used == 0) {
+		return true;
+	}
+
+	state->writing = true;
+
+#ifdef HAVE_LIBURING
+	if (state->uring != NULL) {
+		armSend(state->uring, state);
+		return true;
+	}
+#endif
+
+	struct epoll_event event;
+	event.events = EPOLLOUT;
+	event.data.ptr = state;
+	epoll_ctl(state->epollDescriptor, EPOLL_CTL_MOD, state->socketDescriptor, &event);
+	pendingSyscalls++;
+	return true;
+}
+
+/*
+ * Queues the acknowledgement behind the responses still waiting and starts writing them. If the
+ * buffer is too full for it, the acknowledgement goes in once the responses before it are out (the
+ * caller calls this again then). Returns true once everything is written or the connection broke,
+ * so it can be closed, false while the connection is still writing.
+ */
+bool finishConnection(struct connectionState* state) {
+	while (!state->acknowledged) {
+		if (queueAcknowledgement(&state->responses, state->count, &state->parser)) {
+			state->acknowledged = true;
+			break;
+		}
+		if (!writeResponses(state)) {
+			return true;
+		}
+		if (state->writing) {
+			return false;
+		}
+	}
+
+	if (!writeResponses(state)) {
+		return true;
+	}
+
+	return !state->writing;
+}
+
+// reports the time just like respondToClient and sends the acknowledgement, returns what finishConnection returned
+bool acknowledgeConnection(struct connectionState* state) {
+	long end = monotonicNanoseconds();
+
+	recordValue(connectionHistogram, end - state->start);
+	logConnection(state->start, end, state->parser.payloadBytes, state->count);
+
+	return finishConnection(state);
+}
+
+// records when the first response of a batch was queued, given how many bytes were queued before the parse
+void markPending(struct connectionState* state, size_t queued) {
+	if (queued == 0 && state->responses.used > 0) {
+		state->pendingSince = state->parser.receivedAt;
+	}
+}
+
+/*
+ * Puts a connection with responses waiting on its loop's list, so they are written at the end of the
+ * loop turn (see flushWaiting) together with whatever else it answered in that turn.
+ */
+void startWaiting(vector<struct connectionState*>& waiting, struct connectionState* state) {
+	if (state->responses.used > 0 && !state->waiting && !state->writing) {
+		state->waiting = true;
+		waiting.push_back(state);
+	}
+}
+
+// takes a connection that is about to be closed off its loop's list
+void stopWaiting(vector<struct connectionState*>& waiting, struct connectionState* state) {
+	if (!state->waiting) {
+		return;
+	}
+
+	for (size_t i = 0; i < waiting.size(); i++) {
+		if (waiting[i] == state) {
+			waiting.erase(waiting.begin() + i);
+			break;
+		}
+	}
+	state->waiting = false;
+}
+
+/*
+ * Writes the responses of every waiting connection that are due (see responsesDue), one write per
+ * connection, and keeps the others on the list. A due batch the socket does not fully take goes on
+ * with writeResponses like any other, so a slow reader never holds up the rest of the loop. Returns
+ * the nanoseconds until the next one is due, or -1 if no connection is waiting anymore.
+ */
+long flushWaiting(vector<struct connectionState*>& waiting) {
+	long now = monotonicNanoseconds();
+	long nextDue = -1;
+	size_t kept = 0;
+
+	for (size_t i = 0; i < waiting.size(); i++) {
+		struct connectionState* state = waiting[i];
+
+		if (state->writing) {
+			state->waiting = false; // its responses already wait on the socket, they go out with the rest
+			continue;
+		}
+
+		if (responsesDue(&state->responses, state->pendingSince, now) && !writeResponses(state)) {
+			state->responses.used = 0; // the connection broke, its next read fails and closes it
+		}
+
+		if (state->responses.used == 0 || state->writing) {
+			state->waiting = false;
+			continue;
+		}
+
+		waiting[kept++] = state;
+		long due = state->pendingSince + flushDelay;
+		if (nextDue == -1 || due < nextDue) {
+			nextDue = due;
+		}
+	}
+
+	waiting.resize(kept);
+	return (nextDue == -1) ? -1 : max(nextDue - now, 0L);
+}
+
+/*
+ * Reads whatever is available on the connection without blocking. The answers to its requests
+ * are left in its response buffer for the end of the loop turn, unless another full ring's worth
+ * might not fit. Returns true if the connection is finished (acknowledged or broken) and should
+ * be closed, false if we have to wait for more data.
+ */
+bool driveConnection(struct connectionState* state) {
+	while (1) {
+		long bytes = readIntoRing(state->socketDescriptor, &state->ring);
+		pendingSyscalls++;
+
+		if (bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return false; // drained the socket for now, epoll will tell us when there is more
+		}
+		if (bytes <= 0) {
+			return true; // client hung up early or the read failed
+		}
+
+		state->count++;
+		state->parser.receivedAt = monotonicNanoseconds();
+		size_t queued = state->responses.used;
+		countReceived(bytes, parseMessages(&state->ring, &state->parser, &state->responses));
+		pendingSyscalls += rearmQuickAck(state->socketDescriptor, &tuning);
+		markPending(state, queued);
+
+		if (state->parser.broken) {
+			return true;
+		}
+		if (state->parser.sawLast) {
+			return acknowledgeConnection(state);
+		}
+		if (state->responses.capacity - state->responses.used < (size_t) RINGSIZE) {
+			if (!writeResponses(state)) {
+				return true;
+			}
+			if (state->writing) {
+				return false; // reading goes on once EPOLLOUT says the client took the responses
+			}
+		}
+	}
+}
+
+/*
+ * Called when EPOLLOUT (or an error) comes in for a connection that is writing. Writes what is left
+ * of its responses and, once they are all out, goes back to waiting for EPOLLIN and picks up where
+ * it stopped. Returns true if the connection is finished and should be closed, like driveConnection.
+ */
+bool resumeConnection(struct connectionState* state) {
+	if (!sendResponses(state->socketDescriptor, &state->responses)) {
+		return true;
+	}
+	if (state->responses.used > 0) {
+		return false;
+	}
+
+	state->writing = false;
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = state;
+	epoll_ctl(state->epollDescriptor, EPOLL_CTL_MOD, state->socketDescriptor, &event);
+	pendingSyscalls++;
+
+	if (state->parser.sawLast) {
+		return finishConnection(state);
+	}
+
+	return driveConnection(state);
+}
+
+/*
+ * Accepts everyone waiting on the loop's listening socket and adds them to its epoll set.
+ * Returns how many connections it accepted.
+ */
+int acceptWaiting(int serverSocket, int epollDescriptor) {
+	int accepted = 0;
+
+	while (1) {
+		int clientSocketDescriptor = accept4(serverSocket, NULL, NULL, SOCK_NONBLOCK);
+		pendingSyscalls++;
 
 		if (clientSocketDescriptor == -1) {
-			cout << "Failed to accept client connection request" << endl;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				acceptFailed(errno); // anything but "nobody else is waiting" gets retried on the next wakeup
+			}
+			return accepted;
+		}
+
+		countStat(threadStats, STAT_ACCEPTED, 1);
+		tuneConnection(clientSocketDescriptor);
+		trackConnection(clientSocketDescriptor);
+		struct connectionState* state = newConnection(clientSocketDescriptor);
+		state->epollDescriptor = epollDescriptor;
+
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.ptr = state;
+		epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, clientSocketDescriptor, &event);
+		pendingSyscalls++;
+		accepted++;
+	}
+}
+
+/*
+ * Body of each event loop thread. It opens its own non-blocking listening socket, then waits
+ * on epoll for either new connections or data on the connections it already owns. A
+ * connection stays with the loop that accepted it for its whole life, so the loops never
+ * share any state with each other. When the server stops, the loop takes what is left in its
+ * backlog, closes its listening socket and returns once its last connection is done.
+ */
+void* runEventLoop(void* input) {
+	struct eventLoopData* loopData = (struct eventLoopData*)input;
+	registerThreadRecorders();
+
+	int serverSocket = getListeningSocket(loopData->port, true, true);
+	int epollDescriptor = epoll_create1(0);
+
+	if (epollDescriptor == -1) {
+		cout << "Could not create an epoll instance" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// a NULL pointer in the event data means "this is the listening socket", &stopEvent means the server is stopping
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, serverSocket, &event);
+	event.data.ptr = &stopEvent;
+	epoll_ctl(epollDescriptor, EPOLL_CTL_ADD, stopEvent, &event);
+
+	const int MAXEVENTS = 256; // how many ready descriptors we handle per epoll_wait call
+	struct epoll_event events[MAXEVENTS];
+	vector<struct connectionState*> waiting; // connections with responses to write at the end of a turn
+	int timeout = -1;
+	long open = 0; // connections this loop is serving
+	bool listening = true;
+
+	while (listening || open > 0) {
+		int ready = epoll_wait(epollDescriptor, events, MAXEVENTS, timeout);
+		pendingSyscalls++;
+
+		for (int i = 0; i < ready; i++) {
+			struct connectionState* state = (struct connectionState*)events[i].data.ptr;
+
+			if (events[i].data.ptr == &stopEvent) {
+				if (!handedOff.load()) {
+					open += acceptWaiting(serverSocket, epollDescriptor);
+				}
+
+				// take the listener out of the epoll set before closing it. After a handoff the new server still holds
+				// the socket, so closing alone would leave it registered and wake this loop for every connection meant
+				// for the new server. The stop event stays readable so it goes too
+				epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, serverSocket, NULL);
+				epoll_ctl(epollDescriptor, EPOLL_CTL_DEL, stopEvent, NULL);
+				closeListener(serverSocket);
+				listening = false;
+				continue;
+			}
+
+			if (state != NULL) {
+				bool finished = state->writing ? resumeConnection(state) : driveConnection(state);
+
+				if (finished) {
+					stopWaiting(waiting, state);
+					closeConnection(state->socketDescriptor); // closing also removes it from the epoll set
+					deleteConnection(state);
+					open--;
+				}
+				else {
+					startWaiting(waiting, state);
+				}
+				continue;
+			}
+
+			// the listening socket is ready, so accept everyone who is waiting
+			if (listening) {
+				open += acceptWaiting(serverSocket, epollDescriptor);
+			}
+		}
+
+		// every connection answered this turn gets one write, or waits for the next turn while --flush-delay allows.
+		// epoll_wait only counts milliseconds, so the wait is rounded up rather than waking before it is due
+		long due = flushWaiting(waiting);
+		timeout = (due == -1) ? -1 : (int) ((due + 999999) / 1000000);
+		flushSyscalls();
+	}
+
+	close(epollDescriptor);
+	retireThreadRecorders();
+	return NULL;
+}
+
+#ifdef HAVE_LIBURING
+const int URING_ENTRIES = 4096; // submission queue slots per loop
+const int URING_BUFFERS = 1024; // receive buffers each loop hands the kernel, must be a power of two
+const int URING_BUFFER_GROUP = 0; // id the recv requests use to find the buffer ring
+
+// user_data values that mark the multishot accept, the poll on stopEvent and the cancel requests.
+// every other completion carries a connectionState pointer, with SEND_TAG or'ed in for its send
+const __u64 ACCEPT_TAG = 0;
+const __u64 STOP_TAG = 1;
+const __u64 CANCEL_TAG = 2;
+const __u64 SEND_TAG = 1; // connectionState pointers are aligned, so their lowest bit is free
+
+/*
+ * Returns a submission slot, submitting what is already queued first if the ring is full.
+ */
+struct io_uring_sqe* getSubmission(struct io_uring* ring) {
+	struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+
+	while (sqe == NULL) {
+		io_uring_submit(ring);
+		pendingSyscalls++;
+		sqe = io_uring_get_sqe(ring);
+	}
+
+	return sqe;
+}
+
+void armAccept(struct io_uring* ring, int serverSocket) {
+	struct io_uring_sqe* sqe = getSubmission(ring);
+	io_uring_prep_multishot_accept(sqe, serverSocket, NULL, NULL, 0);
+	io_uring_sqe_set_data64(sqe, ACCEPT_TAG);
+}
+
+// completes once the server is stopping
+void armStop(struct io_uring* ring) {
+	struct io_uring_sqe* sqe = getSubmission(ring);
+	io_uring_prep_poll_add(sqe, stopEvent, POLLIN);
+	io_uring_sqe_set_data64(sqe, STOP_TAG);
+}
+
+// one recv request that keeps producing a completion per chunk until the connection ends
+void armReceive(struct io_uring* ring, struct connectionState* state) {
+	struct io_uring_sqe* sqe = getSubmission(ring);
+	io_uring_prep_recv_multishot(sqe, state->socketDescriptor, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT; // let the kernel pick a buffer out of the ring for every chunk
+	sqe->buf_group = URING_BUFFER_GROUP;
+	io_uring_sqe_set_data(sqe, state);
+	state->receiving = true;
+}
+
+/*
+ * Sends the responses the socket did not take right away (see writeResponses) as a request of its
+ * own, and cancels the connection's recv so it stops taking in more requests until they are out.
+ * The buffer must not move until the send completes, new responses only go in behind it.
+ */
+void armSend(struct io_uring* ring, struct connectionState* state) {
+	struct io_uring_sqe* sqe = getSubmission(ring);
+	io_uring_prep_send(sqe, state->socketDescriptor, state->responses.data, state->responses.used, MSG_NOSIGNAL);
+	io_uring_sqe_set_data64(sqe, (__u64) state | SEND_TAG);
+
+	if (state->receiving) {
+		sqe = getSubmission(ring);
+		io_uring_prep_cancel64(sqe, (__u64) state, 0);
+		io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+	}
+}
+
+// sets up a connection the uring loop just accepted and starts receiving on it
+void startConnection(struct io_uring* ring, int clientSocketDescriptor) {
+	countStat(threadStats, STAT_ACCEPTED, 1);
+	tuneConnection(clientSocketDescriptor);
+	trackConnection(clientSocketDescriptor);
+	struct connectionState* state = newConnection(clientSocketDescriptor);
+	state->uring = ring;
+	armReceive(ring, state);
+}
+
+// copies one received chunk into the connection's ring (so messages split across chunks still parse) and parses it
+void parseChunk(struct connectionState* state, const char* chunk, size_t length) {
+	appendToRing(&state->ring, chunk, length);
+	state->parser.receivedAt = monotonicNanoseconds();
+	size_t queued = state->responses.used;
+	countReceived(length, parseMessages(&state->ring, &state->parser, &state->responses));
+	markPending(state, queued);
+
+	if (state->responses.capacity - state->responses.used < (size_t) RINGSIZE && !writeResponses(state)) {
+		state->parser.broken = true;
+	}
+}
+
+/*
+ * What follows a parse: after the last message the acknowledgement goes out, otherwise the answers
+ * wait for the end of the loop turn. A connection that is done gets its read side shut down, which
+ * ends the multishot recv.
+ */
+void settleParse(struct connectionState* state, vector<struct connectionState*>& waiting) {
+	if (state->parser.sawLast) {
+		acknowledgeConnection(state);
+	}
+	else {
+		startWaiting(waiting, state);
+	}
+
+	if ((state->parser.sawLast || state->parser.broken) && state->receiving) {
+		shutdown(state->socketDescriptor, SHUT_RD);
+		pendingSyscalls++;
+	}
+}
+
+/*
+ * Handles the completion of a connection's send. Sends the rest if the socket took only part of it,
+ * otherwise goes on where the connection stopped: the acknowledgement if it is waiting, or the
+ * chunks held while it was writing.
+ */
+void completeSend(struct io_uring* ring, struct connectionState* state, int result, vector<struct connectionState*>& waiting) {
+	state->writing = false;
+
+	if (result <= 0) {
+		state->parser.broken = true;
+		state->responses.used = 0;
+	}
+	else {
+		memmove(state->responses.data, state->responses.data + result, state->responses.used - result);
+		state->responses.used -= result;
+
+		if (state->responses.used > 0) {
+			state->writing = true;
+			armSend(ring, state);
+			return;
+		}
+	}
+
+	if (state->parser.broken) {
+		if (state->receiving) {
+			shutdown(state->socketDescriptor, SHUT_RD);
+			pendingSyscalls++;
+		}
+		return;
+	}
+	if (state->parser.sawLast) {
+		finishConnection(state);
+		return;
+	}
+
+	while (!state->held.empty() && !state->writing && !state->parser.sawLast && !state->parser.broken) {
+		size_t piece = min(state->held.size(), (size_t) BUFSIZE);
+		parseChunk(state, state->held.data(), piece);
+		state->held.erase(0, piece);
+	}
+
+	settleParse(state, waiting);
+}
+
+/*
+ * Once none of a connection's requests are in flight anymore, it either gets its recv again (it still
+ * expects data) or is closed. A client that only closed its sending side still gets its answers
+ * first. Returns true if the connection was closed.
+ */
+bool settleConnection(struct io_uring* ring, struct connectionState* state, vector<struct connectionState*>& waiting) {
+	if (state->receiving || state->writing) {
+		return false;
+	}
+
+	if (!state->parser.sawLast && !state->parser.broken && !state->hungUp) {
+		armReceive(ring, state);
+		return false;
+	}
+
+	if (!state->parser.broken && state->responses.used > 0 && writeResponses(state) && state->writing) {
+		return false;
+	}
+
+	stopWaiting(waiting, state);
+	closeConnection(state->socketDescriptor);
+	pendingSyscalls++;
+	deleteConnection(state);
+	return true;
+}
+
+/*
+ * Checks once at startup whether this kernel can run the uring backend: it needs registered buffer
+ * rings (5.19) and multishot recv (6.0). Returns false if the server should fall back to read().
+ */
+bool uringSupported() {
+	struct utsname kernel;
+	int major = 0;
+	int minor = 0;
+
+	if (uname(&kernel) == 0) {
+		sscanf(kernel.release, "%d.%d", &major, &minor);
+	}
+	if (major < 6) {
+		return false;
+	}
+
+	struct io_uring ring;
+	if (io_uring_queue_init(8, &ring, 0) < 0) {
+		return false; // io_uring is missing or turned off (for example by a container seccomp profile)
+	}
+
+	int error = 0;
+	struct io_uring_buf_ring* buffers = io_uring_setup_buf_ring(&ring, 8, URING_BUFFER_GROUP, 0, &error);
+	if (buffers != NULL) {
+		io_uring_free_buf_ring(&ring, buffers, 8, URING_BUFFER_GROUP);
+	}
+
+	io_uring_queue_exit(&ring);
+	return buffers != NULL;
+}
+
+/*
+ * Body of each loop thread for the uring backend. Works like runEventLoop, but instead of asking
+ * epoll which sockets are ready and reading each one, the loop keeps a multishot accept and one
+ * multishot recv per connection armed. The kernel copies incoming data straight into buffers from
+ * the registered ring and posts one completion per chunk, and a single io_uring_submit_and_wait()
+ * both hands over new requests and collects every completion that is ready. A poll on stopEvent
+ * tells it when the server stops, and from there it drains like runEventLoop.
+ */
+void* runUringLoop(void* input) {
+	struct eventLoopData* loopData = (struct eventLoopData*)input;
+	registerThreadRecorders();
+
+	int serverSocket = getListeningSocket(loopData->port, true, false);
+
+	struct io_uring ring;
+	if (io_uring_queue_init(URING_ENTRIES, &ring, 0) < 0) {
+		cout << "Could not create an io_uring instance" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// one big allocation sliced into BUFSIZE buffers, all handed to the kernel up front
+	int error = 0;
+	struct io_uring_buf_ring* bufferRing = io_uring_setup_buf_ring(&ring, URING_BUFFERS, URING_BUFFER_GROUP, 0, &error);
+	if (bufferRing == NULL) {
+		cout << "Could not register the io_uring buffer ring" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	char* buffers = poolAllocate(URING_BUFFERS * BUFSIZE);
+	int bufferMask = io_uring_buf_ring_mask(URING_BUFFERS);
+
+	for (int i = 0; i < URING_BUFFERS; i++) {
+		io_uring_buf_ring_add(bufferRing, buffers + i * BUFSIZE, BUFSIZE, i, bufferMask, i);
+	}
+	io_uring_buf_ring_advance(bufferRing, URING_BUFFERS);
+
+	armAccept(&ring, serverSocket);
+	armStop(&ring);
+
+	vector<struct connectionState*> waiting; // connections with responses to write at the end of a turn
+	long due = -1;
+	long open = 0; // connections this loop is serving
+	bool listening = true;
+
+	while (listening || open > 0) {
+		if (due == -1) {
+			io_uring_submit_and_wait(&ring, 1);
+		}
+		else {
+			// wake up when the oldest waiting response is due even if nothing completes before then
+			struct __kernel_timespec untilDue;
+			untilDue.tv_sec = due / 1000000000L;
+			untilDue.tv_nsec = due % 1000000000L;
+			struct io_uring_cqe* first;
+			io_uring_submit_and_wait_timeout(&ring, &first, 1, &untilDue, NULL);
+		}
+		pendingSyscalls++;
+
+		struct io_uring_cqe* cqe;
+		unsigned head;
+		unsigned seen = 0;
+		int recycled = 0; // buffers given back to the kernel this turn
+
+		io_uring_for_each_cqe(&ring, head, cqe) {
+			seen++;
+			bool more = (cqe->flags & IORING_CQE_F_MORE) != 0; // false once the multishot request has ended
+
+			if (io_uring_cqe_get_data64(cqe) == ACCEPT_TAG) {
+				if (cqe->res >= 0) {
+					startConnection(&ring, cqe->res);
+					open++;
+				}
+				else if (cqe->res != -ECANCELED) {
+					acceptFailed(-cqe->res);
+				}
+				if (!more && listening) {
+					armAccept(&ring, serverSocket);
+				}
+				continue;
+			}
+
+			if (io_uring_cqe_get_data64(cqe) == CANCEL_TAG) {
+				continue;
+			}
+
+			if (io_uring_cqe_get_data64(cqe) == STOP_TAG) {
+				// the server is stopping: end the multishot accept and take what is still in the backlog ourselves,
+				// unless the listener went to a new server. The accept holds its own reference, so closing is safe
+				struct io_uring_sqe* sqe = getSubmission(&ring);
+				io_uring_prep_cancel64(sqe, ACCEPT_TAG, 0);
+				io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+
+				if (!handedOff.load()) {
+					fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+					int clientSocketDescriptor;
+
+					while ((clientSocketDescriptor = accept(serverSocket, NULL, NULL)) != -1) {
+						pendingSyscalls++;
+						startConnection(&ring, clientSocketDescriptor);
+						open++;
+					}
+					pendingSyscalls++;
+				}
+
+				closeListener(serverSocket);
+				listening = false;
+				continue;
+			}
+
+			struct connectionState* state = (struct connectionState*)(io_uring_cqe_get_data64(cqe) & ~SEND_TAG);
+
+			if (io_uring_cqe_get_data64(cqe) & SEND_TAG) {
+				completeSend(&ring, state, cqe->res, waiting);
+
+				if (settleConnection(&ring, state, waiting)) {
+					open--;
+				}
+				continue;
+			}
+
+			if (cqe->res > 0) {
+				// the data already sits in one of our buffers, so just account for it and give the buffer back
+				int bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				char* chunk = buffers + bufferId * BUFSIZE;
+				bool done = state->parser.sawLast || state->parser.broken;
+
+				if (!done) {
+					state->count++;
+
+					if (state->writing) {
+						state->held.append(chunk, cqe->res); // came in before the cancel did, parsed once the responses are out
+					}
+					else {
+						parseChunk(state, chunk, cqe->res);
+						settleParse(state, waiting);
+					}
+				}
+
+				io_uring_buf_ring_add(bufferRing, chunk, BUFSIZE, bufferId, bufferMask, recycled++);
+			}
+
+			if (!more) {
+				// the recv stops on its own when the ring ran out of buffers or armSend cancelled it, those get it
+				// again once the connection can read. Anything else means the client is gone
+				state->receiving = false;
+
+				if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+					state->hungUp = true;
+				}
+
+				if (settleConnection(&ring, state, waiting)) {
+					open--;
+				}
+			}
+		}
+
+		io_uring_cq_advance(&ring, seen);
+		io_uring_buf_ring_advance(bufferRing, recycled);
+		due = flushWaiting(waiting);
+		flushSyscalls();
+	}
+
+	io_uring_free_buf_ring(&ring, bufferRing, URING_BUFFERS, URING_BUFFER_GROUP);
+	io_uring_queue_exit(&ring);
+	poolFree(buffers, URING_BUFFERS * BUFSIZE);
+	retireThreadRecorders();
+	return NULL;
+}
+#endif
+
+const int DATAGRAM_BATCH = 32; // receive slots one recvmmsg call can fill
+const int DATAGRAM_SLOTSIZE = 65536; // with GRO one slot holds up to 64 KB of joined datagrams
+const long FLOW_KEEP = 10 * 1000000000L; // nanoseconds a flow is kept after its last datagram, in case its report got lost
+const long FLOW_SWEEP = 1000000000L; // nanoseconds between looks for flows to forget
+const size_t DATAGRAM_MAX_FLOWS = 256; // flows one loop keeps track of at once, each costs about 40 KB
+
+atomic<bool> groWarned(false); // so a refused UDP_GRO is only reported once, not per loop
+atomic<bool> flowsWarned(false); // the same for a full flow table
+
+// what a udp mode loop knows about one client's flow of datagrams
+struct datagramFlow {
+	struct sequenceTracker sequences;
+	struct latencyHistogram* latencies; // one-way, nanoseconds
+	long firstAt; // when the first and the latest datagram arrived
+	long lastAt;
+	long reportedAt; // when the last report went out, 0 if none has
+};
+
+// the flows one udp mode loop keeps track of
+struct flowTable {
+	map<uint32_t, struct datagramFlow*> flows; // by the flow number in the header
+	long sweptAt; // when forgetIdleFlows last ran
+};
+
+/*
+ * Creates the UDP socket of one udp mode loop: bound to the port with SO_REUSEPORT like the event
+ * loops' listeners, dual-stack like getListeningSocket, non-blocking and with UDP_GRO on. The kernel
+ * picks a loop for every datagram by hashing its addresses, so all datagrams of a flow reach the
+ * same loop. Exits the program if no socket could be bound.
+ */
+int getDatagramSocket(char* port) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* result;
+
+	if (getaddrinfo(NULL, port, &hints, &result) != 0) {
+		cout << "Could not translate address with given hints and port" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int datagramSocket = -1;
+
+	// the IPv6 guesses first, with IPV6_V6ONLY off an IPv6 socket takes IPv4 datagrams as well
+	for (int pass = 0; pass < 2 && datagramSocket == -1; pass++) {
+		for (struct addrinfo* curr = result; curr != NULL && datagramSocket == -1; curr = curr->ai_next) {
+			if ((curr->ai_family == AF_INET6) != (pass == 0)) {
+				continue;
+			}
+
+			datagramSocket = socket(curr->ai_family, curr->ai_socktype | SOCK_NONBLOCK, curr->ai_protocol);
+
+			if (datagramSocket == -1) {
+				continue;
+			}
+
+			int enable = 1;
+			setsockopt(datagramSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int));
+
+			if (curr->ai_family == AF_INET6) {
+				int disable = 0;
+				setsockopt(datagramSocket, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int));
+			}
+
+			// a datagram that finds the receive buffer full is dropped, so --rcvbuf decides a lot of the loss
+			applyBufferSizes(datagramSocket, &tuning);
+
+			if (bind(datagramSocket, curr->ai_addr, curr->ai_addrlen) != 0) {
+				close(datagramSocket);
+				datagramSocket = -1;
+			}
+		}
+	}
+
+	freeaddrinfo(result);
+
+	if (datagramSocket == -1) {
+		cout << "Could not create a socket with the given port" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int enable = 1;
+	if (setsockopt(datagramSocket, SOL_UDP, UDP_GRO, &enable, sizeof(int)) == -1 && !groWarned.exchange(true)) {
+		cout << "the kernel refused UDP_GRO, continuing with one datagram per receive slot" << endl;
+	}
+
+	return datagramSocket;
+}
+
+// answers a DATAGRAM_DONE with what the flow's datagrams looked like, sent to wherever the DONE came from
+void sendFlowReport(int datagramSocket, uint32_t flowId, struct datagramFlow* flow, const struct msghdr* from) {
+	struct datagramReport report;
+	report.received = flow->sequences.received;
+	report.duplicates = flow->sequences.duplicates;
+	report.reordered = flow->sequences.reordered;
+	report.late = flow->sequences.late;
+	report.receiveTime = flow->lastAt - flow->firstAt;
+	report.latencyP50 = valueAtPercentile(flow->latencies, 0.50);
+	report.latencyP99 = valueAtPercentile(flow->latencies, 0.99);
+	report.latencyMax = flow->latencies->max.load(memory_order_relaxed);
+
+	char answer[DATAGRAM_HEADERSIZE + DATAGRAM_REPORTSIZE];
+	encodeDatagramHeader(answer, DATAGRAM_REPORT, flowId, 0, 0);
+	encodeDatagramReport(answer + DATAGRAM_HEADERSIZE, &report);
+
+	sendto(datagramSocket, answer, sizeof(answer), 0, (const struct sockaddr*) from->msg_name, from->msg_namelen);
+	pendingSyscalls++;
+}
+
+void deleteFlow(struct datagramFlow* flow) {
+	delete flow->latencies;
+	delete flow;
+}
+
+/*
+ * Forgets the flows nothing arrived for in FLOW_KEEP, reported or not. A client that never sends its
+ * DONE (it crashed, or the datagrams were not from one of our clients at all) would otherwise be kept
+ * forever.
+ */
+void forgetIdleFlows(struct flowTable* table, long now) {
+	for (map<uint32_t, struct datagramFlow*>::iterator flow = table->flows.begin(); flow != table->flows.end(); ) {
+		if (now - max(flow->second->lastAt, flow->second->reportedAt) > FLOW_KEEP) {
+			deleteFlow(flow->second);
+			table->flows.erase(flow++);
+		}
+		else {
+			flow++;
+		}
+	}
+
+	table->sweptAt = now;
+}
+
+/*
+ * Handles one datagram: a data datagram is counted against its flow (sequence number and one-way
+ * latency, which also goes into the message receive time histogram), a DONE gets the flow's report.
+ * Datagrams that are not ours are ignored, and so are new flows while the table is full of flows
+ * that are still active.
+ */
+void handleDatagram(struct flowTable* table, int datagramSocket, const char* data, long length, long now, const struct msghdr* from) {
+	struct datagramHeader header;
+
+	if (!decodeDatagramHeader(data, length, &header)) {
+		return;
+	}
+
+	if (now - table->sweptAt > FLOW_SWEEP) {
+		forgetIdleFlows(table, now);
+	}
+
+	map<uint32_t, struct datagramFlow*>::iterator entry = table->flows.find(header.flow);
+	struct datagramFlow* flow;
+
+	if (entry != table->flows.end()) {
+		flow = entry->second;
+	}
+	else {
+		if (table->flows.size() >= DATAGRAM_MAX_FLOWS) {
+			forgetIdleFlows(table, now);
+		}
+		if (table->flows.size() >= DATAGRAM_MAX_FLOWS) {
+			if (!flowsWarned.exchange(true)) {
+				cout << "more than " << DATAGRAM_MAX_FLOWS << " flows at once on one loop, ignoring datagrams of new ones" << endl;
+			}
+			return;
+		}
+
+		flow = new datagramFlow;
+		resetSequenceTracker(&flow->sequences);
+		flow->latencies = newHistogram();
+		flow->firstAt = flow->lastAt = now;
+		flow->reportedAt = 0;
+		table->flows[header.flow] = flow;
+	}
+
+	if (header.flags & DATAGRAM_DATA) {
+		long latency = now - (long) header.sentAt;
+		trackSequence(&flow->sequences, header.sequence);
+		recordValue(flow->latencies, latency);
+		recordValue(messageHistogram, latency);
+		flow->lastAt = now;
+	}
+	else if (header.flags & DATAGRAM_DONE) {
+		sendFlowReport(datagramSocket, header.flow, flow, from);
+		flow->reportedAt = now;
+	}
+}
+
+/*
+ * Body of each udp mode thread. It takes in datagrams DATAGRAM_BATCH slots per recvmmsg call until
+ * the socket is empty, then waits for it (or a stop) with poll. With GRO a slot can hold many
+ * datagrams of one flow back to back, and the UDP_GRO control message says how long each one is.
+ * A stop ends the loop right away: UDP has no connections to drain, and a client whose datagrams
+ * were still in flight counts them as lost.
+ */
+void* runDatagramLoop(void* input) {
+	struct eventLoopData* loopData = (struct eventLoopData*)input;
+	registerThreadRecorders();
+
+	int datagramSocket = getDatagramSocket(loopData->port);
+	char* slots = poolAllocate(DATAGRAM_BATCH * DATAGRAM_SLOTSIZE);
+	struct mmsghdr messages[DATAGRAM_BATCH];
+	struct iovec segments[DATAGRAM_BATCH];
+	struct sockaddr_storage senders[DATAGRAM_BATCH];
+	char controls[DATAGRAM_BATCH][CMSG_SPACE(sizeof(int))];
+	struct flowTable table;
+	table.sweptAt = monotonicNanoseconds();
+
+	memset(messages, 0, sizeof(messages));
+	for (int i = 0; i < DATAGRAM_BATCH; i++) {
+		segments[i].iov_base = slots + (long) i * DATAGRAM_SLOTSIZE;
+		messages[i].msg_hdr.msg_iov = &segments[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+		messages[i].msg_hdr.msg_name = &senders[i];
+		messages[i].msg_hdr.msg_control = controls[i];
+	}
+
+	struct pollfd waitFor[2];
+	waitFor[0].fd = datagramSocket;
+	waitFor[0].events = POLLIN;
+	waitFor[1].fd = stopEvent;
+	waitFor[1].events = POLLIN;
+
+	while (!stopping.load()) {
+		poll(waitFor, 2, -1);
+		pendingSyscalls++;
+
+		int received = DATAGRAM_BATCH;
+
+		// a full batch means there may be more waiting, so keep going until one comes back short
+		while (received == DATAGRAM_BATCH) {
+			// recvmmsg writes the lengths it used into the headers, so every slot is set up again
+			for (int i = 0; i < DATAGRAM_BATCH; i++) {
+				segments[i].iov_len = DATAGRAM_SLOTSIZE;
+				messages[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+				messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+			}
+
+			received = recvmmsg(datagramSocket, messages, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+			pendingSyscalls++;
+			long now = monotonicNanoseconds();
+
+			for (int i = 0; i < received; i++) {
+				const char* slot = (const char*) segments[i].iov_base;
+				long length = messages[i].msg_len;
+				long datagramSize = length; // without GRO the slot holds one datagram
+
+				for (struct cmsghdr* control = CMSG_FIRSTHDR(&messages[i].msg_hdr); control != NULL;
+					control = CMSG_NXTHDR(&messages[i].msg_hdr, control)) {
+					if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO) {
+						int size;
+						memcpy(&size, CMSG_DATA(control), sizeof(size));
+						datagramSize = size;
+					}
+				}
+
+				int datagrams = 0;
+				for (long offset = 0; offset < length && datagramSize > 0; offset += datagramSize) {
+					handleDatagram(&table, datagramSocket, slot + offset, min(datagramSize, length - offset), now, &messages[i].msg_hdr);
+					datagrams++;
+				}
+
+				countReceived(length, datagrams);
+			}
+		}
+
+		flushSyscalls();
+	}
+
+	for (map<uint32_t, struct datagramFlow*>::iterator flow = table.flows.begin(); flow != table.flows.end(); flow++) {
+		deleteFlow(flow->second);
+	}
+
+	close(datagramSocket);
+	poolFree(slots, DATAGRAM_BATCH * DATAGRAM_SLOTSIZE);
+	retireThreadRecorders();
+	return NULL;
+}
+
+/*
+ * Waits on the --handoff socket for the server that replaces this one (see handoff.h). Once the new
+ * server has the listening sockets, this one stops the same way it does on SIGTERM, except that the
+ * connections waiting in the backlog are left for the new server.
+ */
+void* runHandoff(void* input) {
+	int handoffSocket = *(int*)input;
+
+	while (1) {
+		int connection = accept(handoffSocket, NULL, NULL);
+
+		if (connection == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue; // nothing wrong with the socket, that one caller just went away
+			}
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+				usleep(100000); // out of descriptors or memory for now, the new server can try again in a moment
+				continue;
+			}
+
+			// anything else will not get better by trying again, so this server just cannot be replaced anymore
+			cout << "handoff socket failed (" << strerror(errno) << "), no longer waiting for a new server" << endl;
+			close(handoffSocket);
+			return NULL;
+		}
+
+		// the lock keeps the loops from closing their listeners while they are being sent. It is not held while
+		// the new server answers, a loop that stops in the meantime must not wait for that
+		pthread_mutex_lock(&listenersLock);
+		size_t count = listeners.size();
+		bool sent = !stopping.load() && sendListeningSockets(connection, listeners);
+		pthread_mutex_unlock(&listenersLock);
+
+		sent = sent && acknowledgeTakeover(connection);
+		if (sent) {
+			handedOff.store(true);
+		}
+
+		close(connection);
+
+		if (sent) {
+			cout << "handed " << count << " listening sockets to a new server" << endl;
+			close(handoffSocket); // the path belongs to the new server now, so it is not unlinked
+			kill(getpid(), SIGTERM); // only waitForStop has it unblocked
+			return NULL;
+		}
+	}
+}
+
+// what retryMetricsEndpoint keeps trying to open
+struct metricsRetry {
+	struct metricsEndpoint* endpoint;
+	const char* where;
+};
+
+/*
+ * A server that took over from another (--takeover) and asks for the same --metrics port cannot open
+ * it until the old server has drained and exited, so this thread tries again every 100 ms until then.
+ */
+void* retryMetricsEndpoint(void* input) {
+	struct metricsRetry* retry = (struct metricsRetry*)input;
+
+	while (!startMetricsEndpoint(retry->endpoint, retry->where)) {
+		usleep(100000);
+	}
+
+	cout << "opened the metrics endpoint at " << retry->where << endl;
+	return NULL;
+}
+
+/*
+ * The program takes the port number (2648) as argv[1]. It used to need the client's iteration count
+ * as argv[2] so it knew how much to read, but the framed messages now say that themselves, so an
+ * argv[2] is still accepted (so old command lines keep working) and ignored.
+ * Optional flags: --mode=thread|epoll|pool|udp, --loops=N (number of event loops in epoll and udp mode), and
+ * --workers=N, --queue=N, --overflow=block|reject|grow for the pool mode, and --backend=read|uring
+ * for the event loops (--backend=uring implies --mode=epoll). --backlog=N sets the listen backlog,
+ * --drain=seconds how long a stopping server waits for open connections, and --handoff=path and
+ * --takeover=path do a hot restart (see handoff.h).
+ */
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		cout << "usage: server port [iterations] [--mode=thread|epoll|pool|udp] [--loops=N] [--workers=N] [--queue=N] [--overflow=block|reject|grow] [--backend=read|uring] [--histogram=file.json|file.csv] [--log=debug|info|warn|error] [--metrics=port|/socket/path] [--hugepages] [--flush-delay=usec] [--sink=/dev/null|file]" << endl;
+		cout << "       [--backlog=N] [--drain=seconds] [--handoff=/socket/path] [--takeover=/socket/path]" << endl;
+		cout << "       [--profile=default|latency|throughput] [--nodelay] [--cork] [--quickack] [--sndbuf=N] [--rcvbuf=N] [--busypoll=usec] [--rcvlowat=N]" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	char* port = argv[1]; // 2648 (last four of my student id)
+	const char* mode = getOption(argc, argv, "mode", "thread");
+	const char* backend = getOption(argc, argv, "backend", "read");
+
+	// the udp mode has no connections to splice from and no listening sockets to hand over
+	if (strcmp(mode, "udp") == 0 && (getOption(argc, argv, "sink", NULL) != NULL || getOption(argc, argv, "handoff", NULL) != NULL
+		|| getOption(argc, argv, "takeover", NULL) != NULL)) {
+		cout << "the udp mode works without --sink, --handoff and --takeover" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// every setting is checked up front, a server taking over from another must not find a bad one after it confirmed
+	if (getOption(argc, argv, "sink", NULL) != NULL && (strcmp(mode, "epoll") == 0 || strcmp(backend, "uring") == 0)) {
+		cout << "the sink works in the thread and pool modes" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	const char* overflow = getOption(argc, argv, "overflow", "block");
+
+	if (strcmp(overflow, "block") != 0 && strcmp(overflow, "reject") != 0 && strcmp(overflow, "grow") != 0) {
+		cout << "overflow must be block, reject or grow" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	int level = parseLogLevel(getOption(argc, argv, "log", "info"));
+	if (level == -1) {
+		cout << "log must be debug, info, warn or error" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (!getSocketProfile(argc, argv, &tuning)) {
+		cout << "profile must be default, latency or throughput" << endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// --sink splices every payload into that file (thread and pool modes) instead of reading it
+	sinkPath = getOption(argc, argv, "sink", NULL);
+
+	if (sinkPath != NULL) {
+		int sink = open(sinkPath, O_WRONLY | O_CREAT, 0644);
+
+		if (sink == -1) {
+			cout << "Could not open the sink " << sinkPath << endl;
 			exit(EXIT_FAILURE);
 		}
+		close(sink);
+	}
+
+	// --flush-delay lets responses wait up to that many microseconds for others to share their write
+	flushDelay = getIntOption(argc, argv, "flush-delay", 0) * 1000L;
+
+	listenBacklog = getIntOption(argc, argv, "backlog", SOMAXCONN);
+
+	// --takeover gets the listening sockets of the server running at that path before anything listens.
+	// that server keeps accepting until confirmTakeover below, so this one can still fail until then
+	const char* takeover = getOption(argc, argv, "takeover", NULL);
+	int takeoverConnection = -1;
+
+	if (takeover != NULL) {
+		takeoverConnection = receiveListeningSockets(takeover, &inheritedListeners);
+
+		if (takeoverConnection == -1) {
+			cout << "Could not take over the listening sockets of the server at " << takeover << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// --hugepages backs the buffer pool (see bufferpool.h) with huge pages when the system has them
+	setPoolHugepages(getOption(argc, argv, "hugepages", NULL) != NULL);
+
+	initRegistry(&messageTimes);
+	initRegistry(&connectionTimes);
+
+	initLogger(&logger, level, STDOUT_FILENO);
+	initStats(&stats);
+	threadLog = registerLogRing(&logger); // main accepts the connections in the thread and pool modes
+	threadStats = registerStats(&stats);
+
+	// block the stop signals before any other thread exists (new threads inherit the mask),
+	// so only the waitForStop thread ever sees them
+	struct stopReport report;
+	report.histogramPath = getOption(argc, argv, "histogram", NULL);
+	report.drainTime = getIntOption(argc, argv, "drain", 10);
+	stopEvent = eventfd(0, EFD_CLOEXEC);
+	sigemptyset(&report.signals);
+	sigaddset(&report.signals, SIGTERM);
+	sigaddset(&report.signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &report.signals, NULL);
+
+	pthread_t stopThread;
+	pthread_create(&stopThread, NULL, waitForStop, (void*) &report);
+
+	// formats and writes what the serving threads log, in batches
+	pthread_t drainThread;
+	pthread_create(&drainThread, NULL, runLogDrain, (void*) &logger);
+	pthread_detach(drainThread);
+
+	struct metricsEndpoint endpoint; // main never returns while the server runs, so this outlives the endpoint thread
+	const char* metrics = getOption(argc, argv, "metrics", NULL);
+	endpoint.registry = &stats;
+	endpoint.socketSyscalls = &socketSyscalls;
+
+	struct metricsRetry retry;
+	retry.endpoint = &endpoint;
+	retry.where = metrics;
+
+	if (metrics != NULL && !startMetricsEndpoint(&endpoint, metrics)) {
+		if (takeover == NULL) {
+			cout << "Could not open the metrics endpoint at " << metrics << endl;
+			exit(EXIT_FAILURE);
+		}
+
+		// the server being replaced holds the port until it is done draining, and it only starts that once we confirm
+		cout << "the metrics endpoint at " << metrics << " is still in use, opening it once the old server lets go of it" << endl;
+		pthread_t retryThread;
+		pthread_create(&retryThread, NULL, retryMetricsEndpoint, (void*) &retry);
+		pthread_detach(retryThread);
+	}
+
+	// --handoff waits at that path for a server started with --takeover to replace this one
+	const char* handoff = getOption(argc, argv, "handoff", NULL);
+	int handoffSocket = -1; // main only returns by exiting, so the handoff thread can keep a pointer to this
+
+	if (handoff != NULL) {
+		handoffSocket = openHandoffSocket(handoff);
+
+		if (handoffSocket == -1) {
+			cout << "Could not open the handoff socket at " << handoff << endl;
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_t handoffThread;
+		pthread_create(&handoffThread, NULL, runHandoff, (void*) &handoffSocket);
+		pthread_detach(handoffThread);
+	}
+
+	// everything that could make this server exit is done, so the one it replaces can stop accepting now
+	if (takeoverConnection != -1) {
+		if (!confirmTakeover(takeoverConnection)) {
+			cout << "The server at " << takeover << " gave up on the takeover and kept its listening sockets" << endl;
+			exit(EXIT_FAILURE);
+		}
+
+		cout << "took over " << inheritedListeners.size() << " listening sockets from the server at " << takeover << endl;
+	}
+
+	// the uring backend only exists as an event loop, so asking for it picks the epoll mode too
+	void* (*loopBody)(void*) = runEventLoop;
+
+	if (strcmp(backend, "uring") == 0) {
+		mode = "epoll";
+#ifdef HAVE_LIBURING
+		if (uringSupported()) {
+			loopBody = runUringLoop;
+		}
+		else {
+			cout << "io_uring is not usable on this kernel, falling back to the read backend" << endl;
+		}
+#else
+		cout << "server was built without liburing, falling back to the read backend" << endl;
+#endif
+	}
+
+	if (strcmp(mode, "udp") == 0) {
+		int loops = getIntOption(argc, argv, "loops", sysconf(_SC_NPROCESSORS_ONLN));
+		if (loops < 1) {
+			loops = 1;
+		}
+
+		cout << "Receiving datagrams on port " << port << " with " << loops << " loops!" << endl;
+		cout << "socket profile = " << describeProfile(&tuning) << endl;
+
+		pthread_t loopThreads[loops];
+		struct eventLoopData loopData;
+		loopData.port = port;
+
+		for (int i = 0; i < loops; i++) {
+			pthread_create(&loopThreads[i], NULL, runDatagramLoop, (void*) &loopData);
+		}
+		for (int i = 0; i < loops; i++) {
+			pthread_join(loopThreads[i], NULL);
+		}
+
+		printStopReport(&report);
+	}
+
+	if (strcmp(mode, "epoll") == 0) {
+		int loops = getIntOption(argc, argv, "loops", sysconf(_SC_NPROCESSORS_ONLN));
+
+		// every loop needs its own listener, so a server that took some over runs one loop per socket
+		if (!inheritedListeners.empty()) {
+			loops = inheritedListeners.size();
+		}
+		if (loops < 1) {
+			loops = 1;
+		}
+
+		cout << "Listening for client connection requests on port " << port << " with " << loops << " event loops!" << endl;
+		cout << "socket profile = " << describeProfile(&tuning) << endl;
+
+		// the loops return once the server has stopped and their last connection is done
+		pthread_t loopThreads[loops];
+		struct eventLoopData loopData;
+		loopData.port = port;
+
+		for (int i = 0; i < loops; i++) {
+			pthread_create(&loopThreads[i], NULL, loopBody, (void*) &loopData);
+		}
+		for (int i = 0; i < loops; i++) {
+			pthread_join(loopThreads[i], NULL);
+		}
+
+		printStopReport(&report);
+	}
+
+	// accepting without blocking lets acceptOrStop wait for the listeners and the stop event together.
+	// every listener taken over with --takeover may have clients waiting in its backlog, so all of them are kept
+	vector<int> serverSockets;
+	serverSockets.push_back(getListeningSocket(port, false, true));
+
+	int inherited;
+	while ((inherited = takeInheritedListener(true)) != -1) {
+		serverSockets.push_back(inherited);
+	}
+
+	// displays that it is listening (just for debugging purposes)
+	cout << "Listening for client connection requests on port " << port << "!" << endl;
+	cout << "socket profile = " << describeProfile(&tuning) << endl;
+
+	if (strcmp(mode, "pool") == 0) {
+		int workers = getIntOption(argc, argv, "workers", 2 * sysconf(_SC_NPROCESSORS_ONLN));
+		int queueDepth = getIntOption(argc, argv, "queue", 1024);
+
+		if (workers < 1) {
+			workers = 1;
+		}
+
+		struct workerPool pool;
+		pool.queue = new MPMCQueue<int>(queueDepth);
+		sem_init(&pool.available, 0, 0);
+		pthread_mutex_init(&pool.spilloverLock, NULL);
+
+		vector<pthread_t> workerThreads(workers);
+
+		for (int i = 0; i < workers; i++) {
+			pthread_create(&workerThreads[i], NULL, runWorker, (void*) &pool);
+		}
+
+		long rejected = 0; // connections closed by the reject policy
+		int clientSocketDescriptor;
+
+		while ((clientSocketDescriptor = acceptOrStop(serverSockets)) != -1) {
+			countStat(threadStats, STAT_ACCEPTED, 1);
+			tuneConnection(clientSocketDescriptor);
+			trackConnection(clientSocketDescriptor);
+
+			if (!pool.queue->push(clientSocketDescriptor)) {
+				if (strcmp(overflow, "reject") == 0) {
+					closeConnection(clientSocketDescriptor);
+					rejected++;
+					countStat(threadStats, STAT_REJECTED, 1);
+
+					struct logRecord record;
+					memset(&record, 0, sizeof(record));
+					record.level = LOG_WARN;
+					record.event = EVENT_CONNECTION_REJECTED;
+					record.reads = rejected;
+					appendLog(&logger, threadLog, record);
+					continue;
+				}
+				else if (strcmp(overflow, "grow") == 0) {
+					pthread_mutex_lock(&pool.spilloverLock);
+					pool.spillover.push_back(clientSocketDescriptor);
+					pthread_mutex_unlock(&pool.spilloverLock);
+				}
+				else {
+					// block: stop accepting until a worker frees up a slot, new clients wait in the listen backlog
+					while (!pool.queue->push(clientSocketDescriptor)) {
+						usleep(100);
+					}
+				}
+			}
+
+			sem_post(&pool.available);
+		}
+
+		// the server is stopping: the workers finish what was handed to them and then end
+		for (size_t i = 0; i < serverSockets.size(); i++) {
+			closeListener(serverSockets[i]);
+		}
+		stopWorkers(&pool, workerThreads);
+		printStopReport(&report);
+	}
+
+	// Step 5 - Keep the server running until it is stopped, listening for client connection requests and accepting them
+	// this is done via a loop that only ends when the server stops
+	// to accept client connections, we use the accept function which takes in
+	// 1. the server socket descriptor
+	// 2. a pointer for a sockaddr - the client address. Where the accept function will store the location of this
+	// 3. a pointer to the length of the variable pointed to by the previous argument
+	// returns -1 if cannot accept, and a new file descriptor if it does accept
+
+	// acceptOrStop returns -1 once the server is stopping and the backlog is empty
+	int clientSocketDescriptor;
+
+	while ((clientSocketDescriptor = acceptOrStop(serverSockets)) != -1) {
+		//cout << "recieved request from client address: " << clientAddress.sa_data << endl;
+
+		countStat(threadStats, STAT_ACCEPTED, 1);
+		tuneConnection(clientSocketDescriptor);
+		trackConnection(clientSocketDescriptor);
 
 		//cout << "created socket for client with descriptor: " << clientSocketDescriptor << endl;
 
@@ -214,10 +2514,40 @@ int main(int argc, char** argv) {
 		pthread_t comThread;
 		struct communicationThreadData* data = new communicationThreadData;
 		data->socketDescriptor = clientSocketDescriptor;
-		data->numIterations = iterations;
 
-		pthread_create(&comThread, NULL, genResponse, (void*) data);
+		serviceThreads.fetch_add(1);
+		int error = pthread_create(&comThread, NULL, genResponse, (void*) data);
+
+		// out of threads (or memory for their stacks): this connection cannot be served, but the ones after it might be
+		if (error != 0) {
+			serviceThreads.fetch_sub(1);
+			closeConnection(clientSocketDescriptor);
+			delete data;
+
+			struct logRecord record;
+			memset(&record, 0, sizeof(record));
+			record.level = LOG_ERROR;
+			record.event = EVENT_THREAD_FAILED;
+			record.bytes = error;
+			appendLog(&logger, threadLog, record);
+
+			usleep(1000); // give the threads that are running a moment to finish before the next one is tried
+			continue;
+		}
+
+		// nobody ever joins these threads, so detach them to have their stacks freed as soon as they finish
+		pthread_detach(comThread);
+	}
+
+	// the server is stopping: wait for every connection thread to finish (waitForStop cuts them off at the deadline)
+	for (size_t i = 0; i < serverSockets.size(); i++) {
+		closeListener(serverSockets[i]);
 	}
 
+	while (serviceThreads.load() > 0) {
+		usleep(1000);
+	}
+
+	printStopReport(&report);
 	return 0;
-}
\ No newline at end of file
+}
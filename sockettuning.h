@@ -0,0 +1,163 @@
+/*
+ * Socket Tuning File Description:
+ * Socket option profiles that both programs can apply to their connections. A profile is picked
+ * with --profile=name and any single option can be changed on top of it with its own flag:
+ *
+ *   default    - the kernel's settings, nothing is changed
+ *   latency    - TCP_NODELAY (no Nagle), TCP_QUICKACK (no delayed acks) and SO_BUSY_POLL for 50 usec
+ *   throughput - MSG_MORE on multi-buffer sends (corks the buffers of a message into full segments)
+ *                and 4 MB send and receive buffers
+ *
+ *   --nodelay, --cork, --quickack (on/off, =0 turns one off), --sndbuf=bytes, --rcvbuf=bytes,
+ *   --busypoll=usec, --rcvlowat=bytes
+ *
+ * SO_RCVLOWAT makes a read wait until that many bytes are there, so it must not be bigger than the
+ * smallest message or the read for the last message never returns. Raising SO_BUSY_POLL above the
+ * net.core.busy_read sysctl needs CAP_NET_ADMIN; options the kernel refuses are reported once.
+ * TCP_QUICKACK does not stick (the kernel turns it off again on its own), so the server sets it
+ * again after every read when it is on.
+ */
+#ifndef SOCKETTUNING_H
+#define SOCKETTUNING_H
+
+#include <sys/socket.h>   // setsockopt, SO_SNDBUF, SO_RCVBUF, SO_BUSY_POLL, SO_RCVLOWAT
+#include <netinet/in.h>   // IPPROTO_TCP
+#include <netinet/tcp.h>  // TCP_NODELAY, TCP_QUICKACK
+
+#include <string>
+#include <cstring>
+
+#include "options.h"
+
+struct socketProfile {
+	const char* name;
+	bool noDelay;
+	bool cork; // send the buffers of a message with MSG_MORE so they leave as full segments
+	bool quickAck;
+	int sendBuffer; // bytes, 0 leaves the kernel's default
+	int receiveBuffer;
+	int busyPoll; // usec, 0 leaves it off
+	int receiveLowWater; // bytes, 0 leaves the kernel's default of 1
+};
+
+/*
+ * Builds the profile asked for on the command line. Returns false if --profile names a profile
+ * that does not exist.
+ */
+inline bool getSocketProfile(int argc, char** argv, struct socketProfile* profile) {
+	memset(profile, 0, sizeof(*profile));
+	profile->name = getOption(argc, argv, "profile", "default");
+
+	if (strcmp(profile->name, "latency") == 0) {
+		profile->noDelay = true;
+		profile->quickAck = true;
+		profile->busyPoll = 50;
+	}
+	else if (strcmp(profile->name, "throughput") == 0) {
+		profile->cork = true;
+		profile->sendBuffer = 4 * 1024 * 1024;
+		profile->receiveBuffer = 4 * 1024 * 1024;
+	}
+	else if (strcmp(profile->name, "default") != 0) {
+		return false;
+	}
+
+	profile->noDelay = getIntOption(argc, argv, "nodelay", profile->noDelay) != 0;
+	profile->cork = getIntOption(argc, argv, "cork", profile->cork) != 0;
+	profile->quickAck = getIntOption(argc, argv, "quickack", profile->quickAck) != 0;
+	profile->sendBuffer = getIntOption(argc, argv, "sndbuf", profile->sendBuffer);
+	profile->receiveBuffer = getIntOption(argc, argv, "rcvbuf", profile->receiveBuffer);
+	profile->busyPoll = getIntOption(argc, argv, "busypoll", profile->busyPoll);
+	profile->receiveLowWater = getIntOption(argc, argv, "rcvlowat", profile->receiveLowWater);
+
+	return true;
+}
+
+// the profile's name followed by every option it turns on, for the programs' reports
+inline std::string describeProfile(const struct socketProfile* profile) {
+	std::string text = profile->name;
+	std::string options;
+
+	if (profile->noDelay) {
+		options += " nodelay";
+	}
+	if (profile->cork) {
+		options += " cork";
+	}
+	if (profile->quickAck) {
+		options += " quickack";
+	}
+	if (profile->sendBuffer > 0) {
+		options += " sndbuf=" + std::to_string(profile->sendBuffer);
+	}
+	if (profile->receiveBuffer > 0) {
+		options += " rcvbuf=" + std::to_string(profile->receiveBuffer);
+	}
+	if (profile->busyPoll > 0) {
+		options += " busypoll=" + std::to_string(profile->busyPoll);
+	}
+	if (profile->receiveLowWater > 0) {
+		options += " rcvlowat=" + std::to_string(profile->receiveLowWater);
+	}
+
+	return options.empty() ? text : text + " (" + options.substr(1) + ")";
+}
+
+/*
+ * Sets the buffer sizes, which have to be in place before connect() or listen() to change the
+ * window the connection starts with. Returns the name of the first option the kernel refused, or
+ * NULL if all of them worked.
+ */
+inline const char* applyBufferSizes(int socketDescriptor, const struct socketProfile* profile) {
+	const char* failed = NULL;
+
+	if (profile->sendBuffer > 0
+		&& setsockopt(socketDescriptor, SOL_SOCKET, SO_SNDBUF, &profile->sendBuffer, sizeof(int)) == -1) {
+		failed = "SO_SNDBUF";
+	}
+	if (profile->receiveBuffer > 0
+		&& setsockopt(socketDescriptor, SOL_SOCKET, SO_RCVBUF, &profile->receiveBuffer, sizeof(int)) == -1 && failed == NULL) {
+		failed = "SO_RCVBUF";
+	}
+
+	return failed;
+}
+
+/*
+ * Applies every option of the profile to a connected (or about to be connected) socket. Returns
+ * the name of the first option the kernel refused, or NULL if all of them worked.
+ */
+inline const char* applySocketProfile(int socketDescriptor, const struct socketProfile* profile) {
+	const char* failed = applyBufferSizes(socketDescriptor, profile);
+	int enable = 1;
+
+	if (profile->noDelay && setsockopt(socketDescriptor, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) == -1 && failed == NULL) {
+		failed = "TCP_NODELAY";
+	}
+	if (profile->quickAck && setsockopt(socketDescriptor, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(int)) == -1 && failed == NULL) {
+		failed = "TCP_QUICKACK";
+	}
+	if (profile->busyPoll > 0
+		&& setsockopt(socketDescriptor, SOL_SOCKET, SO_BUSY_POLL, &profile->busyPoll, sizeof(int)) == -1 && failed == NULL) {
+		failed = "SO_BUSY_POLL";
+	}
+	if (profile->receiveLowWater > 0
+		&& setsockopt(socketDescriptor, SOL_SOCKET, SO_RCVLOWAT, &profile->receiveLowWater, sizeof(int)) == -1 && failed == NULL) {
+		failed = "SO_RCVLOWAT";
+	}
+
+	return failed;
+}
+
+// turns TCP_QUICKACK back on after a read if the profile wants it, returns true if that took a syscall
+inline bool rearmQuickAck(int socketDescriptor, const struct socketProfile* profile) {
+	if (!profile->quickAck) {
+		return false;
+	}
+
+	int enable = 1;
+	setsockopt(socketDescriptor, IPPROTO_TCP, TCP_QUICKACK, &enable, sizeof(int));
+	return true;
+}
+
+#endif
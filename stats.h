@@ -0,0 +1,287 @@
+/*
+ * Stats File Description:
+ * Live counters for the server and a small endpoint that serves them in the Prometheus text format,
+ * so throughput and reads per message can be watched while the server is under load.
+ *
+ * Every thread that serves clients owns a statCounters block. Only the owning thread writes it, so
+ * bumping a counter is a plain load and store (no lock and no locked instruction), and the block is
+ * padded to its own cache line so threads never slow each other down by writing neighbouring
+ * counters. A scrape simply reads every block and adds them up.
+ *
+ * The endpoint is started with --metrics=port (plain HTTP on 127.0.0.1, try curl localhost:port/metrics)
+ * or --metrics=/path/to/socket (the same HTTP over a Unix socket, try curl --unix-socket path localhost/).
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>    // socket
+#include <sys/socket.h>   // socket, bind, listen, accept
+#include <sys/un.h>       // sockaddr_un
+#include <netinet/in.h>   // sockaddr_in
+#include <arpa/inet.h>    // htons, htonl
+#include <unistd.h>       // read, close, unlink, usleep
+#include <pthread.h>      // pthread_mutex_lock
+#include <time.h>         // clock_gettime
+#include <sys/time.h>     // timeval
+#include <errno.h>        // errno, EINTR
+#include <stdio.h>        // snprintf
+#include <stdlib.h>       // atoi
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstring>
+
+// the counters of one thread, they only ever go up
+enum statCounter {
+	STAT_ACCEPTED, // connections accepted
+	STAT_ACCEPT_FAILURES, // accept calls (or io_uring accept completions) that failed
+	STAT_REJECTED, // connections closed right away because the pool's queue was full
+	STAT_OPENED, // connections this thread started serving
+	STAT_CLOSED, // connections this thread finished with, so opened - closed are active
+	STAT_BYTES, // bytes received
+	STAT_READS, // read calls (or receive completions) that returned data
+	STAT_MESSAGES, // complete messages parsed
+	STAT_COUNTERS // how many there are
+};
+
+struct alignas(64) statCounters {
+	std::atomic<long> values[STAT_COUNTERS];
+};
+
+/*
+ * Keeps track of every thread's counters. The lock is only taken to register or retire a block and
+ * while a scrape walks the list, never to count. A retired block (its thread is gone) is added into
+ * retired so the memory can be freed and the totals still only go up.
+ */
+struct statRegistry {
+	pthread_mutex_t lock;
+	std::vector<struct statCounters*> live;
+	long retired[STAT_COUNTERS];
+};
+
+inline void initStats(struct statRegistry* registry) {
+	pthread_mutex_init(&registry->lock, NULL);
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		registry->retired[i] = 0;
+	}
+}
+
+inline struct statCounters* registerStats(struct statRegistry* registry) {
+	struct statCounters* counters = new statCounters;
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		counters->values[i].store(0, std::memory_order_relaxed);
+	}
+
+	pthread_mutex_lock(&registry->lock);
+	registry->live.push_back(counters);
+	pthread_mutex_unlock(&registry->lock);
+
+	return counters;
+}
+
+inline void retireStats(struct statRegistry* registry, struct statCounters* counters) {
+	pthread_mutex_lock(&registry->lock);
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		registry->retired[i] += counters->values[i].load(std::memory_order_relaxed);
+	}
+	for (size_t i = 0; i < registry->live.size(); i++) {
+		if (registry->live[i] == counters) {
+			registry->live.erase(registry->live.begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry->lock);
+
+	delete counters;
+}
+
+// adds amount to one counter, must only be called by the thread that owns counters
+inline void countStat(struct statCounters* counters, int counter, long amount) {
+	std::atomic<long>& value = counters->values[counter];
+	value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// adds up every thread's counters into totals
+inline void collectStats(struct statRegistry* registry, long* totals) {
+	pthread_mutex_lock(&registry->lock);
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		totals[i] = registry->retired[i];
+		for (size_t j = 0; j < registry->live.size(); j++) {
+			totals[i] += registry->live[j]->values[i].load(std::memory_order_relaxed);
+		}
+	}
+	pthread_mutex_unlock(&registry->lock);
+}
+
+// what the endpoint thread needs
+struct metricsEndpoint {
+	struct statRegistry* registry;
+	std::atomic<long>* socketSyscalls; // the server's syscall total, reported alongside the counters
+	int listenSocket;
+	long lastTotals[STAT_COUNTERS]; // totals at the previous scrape, for the per second rates
+	long lastScrape; // monotonic nanoseconds of the previous scrape
+};
+
+/*
+ * Opens the endpoint's listening socket: a path (anything starting with '/') is a Unix socket,
+ * anything else a TCP port on 127.0.0.1. Returns the socket or -1.
+ */
+inline int openMetricsSocket(const char* where) {
+	int sd;
+
+	if (where[0] == '/') {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, where, sizeof(address.sun_path) - 1);
+
+		sd = socket(AF_UNIX, SOCK_STREAM, 0);
+		unlink(where); // left over from an earlier run
+		if (sd == -1 || bind(sd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+			close(sd);
+			return -1;
+		}
+	}
+	else {
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(atoi(where));
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		sd = socket(AF_INET, SOCK_STREAM, 0);
+		int yes = 1;
+		if (sd == -1 || setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1
+			|| bind(sd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+			close(sd); // a server waiting for the port (see retryMetricsEndpoint in server.cpp) tries this again and again
+			return -1;
+		}
+	}
+
+	if (listen(sd, 16) == -1) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+// appends one metric with its HELP and TYPE lines
+inline void appendMetric(std::string& out, const char* name, const char* type, const char* help, double value) {
+	char line[512];
+	snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+	out += line;
+}
+
+// the whole page for one scrape
+inline std::string formatMetrics(struct metricsEndpoint* endpoint) {
+	long totals[STAT_COUNTERS];
+	collectStats(endpoint->registry, totals);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long nowNanoseconds = now.tv_sec * 1000000000L + now.tv_nsec;
+	double seconds = (nowNanoseconds - endpoint->lastScrape) / 1e9;
+
+	std::string out;
+	appendMetric(out, "server_connections_active", "gauge", "Connections being served right now.", totals[STAT_OPENED] - totals[STAT_CLOSED]);
+	appendMetric(out, "server_connections_accepted_total", "counter", "Connections accepted.", totals[STAT_ACCEPTED]);
+	appendMetric(out, "server_connections_rejected_total", "counter", "Connections closed because the pool queue was full.", totals[STAT_REJECTED]);
+	appendMetric(out, "server_accept_failures_total", "counter", "Failed accept calls.", totals[STAT_ACCEPT_FAILURES]);
+	appendMetric(out, "server_received_bytes_total", "counter", "Bytes received from clients.", totals[STAT_BYTES]);
+	appendMetric(out, "server_reads_total", "counter", "Reads that returned data.", totals[STAT_READS]);
+	appendMetric(out, "server_messages_total", "counter", "Complete messages received.", totals[STAT_MESSAGES]);
+	appendMetric(out, "server_socket_syscalls_total", "counter", "Socket syscalls made serving clients.", endpoint->socketSyscalls->load(std::memory_order_relaxed));
+	appendMetric(out, "server_reads_per_message", "gauge", "Reads per complete message since the server started.",
+		totals[STAT_MESSAGES] == 0 ? 0 : (double) totals[STAT_READS] / totals[STAT_MESSAGES]);
+
+	// rates since the previous scrape, for a quick look without a Prometheus server doing rate()
+	appendMetric(out, "server_accepted_per_second", "gauge", "Connections accepted per second since the previous scrape.",
+		(totals[STAT_ACCEPTED] - endpoint->lastTotals[STAT_ACCEPTED]) / seconds);
+	appendMetric(out, "server_received_bytes_per_second", "gauge", "Bytes received per second since the previous scrape.",
+		(totals[STAT_BYTES] - endpoint->lastTotals[STAT_BYTES]) / seconds);
+
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		endpoint->lastTotals[i] = totals[i];
+	}
+	endpoint->lastScrape = nowNanoseconds;
+
+	return out;
+}
+
+/*
+ * Body of the endpoint thread. Serves one scrape at a time: reads the request (whatever it asks for,
+ * the answer is the same page) and writes an HTTP/1.0 response, then closes the connection. Each
+ * scrape gets METRICS_TIMEOUT to send its request and take the page, so a client that connects and
+ * then does nothing cannot hold up everyone else.
+ */
+const int METRICS_TIMEOUT = 1; // seconds
+
+inline void* runMetricsEndpoint(void* input) {
+	struct metricsEndpoint* endpoint = (struct metricsEndpoint*)input;
+
+	while (1) {
+		int client = accept(endpoint->listenSocket, NULL, NULL);
+
+		if (client == -1) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				usleep(100000); // out of descriptors or memory for now, trying again right away would just spin
+			}
+			continue;
+		}
+
+		struct timeval timeout;
+		timeout.tv_sec = METRICS_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		char request[1024];
+		if (read(client, request, sizeof(request)) <= 0) { // a scraper sends its whole request in one small packet
+			close(client); // it hung up or sent nothing in time
+			continue;
+		}
+
+		std::string body = formatMetrics(endpoint);
+		std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+			+ std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+		size_t written = 0;
+		while (written < response.size()) {
+			// MSG_NOSIGNAL so a scraper that hung up does not kill the server with SIGPIPE
+			long bytes = send(client, response.data() + written, response.size() - written, MSG_NOSIGNAL);
+			if (bytes <= 0) {
+				break;
+			}
+			written += bytes;
+		}
+
+		close(client);
+	}
+
+	return NULL;
+}
+
+// opens the endpoint and starts its thread, returns false if the socket could not be opened
+inline bool startMetricsEndpoint(struct metricsEndpoint* endpoint, const char* where) {
+	endpoint->listenSocket = openMetricsSocket(where);
+
+	if (endpoint->listenSocket == -1) {
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	endpoint->lastScrape = now.tv_sec * 1000000000L + now.tv_nsec;
+	for (int i = 0; i < STAT_COUNTERS; i++) {
+		endpoint->lastTotals[i] = 0;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, runMetricsEndpoint, (void*) endpoint);
+	pthread_detach(thread);
+	return true;
+}
+
+#endif